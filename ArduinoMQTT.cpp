@@ -1,4 +1,6 @@
 // This file is here to help the Arduino IDE find the other files.
 
 #include "src/MQTT.cpp"
-#include "src/PubSubClient.cpp"
\ No newline at end of file
+#include "src/PubSubClient.cpp"
+#include "src/PosixClient.cpp"
+#include "src/PubSubGateway.cpp"
\ No newline at end of file
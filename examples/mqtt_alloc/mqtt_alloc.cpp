@@ -0,0 +1,100 @@
+/*
+ Checking that steady-state traffic never touches the heap
+
+  - replaces malloc() and friends with counting versions (glibc only)
+  - connects to an MQTT server, subscribes to "bench/alloc" and warms up
+  - then publishes with QoS 0 and 1, with RAM and F() topics, receives
+    the messages back and subscribes / unsubscribes again, all through
+    the const char * API
+  - exits with status 1 if any of that allocated memory
+
+  Build with MQTT_HOST_BUILD defined, see the Makefile.
+
+  usage: mqtt_alloc [host] [rounds]
+*/
+
+#include <Arduino.h>
+#include <ArduinoMQTT.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+unsigned long allocations = 0;
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    allocations++;
+    return __libc_realloc(p, size);
+}
+}
+
+unsigned long received = 0;
+
+void callback(const MQTT::Publish &pub, void *) {
+    received++;
+}
+
+// One round of everything the client does in steady state
+bool round(PubSubClient &client) {
+    static const uint8_t payload[] = "0123456789abcdef";
+
+    if (!client.publish("bench/alloc", payload, 16))
+        return false;
+    if (!client.publish(F("bench/alloc"), payload, 16))
+        return false;
+
+    MQTT::Publish pub(MQTT::TopicRef("bench/alloc"), (uint8_t *) payload, 16);
+    pub.set_qos(1, client.next_packet_id());
+    if (!client.publish(pub))
+        return false;
+
+    if (!client.subscribe("bench/alloc/other") || !client.unsubscribe("bench/alloc/other"))
+        return false;
+
+    client.loop(1000);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = argc > 1 ? argv[1] : "localhost";
+    int rounds = argc > 2 ? atoi(argv[2]) : 1000;
+
+    PubSubClient client{String(host)};
+    client.set_callback(callback);
+    if (!client.connect("allocClient") || !client.subscribe("bench/alloc")) {
+        fprintf(stderr, "connect failed\n");
+        return 1;
+    }
+
+    // Anything allocated once, e.g. stdio buffers, happens here
+    printf("warming up\n");
+    for (int i = 0; i < 10; i++)
+        round(client);
+
+    unsigned long before = allocations;
+    for (int i = 0; i < rounds; i++) {
+        if (!round(client)) {
+            fprintf(stderr, "round %d failed\n", i);
+            return 1;
+        }
+    }
+    unsigned long count = allocations - before;
+
+    printf("%d rounds, %lu messages received, %lu allocations\n", rounds, received, count);
+    client.disconnect();
+    return count == 0 ? 0 : 1;
+}
@@ -0,0 +1,82 @@
+/*
+ C++20 coroutines on a single thread
+
+  - connects to an MQTT server and subscribes to "inTopic" with co_await
+  - then starts a large number of jobs, each publishing to "outTopic"
+    with QoS 1 or 2 and waiting for its own PUBACK / PUBCOMP
+  - all jobs are in flight at once; the only thing driving them is
+    client.loop() handing incoming acks to whoever is waiting
+
+  Build with MQTT_HOST_BUILD defined and -std=c++20, see the Makefile.
+
+  usage: mqtt_coroutines [host] [jobs]
+*/
+
+#include <Arduino.h>
+#include <ArduinoMQTT.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int running = 0, succeeded = 0;
+bool done = false;
+
+// Taking the client as first parameter puts this frame in the client's pool too
+MQTT::Task<> job(PubSubClient &client, int n) {
+    char payload[16];
+    snprintf(payload, sizeof(payload), "job %d", n);
+
+    MQTT::Publish pub("outTopic", payload);
+    pub.set_qos(n % 2 ? 1 : 2, client.next_packet_id());
+
+    bool ok = co_await client.co_publish(pub);
+    if (ok)
+        succeeded++;
+    running--;
+}
+
+MQTT::Task<> session(PubSubClient &client, int jobs) {
+    bool ok = co_await client.co_connect("coroutineClient");
+    if (!ok) {
+        fprintf(stderr, "connect failed\n");
+        done = true;
+        co_return;
+    }
+
+    ok = co_await client.co_subscribe("inTopic", 1);
+    if (!ok)
+        fprintf(stderr, "subscribe failed\n");
+
+    for (int n = 0; n < jobs; n++) {
+        running++;
+        job(client, n).start();
+    }
+    done = true;
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = argc > 1 ? argv[1] : "localhost";
+    int jobs = argc > 2 ? atoi(argv[2]) : 1000;
+
+    // Every job holds a packet id until its exchange completes
+    if (jobs > MQTT_MAX_INFLIGHT)
+        jobs = MQTT_MAX_INFLIGHT;
+
+    PubSubClient client{String(host)};
+
+    unsigned long start = micros();
+    session(client, jobs).start();
+
+    // Everything above is suspended by now, loop() resumes it as responses come in
+    while (!done || running > 0) {
+        if (client.loop(1000) < 0 && !client.connected()) {
+            if (done)
+                break;
+        }
+    }
+    unsigned long elapsed = micros() - start;
+
+    printf("%d/%d publishes acknowledged in %lu ms\n", succeeded, jobs, elapsed / 1000);
+    client.disconnect();
+    return 0;
+}
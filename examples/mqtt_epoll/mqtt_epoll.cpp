@@ -0,0 +1,106 @@
+/*
+ Driving clients from epoll on a Linux host
+
+  - connects a number of clients to an MQTT server
+  - subscribes each one to "inTopic"
+  - sleeps in epoll_wait() until a socket is readable/writable or
+    the earliest client timer (keepalive etc.) is due
+  - prints the process CPU time every 10 seconds, which stays near
+    zero while idle and grows with the incoming message rate
+
+  Build with MQTT_HOST_BUILD defined, see the Makefile.
+
+  usage: mqtt_epoll [host] [clients]
+*/
+
+#include <Arduino.h>
+#include <ArduinoMQTT.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define MAX_CLIENTS 64
+
+PubSubClient *clients[MAX_CLIENTS];
+uint32_t events[MAX_CLIENTS];
+unsigned long received = 0;
+
+void callback(const MQTT::Publish &pub, void *pdata) {
+    received++;
+}
+
+// Register or update a client's socket with the interest it currently has
+void watch(int ep, int i, int op) {
+    struct epoll_event ev;
+    ev.events = (uint32_t) EPOLLIN | (clients[i]->wants_write() ? (uint32_t) EPOLLOUT : 0);
+    ev.data.u32 = i;
+    if (op == EPOLL_CTL_MOD && ev.events == events[i])
+        return;
+    events[i] = ev.events;
+    epoll_ctl(ep, op, clients[i]->fd(), &ev);
+}
+
+double cpu_seconds(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = argc > 1 ? argv[1] : "localhost";
+    int count = argc > 2 ? atoi(argv[2]) : 1;
+    if (count < 1 || count > MAX_CLIENTS)
+        count = 1;
+
+    int ep = epoll_create1(0);
+
+    for (int i = 0; i < count; i++) {
+        char id[24];
+        snprintf(id, sizeof(id), "epollClient%d", i);
+
+        clients[i] = new PubSubClient(String(host));
+        clients[i]->set_callback(callback);
+        if (!clients[i]->connect(id)) {
+            fprintf(stderr, "%s: connect failed\n", id);
+            return 1;
+        }
+        clients[i]->subscribe("inTopic");
+        watch(ep, i, EPOLL_CTL_ADD);
+    }
+
+    unsigned long report = millis();
+    double cpu = cpu_seconds();
+
+    while (true) {
+        unsigned long wait_ms = MQTT_NO_DEADLINE;
+        for (int i = 0; i < count; i++)
+            wait_ms = min(wait_ms, clients[i]->on_timeout());
+        wait_ms = min(wait_ms, 10000UL);
+
+        struct epoll_event ready[MAX_CLIENTS];
+        int n = epoll_wait(ep, ready, MAX_CLIENTS, (int) wait_ms);
+
+        for (int k = 0; k < n; k++) {
+            int i = ready[k].data.u32;
+            if (ready[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                if (clients[i]->on_readable() < 0) {
+                    fprintf(stderr, "client %d disconnected\n", i);
+                    return 1;
+                }
+            }
+            if (ready[k].events & EPOLLOUT)
+                clients[i]->on_writable();
+            watch(ep, i, EPOLL_CTL_MOD);
+        }
+
+        if (millis() - report >= 10000) {
+            double now = cpu_seconds();
+            printf("%lu messages, %.3f s CPU in the last %lu ms\n", received, now - cpu, millis() - report);
+            received = 0;
+            cpu = now;
+            report = millis();
+        }
+    }
+}
@@ -0,0 +1,98 @@
+/*
+ Gateway benchmark: many clients sharded over worker threads
+
+  - adds a number of clients to a PubSubGateway
+  - each worker connects its own share of them and then publishes
+    to "bench/<client>" on all of them as fast as it can
+  - reports connections per second and messages per second
+
+  Run it with 1, 2, 4... workers against a local broker to see how
+  both rates scale with cores. Build with MQTT_HOST_BUILD defined,
+  see the Makefile.
+
+  usage: mqtt_gateway [host] [clients] [workers] [seconds]
+*/
+
+#include <Arduino.h>
+#include <ArduinoMQTT.h>
+#include <PubSubGateway.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_WORKERS 64
+
+// One counter per worker, padded so workers never share a cache line
+struct counter_t {
+    unsigned long sent;
+    char pad[64 - sizeof(unsigned long)];
+} sent[MAX_WORKERS];
+
+// Set once the connection phase is over, connecting is not timed under publish load
+std::atomic<bool> publishing(false);
+
+bool tick(PubSubGateway &gateway, size_t worker, void *data) {
+    const char *payload = "0123456789abcdef";
+    if (!publishing.load(std::memory_order_relaxed))
+        return false;
+
+    for (size_t k = 0; k < gateway.shard_size(worker); k++) {
+        PubSubClient &client = gateway.shard_client(worker, k);
+        if (client.publish("bench/gateway", (const uint8_t *) payload, 16))
+            sent[worker].sent++;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = argc > 1 ? argv[1] : "localhost";
+    int count = argc > 2 ? atoi(argv[2]) : 100;
+    int workers = argc > 3 ? atoi(argv[3]) : 0;
+    int seconds = argc > 4 ? atoi(argv[4]) : 10;
+
+    PubSubGateway gateway(workers);
+    gateway.set_tick(tick);
+    if (gateway.workers() > MAX_WORKERS) {
+        fprintf(stderr, "at most %d workers\n", MAX_WORKERS);
+        return 1;
+    }
+
+    PubSubClient **clients = new PubSubClient *[count];
+    for (int i = 0; i < count; i++) {
+        char id[24];
+        snprintf(id, sizeof(id), "gateway%d", i);
+        clients[i] = new PubSubClient(String(host));
+        gateway.add_client(*clients[i], String(id));
+    }
+
+    unsigned long start = millis();
+    gateway.start();
+
+    // Connection rate: time until every worker has connected its share
+    unsigned long connected = 0;
+    while (connected < (unsigned long) count && millis() - start < 30000UL) {
+        usleep(1000);
+        connected = 0;
+        for (size_t w = 0; w < gateway.workers(); w++)
+            connected += gateway.stats(w).connected;
+    }
+    unsigned long connect_ms = millis() - start;
+    publishing = true;
+
+    unsigned long before = 0;
+    for (size_t w = 0; w < gateway.workers(); w++)
+        before += sent[w].sent;
+
+    sleep(seconds);
+
+    unsigned long after = 0;
+    for (size_t w = 0; w < gateway.workers(); w++)
+        after += sent[w].sent;
+    gateway.stop();
+
+    printf("%zu workers, %lu/%d clients connected in %lu ms (%.0f conn/s)\n",
+           gateway.workers(), connected, count, connect_ms, connected * 1000.0 / max(connect_ms, 1UL));
+    printf("%lu messages in %d s (%.0f msg/s)\n", after - before, seconds, (after - before) / (double) seconds);
+    return 0;
+}
@@ -0,0 +1,120 @@
+/*
+ Reading a JSON command in the callback with JsonReader versus a DOM parser
+
+  - hands the same command payload to a callback-shaped handler many times
+  - the JsonReader handler looks up four fields, one nested and one in an
+    array, straight from pub.payload()
+  - the DOM handlers copy the payload first, as callbacks usually do, and
+    parse all of it with ArduinoJson and / or jsoncpp, if they were found
+    at build time
+  - reports the time per message for each
+
+  Build with MQTT_HOST_BUILD defined, see the Makefile.
+
+  usage: mqtt_json [messages]
+*/
+
+// Ahead of Arduino.h, whose min() and max() macros can upset them
+#if __has_include(<ArduinoJson.h>)
+#include <ArduinoJson.h>
+#define HAVE_ARDUINOJSON
+#endif
+
+#if __has_include(<json/json.h>)
+#include <json/json.h>
+#define HAVE_JSONCPP
+#endif
+
+#include <Arduino.h>
+#include <ArduinoMQTT.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+const char command[] =
+        "{\"id\":\"node-17\",\"seq\":48213,\"cmd\":\"set\","
+        "\"led\":{\"on\":true,\"rgb\":[255,128,0],\"fade_ms\":250},"
+        "\"schedule\":[{\"at\":\"06:30\",\"level\":40},{\"at\":\"22:00\",\"level\":0}],"
+        "\"note\":\"kitchen \\\"main\\\" strip\"}";
+
+struct result_t {
+    bool set;
+    bool on;
+    long green;
+    long fade;
+} result;
+
+volatile long sink;
+
+void handle_reader(const MQTT::Publish &pub) {
+    MQTT::JsonReader json(pub.payload(), pub.payload_len());
+    result.set = json.get("cmd").equals("set");
+    MQTT::JsonReader led = json.get("led");
+    result.on = led.get("on").to_bool();
+    result.green = led.find("rgb.1").to_long();
+    result.fade = led.get("fade_ms").to_long();
+}
+
+#ifdef HAVE_ARDUINOJSON
+void handle_arduinojson(const MQTT::Publish &pub) {
+    char copy[sizeof(command)];
+    memcpy(copy, pub.payload(), pub.payload_len());
+    copy[pub.payload_len()] = 0;
+
+#if ARDUINOJSON_VERSION_MAJOR >= 7
+    JsonDocument doc;
+#else
+    StaticJsonDocument<512> doc;
+#endif
+    if (deserializeJson(doc, copy))
+        return;
+    result.set = strcmp(doc["cmd"] | "", "set") == 0;
+    result.on = doc["led"]["on"];
+    result.green = doc["led"]["rgb"][1];
+    result.fade = doc["led"]["fade_ms"];
+}
+#endif
+
+#ifdef HAVE_JSONCPP
+void handle_jsoncpp(const MQTT::Publish &pub) {
+    std::string copy((const char *) pub.payload(), pub.payload_len());
+
+    Json::CharReaderBuilder builder;
+    Json::Value doc;
+    std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+    if (!reader->parse(copy.data(), copy.data() + copy.size(), &doc, NULL))
+        return;
+    result.set = doc["cmd"].asString() == "set";
+    result.on = doc["led"]["on"].asBool();
+    result.green = doc["led"]["rgb"][1].asInt();
+    result.fade = doc["led"]["fade_ms"].asInt();
+}
+#endif
+
+void run(const char *what, void (*handle)(const MQTT::Publish &), unsigned long messages) {
+    MQTT::Publish pub("cmd/node-17", command);
+    memset(&result, 0, sizeof(result));
+
+    unsigned long start = micros();
+    for (unsigned long i = 0; i < messages; i++) {
+        handle(pub);
+        sink = result.green;
+    }
+    unsigned long elapsed = micros() - start;
+
+    printf("%-12s %7.0f ns/message  (set=%d on=%d green=%ld fade=%ld)\n", what, elapsed * 1000.0 / messages,
+           result.set, result.on, result.green, result.fade);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long messages = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+
+    run("JsonReader", handle_reader, messages);
+#ifdef HAVE_ARDUINOJSON
+    run("ArduinoJson", handle_arduinojson, messages);
+#endif
+#ifdef HAVE_JSONCPP
+    run("jsoncpp", handle_jsoncpp, messages / 10);
+#endif
+    return 0;
+}
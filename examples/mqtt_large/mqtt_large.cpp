@@ -0,0 +1,75 @@
+/*
+ Round trip of payloads far larger than the packet buffer
+
+  - connects to an MQTT server and subscribes to "bench/large"
+  - publishes payloads of 64 KB up to 16 MB to that topic; the payload
+    goes out straight from its own memory, never through the buffer
+  - receives each one back through a chunk callback, checking every byte
+    against the pattern it was filled with
+  - reports the round trip throughput for each size
+
+  Build with MQTT_HOST_BUILD defined, see the Makefile.
+
+  usage: mqtt_large [host]
+*/
+
+#include <Arduino.h>
+#include <ArduinoMQTT.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+uint32_t received = 0, expected = 0;
+bool corrupt = false;
+
+void chunk(const MQTT::Publish &pub, const uint8_t *data, size_t length,
+           uint32_t offset, uint32_t total, void *) {
+    if (total != expected)
+        corrupt = true;
+    for (size_t i = 0; i < length; i++)
+        if (data[i] != (uint8_t) ((offset + i) * 7))
+            corrupt = true;
+    received += length;
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = argc > 1 ? argv[1] : "localhost";
+
+    PubSubClient client{String(host)};
+    client.set_chunk_callback(chunk);
+    if (!client.connect("largeClient") || !client.subscribe("bench/large")) {
+        fprintf(stderr, "connect failed\n");
+        return 1;
+    }
+
+    const uint32_t max_size = 16UL << 20;
+    uint8_t *payload = (uint8_t *) malloc(max_size);
+    for (uint32_t i = 0; i < max_size; i++)
+        payload[i] = (uint8_t) (i * 7);
+
+    for (uint32_t size = 64UL << 10; size <= max_size; size <<= 2) {
+        received = 0;
+        expected = size;
+        corrupt = false;
+
+        unsigned long start = micros();
+        if (!client.publish("bench/large", payload, size)) {
+            fprintf(stderr, "publish of %lu bytes failed\n", (unsigned long) size);
+            return 1;
+        }
+        while (received < size) {
+            if (client.loop(1000) < 0) {
+                fprintf(stderr, "disconnected\n");
+                return 1;
+            }
+        }
+        unsigned long elapsed = micros() - start;
+
+        printf("%8lu bytes: %6lu ms, %7.1f MB/s%s\n", (unsigned long) size, elapsed / 1000,
+               2.0 * size / elapsed, corrupt ? ", CORRUPT" : "");
+    }
+
+    free(payload);
+    client.disconnect();
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ Loopback between modules on the same device
+
+  - a "heater" module subscribes locally to "home/+/temperature" and a
+    "display" module to "home/#"
+  - temperatures are local only and never leave the device, while
+    "home/status" is delivered locally and sent to the server as well
+  - times publish() to callback for a number of local deliveries, which
+    works without a server, then, if one is reachable, the same through
+    the server's round trip for comparison
+
+  Build with MQTT_HOST_BUILD defined, see the Makefile.
+
+  usage: mqtt_loopback [host] [count]
+*/
+
+#include <Arduino.h>
+#include <ArduinoMQTT.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+unsigned long heater = 0, display = 0, remote = 0;
+
+// Each module gets its own callback data, here just a counter
+void module_cb(const MQTT::Publish &pub, void *count) {
+    (*(unsigned long *) count)++;
+}
+
+void server_cb(const MQTT::Publish &pub, void *) {
+    remote++;
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = argc > 1 ? argv[1] : "localhost";
+    unsigned long count = argc > 2 ? atol(argv[2]) : 1000;
+
+    PubSubClient client{String(host)};
+    client.set_callback(server_cb);
+    client.subscribe_local("home/+/temperature", MQTT_LOCAL_ONLY, module_cb, &heater);
+    client.subscribe_local("home/#", MQTT_LOCAL_AND_REMOTE, module_cb, &display);
+
+    unsigned long start = micros();
+    for (unsigned long i = 0; i < count; i++)
+        client.publish("home/kitchen/temperature", "21.5");
+    unsigned long elapsed = micros() - start;
+    printf("local:  %lu publishes, %lu + %lu deliveries, %.3f us each\n",
+           count, heater, display, (double) elapsed / count);
+
+    if (!client.connect("loopbackClient") || !client.subscribe("home/status")) {
+        printf("no MQTT server at %s, skipping the round trip\n", host);
+        return 0;
+    }
+
+    // Delivered to the display right away, and to server_cb once the server echoes it
+    display = 0;
+    start = micros();
+    for (unsigned long i = 0; i < count; i++) {
+        unsigned long want = remote + 1;
+        if (!client.publish("home/status", "on"))
+            break;
+        while (remote < want && client.loop(1000) >= 0)
+            ;
+    }
+    elapsed = micros() - start;
+    printf("remote: %lu publishes, %lu local deliveries, %lu echoes, %.3f us each\n",
+           count, display, remote, (double) elapsed / count);
+
+    client.disconnect();
+    return 0;
+}
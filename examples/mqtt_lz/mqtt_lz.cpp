@@ -0,0 +1,176 @@
+/*
+ LZ compression of bulk telemetry
+
+  - builds three kinds of payload: a waveform capture (12 bit ADC samples
+    of a slightly noisy sine), a text log and random bytes that do not
+    compress, which are sent stored instead
+  - compresses each with an LZEncoder and decompresses it again with an
+    LZDecoder, checking the result, and reports the ratio and the time
+    per KB each way
+  - then, if an MQTT server is reachable, publishes each as an LZPublish
+    to "bench/<name>/lz", compressed as it is written out, and receives it
+    back through a chunk callback, decompressed as it is read
+
+  Build with MQTT_HOST_BUILD and MQTT_LZ defined, see the Makefile.
+
+  usage: mqtt_lz [host] [KB]
+*/
+
+#include <Arduino.h>
+#include <ArduinoMQTT.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const uint8_t *expected;
+uint32_t expected_len, received = 0;
+bool corrupt = false;
+
+void chunk(const MQTT::Publish &pub, const uint8_t *data, size_t length,
+           uint32_t offset, uint32_t total, void *) {
+    if (total != expected_len || offset + length > expected_len ||
+        memcmp(data, expected + offset, length) != 0)
+        corrupt = true;
+    received += length;
+}
+
+void check(const uint8_t *data, size_t length, void *arg) {
+    const uint8_t **p = (const uint8_t **) arg;
+    if (memcmp(data, *p, length) != 0)
+        corrupt = true;
+    *p += length;
+}
+
+size_t make_waveform(uint8_t *buf, size_t size) {
+    size_t n = 0;
+    for (uint32_t i = 0; n + 2 <= size; i++) {
+        // 12 bit ADC, 200 samples per period, an LSB of noise now and then
+        int16_t s = (int16_t) (2048 + 1800 * sin(i * M_PI / 100) + (rand() % 4 == 0));
+        buf[n++] = (uint8_t) s;
+        buf[n++] = (uint8_t) (s >> 8);
+    }
+    return n;
+}
+
+size_t make_log(uint8_t *buf, size_t size) {
+    static const char *levels[] = {"INFO", "INFO", "INFO", "WARN", "DEBUG"};
+    size_t n = 0;
+    char line[128];
+    for (uint32_t i = 0; ; i++) {
+        int len = snprintf(line, sizeof(line), "2024-05-%02u 12:%02u:%02u %s sensor %u: t=%d.%u h=%u%% ok\n",
+                           1 + i / 86400 % 28, i / 60 % 60, i % 60, levels[rand() % 5],
+                           rand() % 4, 18 + rand() % 8, rand() % 10, 40 + rand() % 20);
+        if (n + len > size)
+            break;
+        memcpy(buf + n, line, len);
+        n += len;
+    }
+    return n;
+}
+
+size_t make_random(uint8_t *buf, size_t size) {
+    for (size_t i = 0; i < size; i++)
+        buf[i] = (uint8_t) rand();
+    return size;
+}
+
+void bench(const char *name, const uint8_t *data, size_t len) {
+    static MQTT::LZEncoder encoder;
+    static MQTT::LZDecoder decoder;
+    static uint8_t out[1024];
+    const int rounds = 20;
+
+    unsigned long start = micros();
+    encoder.set_source(data, len);
+    size_t compressed = encoder.length();
+    double size_us = (double) (micros() - start);
+    uint8_t *stream = (uint8_t *) malloc(compressed);
+
+    start = micros();
+    for (int r = 0; r < rounds; r++) {
+        encoder.rewind();
+        size_t pos = 0, n;
+        while ((n = encoder.read(out, sizeof(out))) > 0) {
+            memcpy(stream + pos, out, n);
+            pos += n;
+        }
+    }
+    double enc_us = (double) (micros() - start) / rounds;
+
+    corrupt = false;
+    start = micros();
+    for (int r = 0; r < rounds; r++) {
+        const uint8_t *p = data;
+        decoder.reset();
+        // Fed in network-sized pieces, as the client does
+        for (size_t pos = 0; pos < compressed; pos += 100)
+            decoder.write(stream + pos, min(compressed - pos, (size_t) 100), check, &p);
+        if (!decoder.done() || p != data + len)
+            corrupt = true;
+    }
+    double dec_us = (double) (micros() - start) / rounds;
+
+    // Sizing is a compression run of its own, so publishing costs both
+    printf("%-9s %7lu -> %7lu bytes, ratio %5.2f, size %5.1f + compress %5.1f us/KB, decompress %5.1f us/KB%s\n",
+           name, (unsigned long) len, (unsigned long) compressed, (double) len / compressed,
+           size_us * 1024 / len, enc_us * 1024 / len, dec_us * 1024 / len, corrupt ? ", CORRUPT" : "");
+    free(stream);
+}
+
+bool round_trip(PubSubClient &client, const char *name, const uint8_t *data, size_t len) {
+    char topic[32];
+    snprintf(topic, sizeof(topic), "bench/%s" MQTT_LZ_SUFFIX, name);
+
+    static MQTT::LZPublish *pub;
+    pub = new MQTT::LZPublish(topic, data, len);
+    expected = data;
+    expected_len = len;
+    received = 0;
+    corrupt = false;
+
+    unsigned long start = micros();
+    bool ok = client.publish(*pub);
+    while (ok && received < len)
+        ok = client.loop(1000) >= 0;
+    unsigned long elapsed = micros() - start;
+
+    if (ok)
+        printf("%-9s %7lu bytes sent as %7lu, round trip %6lu us%s\n", name, (unsigned long) len,
+               (unsigned long) pub->payload_len(), elapsed, corrupt ? ", CORRUPT" : "");
+    delete pub;
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = argc > 1 ? argv[1] : "localhost";
+    size_t size = (argc > 2 ? atoi(argv[2]) : 64) * 1024;
+
+    srand(1);
+    uint8_t *wave = (uint8_t *) malloc(size), *log = (uint8_t *) malloc(size), *noise = (uint8_t *) malloc(size);
+    size_t wave_len = make_waveform(wave, size);
+    size_t log_len = make_log(log, size);
+    size_t noise_len = make_random(noise, size);
+
+    printf("window %u bytes, match table %u entries\n", 1 << MQTT_LZ_WINDOW_BITS, 1 << MQTT_LZ_HASH_BITS);
+    bench("waveform", wave, wave_len);
+    bench("log", log, log_len);
+    bench("random", noise, noise_len);
+
+    PubSubClient client{String(host)};
+    client.set_chunk_callback(chunk);
+    if (client.connect("lzClient") && client.subscribe("bench/+" MQTT_LZ_SUFFIX)) {
+        round_trip(client, "waveform", wave, wave_len) &&
+        round_trip(client, "log", log, log_len) &&
+        round_trip(client, "random", noise, noise_len);
+        client.disconnect();
+    } else {
+        printf("no MQTT server at %s, skipping the round trip\n", host);
+    }
+
+    free(wave);
+    free(log);
+    free(noise);
+    return 0;
+}
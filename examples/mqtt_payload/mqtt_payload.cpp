@@ -0,0 +1,101 @@
+/*
+ Formatting telemetry with String versus a PayloadWriter
+
+  - builds the same small JSON document, {"t":21.5,"h":48.2,"n":1234},
+    first by String concatenation and then with a PayloadWriter
+  - times formatting alone, then, if an MQTT server is reachable,
+    formatting and publishing to "bench/payload": the String goes through
+    publish(), which copies it into the TX buffer, while the writer
+    formats straight into the TX buffer between begin_publish() and
+    end_publish()
+
+  Build with MQTT_HOST_BUILD defined, see the Makefile.
+
+  usage: mqtt_payload [host] [messages]
+*/
+
+#include <Arduino.h>
+#include <ArduinoMQTT.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+volatile size_t sink;
+
+String format_string(float t, float h, long n) {
+    String s = "{\"t\":";
+    s += String(t, 1);
+    s += ",\"h\":";
+    s += String(h, 1);
+    s += ",\"n\":";
+    s += String(n);
+    s += "}";
+    return s;
+}
+
+void format_writer(MQTT::PayloadWriter &w, float t, float h, long n) {
+    w.begin_object()
+            .key("t").value(t, 1)
+            .key("h").value(h, 1)
+            .key("n").value(n)
+            .end_object();
+}
+
+void report(const char *what, unsigned long count, unsigned long elapsed) {
+    printf("%-28s %8.0f ns/message, %9.0f messages/s\n", what, elapsed * 1000.0 / count, count * 1e6 / elapsed);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = argc > 1 ? argv[1] : "localhost";
+    unsigned long messages = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+    unsigned long start = micros();
+    for (unsigned long i = 0; i < messages; i++) {
+        String s = format_string(21.5f + (i & 7), 48.2f, (long) i);
+        sink = s.length();
+    }
+    report("String, format only", messages, micros() - start);
+
+    uint8_t buf[MQTT_MAX_PACKET_SIZE];
+    start = micros();
+    for (unsigned long i = 0; i < messages; i++) {
+        MQTT::PayloadWriter w(buf, sizeof(buf));
+        format_writer(w, 21.5f + (i & 7), 48.2f, (long) i);
+        sink = w.length();
+    }
+    report("PayloadWriter, format only", messages, micros() - start);
+
+    PubSubClient client{String(host)};
+    if (!client.connect("payloadClient")) {
+        fprintf(stderr, "no server, skipping the publish runs\n");
+        return 0;
+    }
+
+    messages /= 10;
+    start = micros();
+    for (unsigned long i = 0; i < messages; i++) {
+        String s = format_string(21.5f + (i & 7), 48.2f, (long) i);
+        if (!client.publish("bench/payload", s)) {
+            fprintf(stderr, "publish failed\n");
+            return 1;
+        }
+        client.loop();
+    }
+    report("String, publish()", messages, micros() - start);
+
+    MQTT::PublishTemplate tpl("bench/payload");
+    start = micros();
+    for (unsigned long i = 0; i < messages; i++) {
+        MQTT::PayloadWriter w = client.begin_publish(tpl);
+        format_writer(w, 21.5f + (i & 7), 48.2f, (long) i);
+        if (!client.end_publish(tpl, w)) {
+            fprintf(stderr, "publish failed\n");
+            return 1;
+        }
+        client.loop();
+    }
+    report("PayloadWriter, end_publish()", messages, micros() - start);
+
+    client.disconnect();
+    return 0;
+}
@@ -35,14 +35,9 @@ PubSubClient client(server);
 
 // Callback function
 void callback(const MQTT::Publish &pub, void *pdata) {
-    // In order to republish this payload, a copy must be made
-    // as the orignal payload buffer will be overwritten whilst
-    // constructing the PUBLISH packet.
-
-//    client.publish("outTopic", pub.payload(), pub.payload_len());
-    // Copy the payload to a new message
-    MQTT::BufferedPublish newpub("outTopic", pub.payload(), pub.payload_len());
-    client.publish(newpub);
+    // Incoming packets are kept apart from the buffer outgoing ones are
+    // built in, so the payload can be republished as it is, without a copy.
+    client.publish("outTopic", pub.payload(), pub.payload_len());
 }
 
 void setup() {
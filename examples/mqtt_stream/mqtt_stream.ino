@@ -7,6 +7,8 @@
   - connects to an MQTT server
   - publishes "hello world" to the topic "outTopic"
   - subscribes to the topic "inTopic"
+  - payloads too big for the client's buffer are written straight
+    to the SRAM as they arrive, smaller ones are copied in the callback
 */
 
 #include "Arduino.h"
@@ -30,10 +32,17 @@ IPAddress server(10, 0, 0, 10);
 SRAM sram(4, SRAM_1024);
 
 void callback(const MQTT::Publish& pub, void*pdata) {
+  if (pub.payload_len() == 0) {
+    // A large payload, already streamed to the SRAM
+    Serial.println("payload stored");
+    sram.seek(1);
+    return;
+  }
+
   sram.seek(1);
 
   // do something with the message
-  for (uint8_t i = 0; i < pub.payload_len(); i++) {
+  for (size_t i = 0; i < pub.payload_len(); i++) {
     sram.write(pub.payload()[i]);
     Serial.write(pub.payload()[i]);
   }
@@ -52,6 +61,9 @@ void setup()
   Serial.println();
 
   client.set_callback(callback);
+  client.set_stream(sram);
+  // Payloads that fit the buffer still go to the callback, by default every one is streamed
+  client.set_stream_threshold(MQTT_MAX_PACKET_SIZE);
 
   WiFi.begin(ssid, pass);
 
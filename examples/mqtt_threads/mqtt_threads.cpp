@@ -0,0 +1,84 @@
+/*
+ Publishing from several threads through the lock-free TX queue
+
+  - connects one client to an MQTT server; the main thread owns it
+    and is the only one to call loop()
+  - 1, 2, 4 and 8 producer threads each publish a fixed number of
+    messages with publish_async(), retrying when the queue is full
+  - reports messages per second and how often producers found the
+    queue full, for each producer count
+
+  Build with MQTT_HOST_BUILD defined, see the Makefile.
+
+  usage: mqtt_threads [host] [messages per producer]
+*/
+
+#include <Arduino.h>
+#include <ArduinoMQTT.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+PubSubClient *client;
+std::atomic<unsigned long> full_count(0);
+std::atomic<int> producers_done(0);
+
+void producer(int id, unsigned long messages) {
+    char topic[24];
+    snprintf(topic, sizeof(topic), "bench/threads/%d", id);
+    const char *payload = "0123456789abcdef";
+
+    unsigned long full = 0;
+    for (unsigned long i = 0; i < messages; i++) {
+        while (!client->publish_async(topic, (const uint8_t *) payload, 16)) {
+            full++;
+            std::this_thread::sleep_for(std::chrono::microseconds(20));
+        }
+    }
+    full_count += full;
+    producers_done++;
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = argc > 1 ? argv[1] : "localhost";
+    unsigned long messages = argc > 2 ? strtoul(argv[2], NULL, 10) : 100000;
+
+    client = new PubSubClient(String(host));
+    if (!client->connect("threadsClient")) {
+        fprintf(stderr, "connect failed\n");
+        return 1;
+    }
+
+    for (int producers = 1; producers <= 8; producers *= 2) {
+        full_count = 0;
+        producers_done = 0;
+
+        unsigned long start = micros();
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; p++)
+            threads.push_back(std::thread(producer, p, messages));
+
+        // Owner thread: drain until every producer has finished and the queue is empty
+        while (producers_done < producers || client->wants_write()) {
+            if (client->loop(1000) < 0) {
+                fprintf(stderr, "disconnected\n");
+                return 1;
+            }
+        }
+        unsigned long elapsed = micros() - start;
+
+        for (size_t p = 0; p < threads.size(); p++)
+            threads[p].join();
+
+        unsigned long total = messages * producers;
+        printf("%d producers: %lu messages in %lu ms (%.0f msg/s), queue full %lu times\n",
+               producers, total, elapsed / 1000, total * 1e6 / elapsed, (unsigned long) full_count);
+    }
+
+    client->disconnect();
+    return 0;
+}
@@ -0,0 +1,89 @@
+/*
+ FramePool.h - Fixed-size block allocator for coroutine frames.
+*/
+
+#ifndef FramePool_h
+#define FramePool_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+// MQTT_FRAME_SIZE : Largest coroutine frame served from the pool, bigger ones use the heap
+#define MQTT_FRAME_SIZE 512
+
+// MQTT_FRAME_CHUNK : Frames allocated together whenever the pool runs dry
+#define MQTT_FRAME_CHUNK 32
+
+namespace MQTT {
+    class FramePool {
+    private:
+        union block_t {
+            block_t *next;
+            max_align_t align;
+            uint8_t data[MQTT_FRAME_SIZE];
+        };
+
+        struct chunk_t {
+            chunk_t *next;
+            block_t blocks[MQTT_FRAME_CHUNK];
+        };
+
+        block_t *_free;
+        chunk_t *_chunks;
+
+        // Disallow copies, blocks handed out point back into this pool's chunks
+        FramePool(const FramePool &);
+
+        FramePool &operator=(const FramePool &);
+
+        bool grow(void) {
+            chunk_t *chunk = (chunk_t *) malloc(sizeof(chunk_t));
+            if (chunk == NULL)
+                return false;
+
+            chunk->next = _chunks;
+            _chunks = chunk;
+            for (size_t i = 0; i < MQTT_FRAME_CHUNK; i++) {
+                chunk->blocks[i].next = _free;
+                _free = &chunk->blocks[i];
+            }
+            return true;
+        }
+
+    public:
+        FramePool() : _free(NULL), _chunks(NULL) { }
+
+        ~FramePool() {
+            while (_chunks) {
+                chunk_t *next = _chunks->next;
+                free(_chunks);
+                _chunks = next;
+            }
+        }
+
+        void *allocate(size_t size) {
+            if (size > MQTT_FRAME_SIZE)
+                return malloc(size);
+            if (_free == NULL && !grow())
+                return NULL;
+
+            block_t *block = _free;
+            _free = block->next;
+            return block;
+        }
+
+        void release(void *p, size_t size) {
+            if (size > MQTT_FRAME_SIZE) {
+                free(p);
+                return;
+            }
+
+            block_t *block = (block_t *) p;
+            block->next = _free;
+            _free = block;
+        }
+    };
+}
+
+#endif
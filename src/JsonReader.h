@@ -0,0 +1,404 @@
+/*
+ JsonReader.h - Looks up values in a JSON payload where it lies, without parsing it all.
+*/
+
+#ifndef JsonReader_h
+#define JsonReader_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace MQTT {
+    enum json_type_t {
+        JSON_NONE,      // Missing or malformed
+        JSON_NULL,
+        JSON_BOOL,
+        JSON_NUMBER,
+        JSON_STRING,
+        JSON_ARRAY,
+        JSON_OBJECT
+    };
+
+    // View of one JSON value inside a buffer, e.g. the payload handed to the callback
+    // Each lookup is a forward scan from this value that skips over whatever it is not after
+    // and stops as soon as it has found it. Nothing is copied, allocated or modified, and the
+    // buffer does not need to be terminated. A lookup that fails gives a JSON_NONE value,
+    // which every accessor treats as missing
+    class JsonReader {
+    private:
+        const char *_p;     // First character of the value
+        const char *_end;   // End of the whole buffer
+
+        static bool is_ws(char c) {
+            return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+        }
+
+        static const char *skip_ws(const char *p, const char *end) {
+            while (p < end && is_ws(*p))
+                p++;
+            return p;
+        }
+
+        // p at the opening quote, returns just past the closing one
+        static const char *skip_string(const char *p, const char *end) {
+            for (p++; p < end; p++) {
+                if (*p == '\\')
+                    p++;
+                else if (*p == '"')
+                    return p + 1;
+            }
+            return NULL;
+        }
+
+        // Returns just past the value at p, NULL if it is cut short
+        static const char *skip_value(const char *p, const char *end) {
+            if (p >= end)
+                return NULL;
+
+            if (*p == '"')
+                return skip_string(p, end);
+
+            if (*p == '{' || *p == '[') {
+                size_t depth = 0;
+                while (p < end) {
+                    char c = *p;
+                    if (c == '"') {
+                        p = skip_string(p, end);
+                        if (p == NULL)
+                            return NULL;
+                        continue;
+                    }
+                    if (c == '{' || c == '[')
+                        depth++;
+                    else if ((c == '}' || c == ']') && --depth == 0)
+                        return p + 1;
+                    p++;
+                }
+                return NULL;
+            }
+
+            const char *start = p;
+            while (p < end && *p != ',' && *p != '}' && *p != ']' && !is_ws(*p))
+                p++;
+            return p == start ? NULL : p;
+        }
+
+        // Step from one member or element to the next: p just past a value, returns the
+        // start of the next key or value, NULL at the closing bracket or on bad input
+        static const char *next_item(const char *p, const char *end) {
+            p = skip_ws(p, end);
+            if (p >= end || *p != ',')
+                return NULL;
+            return skip_ws(p + 1, end);
+        }
+
+        // First key or value inside the object or array, NULL if it is empty
+        const char *first_item(void) const {
+            const char *p = skip_ws(_p + 1, _end);
+            if (p >= _end || *p == '}' || *p == ']')
+                return NULL;
+            return p;
+        }
+
+        // p at a member's key: returns the start of its value and the key's raw text
+        static const char *member_value(const char *p, const char *end, const char *&key, size_t &key_len) {
+            if (p >= end || *p != '"')
+                return NULL;
+            const char *after = skip_string(p, end);
+            if (after == NULL)
+                return NULL;
+            key = p + 1;
+            key_len = (size_t) (after - 1 - key);
+
+            p = skip_ws(after, end);
+            if (p >= end || *p != ':')
+                return NULL;
+            return skip_ws(p + 1, end);
+        }
+
+        // One character of a string, p inside the quotes, UTF-8 encoded into out
+        // Returns its length, 0 at the closing quote or a broken escape
+        static uint8_t decode(const char *&p, const char *end, char *out) {
+            if (p >= end || *p == '"')
+                return 0;
+
+            char c = *p++;
+            if (c != '\\') {
+                out[0] = c;
+                return 1;
+            }
+            if (p >= end)
+                return 0;
+
+            c = *p++;
+            switch (c) {
+                case 'b': out[0] = '\b'; return 1;
+                case 'f': out[0] = '\f'; return 1;
+                case 'n': out[0] = '\n'; return 1;
+                case 'r': out[0] = '\r'; return 1;
+                case 't': out[0] = '\t'; return 1;
+                case 'u': break;
+                default: out[0] = c; return 1;
+            }
+
+            if (end - p < 4)
+                return 0;
+            uint16_t cp = 0;
+            for (uint8_t i = 0; i < 4; i++) {
+                char h = *p++;
+                cp <<= 4;
+                if (h >= '0' && h <= '9')
+                    cp |= h - '0';
+                else if (h >= 'a' && h <= 'f')
+                    cp |= h - 'a' + 10;
+                else if (h >= 'A' && h <= 'F')
+                    cp |= h - 'A' + 10;
+                else
+                    return 0;
+            }
+
+            if (cp < 0x80) {
+                out[0] = (char) cp;
+                return 1;
+            }
+            if (cp < 0x800) {
+                out[0] = (char) (0xc0 | (cp >> 6));
+                out[1] = (char) (0x80 | (cp & 0x3f));
+                return 2;
+            }
+            out[0] = (char) (0xe0 | (cp >> 12));
+            out[1] = (char) (0x80 | ((cp >> 6) & 0x3f));
+            out[2] = (char) (0x80 | (cp & 0x3f));
+            return 3;
+        }
+
+        JsonReader member(const char *key, size_t key_len) const {
+            if (type() != JSON_OBJECT)
+                return JsonReader();
+
+            for (const char *p = first_item(); p; ) {
+                const char *k;
+                size_t k_len;
+                p = member_value(p, _end, k, k_len);
+                if (p == NULL)
+                    break;
+                if (k_len == key_len && memcmp(k, key, k_len) == 0)
+                    return JsonReader(p, _end);
+
+                p = skip_value(p, _end);
+                if (p == NULL)
+                    break;
+                p = next_item(p, _end);
+            }
+            return JsonReader();
+        }
+
+    public:
+        JsonReader() :
+                _p(NULL), _end(NULL) { }
+
+        JsonReader(const char *p, const char *end) :
+                _p(skip_ws(p, end)), _end(end) { }
+
+        JsonReader(const uint8_t *payload, size_t length) :
+                _p(skip_ws((const char *) payload, (const char *) payload + length)),
+                _end((const char *) payload + length) { }
+
+        json_type_t type(void) const {
+            if (_p == NULL || _p >= _end)
+                return JSON_NONE;
+
+            switch (*_p) {
+                case '{': return JSON_OBJECT;
+                case '[': return JSON_ARRAY;
+                case '"': return JSON_STRING;
+                case 't':
+                case 'f': return JSON_BOOL;
+                case 'n': return JSON_NULL;
+                default:
+                    if (*_p == '-' || (*_p >= '0' && *_p <= '9'))
+                        return JSON_NUMBER;
+                    return JSON_NONE;
+            }
+        }
+
+        bool exists(void) const { return type() != JSON_NONE; }
+
+        bool is_null(void) const { return type() == JSON_NULL; }
+
+        // Member of an object by key. Keys are compared as they are written, escapes included
+        JsonReader get(const char *key) const {
+            return member(key, strlen(key));
+        }
+
+        // Element of an array
+        JsonReader at(size_t index) const {
+            if (type() != JSON_ARRAY)
+                return JsonReader();
+
+            for (const char *p = first_item(); p; index--) {
+                if (index == 0)
+                    return JsonReader(p, _end);
+                p = skip_value(p, _end);
+                if (p == NULL)
+                    break;
+                p = next_item(p, _end);
+            }
+            return JsonReader();
+        }
+
+        // Dotted path of keys and array indexes, e.g. find("led.colour.2")
+        JsonReader find(const char *path) const {
+            JsonReader v = *this;
+            while (*path && v.exists()) {
+                const char *dot = strchr(path, '.');
+                size_t len = dot ? (size_t) (dot - path) : strlen(path);
+
+                if (v.type() == JSON_ARRAY) {
+                    size_t index = 0;
+                    for (size_t i = 0; i < len; i++) {
+                        if (path[i] < '0' || path[i] > '9')
+                            return JsonReader();
+                        index = index * 10 + (path[i] - '0');
+                    }
+                    v = v.at(index);
+                } else {
+                    v = v.member(path, len);
+                }
+
+                path += len;
+                if (*path == '.')
+                    path++;
+            }
+            return v;
+        }
+
+        // Members of an object or elements of an array
+        size_t size(void) const {
+            json_type_t t = type();
+            if (t != JSON_ARRAY && t != JSON_OBJECT)
+                return 0;
+
+            size_t n = 0;
+            for (const char *p = first_item(); p; n++) {
+                if (t == JSON_OBJECT) {
+                    const char *k;
+                    size_t k_len;
+                    p = member_value(p, _end, k, k_len);
+                    if (p == NULL)
+                        return n;
+                }
+                p = skip_value(p, _end);
+                if (p == NULL)
+                    return n;
+                p = next_item(p, _end);
+            }
+            return n;
+        }
+
+        // Numbers are read as far as they go, to_long() stops at a decimal point or exponent
+        long to_long(long def = 0) const {
+            if (type() != JSON_NUMBER)
+                return def;
+
+            const char *p = _p;
+            bool neg = *p == '-';
+            if (neg)
+                p++;
+            unsigned long v = 0;
+            for (; p < _end && *p >= '0' && *p <= '9'; p++)
+                v = v * 10 + (*p - '0');
+            return neg ? -(long) v : (long) v;
+        }
+
+        double to_double(double def = 0) const {
+            if (type() != JSON_NUMBER)
+                return def;
+
+            const char *p = _p;
+            bool neg = *p == '-';
+            if (neg)
+                p++;
+
+            double v = 0;
+            for (; p < _end && *p >= '0' && *p <= '9'; p++)
+                v = v * 10 + (*p - '0');
+            if (p < _end && *p == '.') {
+                double scale = 0.1;
+                for (p++; p < _end && *p >= '0' && *p <= '9'; p++) {
+                    v += (*p - '0') * scale;
+                    scale *= 0.1;
+                }
+            }
+            if (p < _end && (*p == 'e' || *p == 'E')) {
+                p++;
+                bool neg_exp = p < _end && *p == '-';
+                if (p < _end && (*p == '-' || *p == '+'))
+                    p++;
+                int exp = 0;
+                for (; p < _end && *p >= '0' && *p <= '9' && exp < 400; p++)
+                    exp = exp * 10 + (*p - '0');
+                for (; exp > 0; exp--)
+                    v = neg_exp ? v / 10 : v * 10;
+            }
+            return neg ? -v : v;
+        }
+
+        bool to_bool(bool def = false) const {
+            if (type() != JSON_BOOL)
+                return def;
+            return *_p == 't';
+        }
+
+        // Compare a string value with s, escapes decoded
+        bool equals(const char *s) const {
+            if (type() != JSON_STRING)
+                return false;
+
+            const char *p = _p + 1;
+            char c[3];
+            uint8_t n;
+            while ((n = decode(p, _end, c)) > 0) {
+                if (strncmp(s, c, n) != 0)
+                    return false;
+                s += n;
+            }
+            return *s == 0 && p < _end && *p == '"';
+        }
+
+        // Copy a string value into buf with escapes decoded, always NUL-terminated
+        // Returns the length copied, shorter than the string if buf is too small
+        size_t copy(char *buf, size_t size) const {
+            if (size == 0)
+                return 0;
+            if (type() != JSON_STRING) {
+                buf[0] = 0;
+                return 0;
+            }
+
+            const char *p = _p + 1;
+            size_t len = 0;
+            char c[3];
+            uint8_t n;
+            while ((n = decode(p, _end, c)) > 0 && len + n < size) {
+                memcpy(buf + len, c, n);
+                len += n;
+            }
+            buf[len] = 0;
+            return len;
+        }
+
+        // The value exactly as it is written in the buffer, quotes and all
+        const char *raw(void) const { return exists() ? _p : NULL; }
+
+        size_t raw_len(void) const {
+            if (!exists())
+                return 0;
+            const char *after = skip_value(_p, _end);
+            return after ? (size_t) (after - _p) : 0;
+        }
+    };
+}
+
+#endif
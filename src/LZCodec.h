@@ -0,0 +1,384 @@
+/*
+ LZCodec.h - Small-window LZ compression of payloads, streamed as they are sent and received.
+*/
+
+#ifndef LZCodec_h
+#define LZCodec_h
+
+#include "MQTT.h"
+
+// Stream format: a header byte 0xA0 | window bits, the uncompressed length as a 7 bit varint
+// (like the MQTT remaining length), then groups of a flag byte and up to eight items, least
+// significant bit first. A clear bit is a literal byte, a set bit a back-reference of two bytes,
+// big-endian ((distance - 1) << 4) | (length - 3): distances up to 4096, lengths 3 to 18
+// Data that does not compress is stored as it is behind a header with 0 window bits instead
+
+#define MQTT_LZ_MAGIC 0xA0
+#define MQTT_LZ_MIN_MATCH 3
+#define MQTT_LZ_MAX_MATCH 18
+
+namespace MQTT {
+    // Whether a topic carries compressed payloads by convention, i.e. ends in MQTT_LZ_SUFFIX
+    inline bool lz_flagged(const char *topic, size_t len) {
+        size_t suffix = sizeof(MQTT_LZ_SUFFIX) - 1;
+        return len >= suffix && memcmp(topic + len - suffix, MQTT_LZ_SUFFIX, suffix) == 0;
+    }
+
+    // Compresses a payload in RAM, handing the output out in pieces of any size
+    // Only a hash table of recent positions is kept, the payload itself is the window
+    class LZEncoder {
+    private:
+        const uint8_t *_src;
+        size_t _len;
+        size_t _pos;
+        size_t _out_len;
+        bool _stored;
+        uint16_t _head[1 << MQTT_LZ_HASH_BITS];    // Low 16 bits of the last position per hash
+        uint8_t _group[1 + 8 * 2];
+        uint8_t _group_len, _group_pos;
+
+        static uint16_t hash(const uint8_t *p) {
+            uint32_t v = ((uint32_t) p[0] << 16) | ((uint32_t) p[1] << 8) | p[2];
+            return (uint16_t) ((uint32_t) (v * 2654435761UL) >> (32 - MQTT_LZ_HASH_BITS));
+        }
+
+        // Length of the match at _pos against the position last seen with the same hash
+        uint8_t match(uint16_t &dist) {
+            if (_len - _pos < MQTT_LZ_MIN_MATCH)
+                return 0;
+
+            uint16_t &head = _head[hash(_src + _pos)];
+            dist = (uint16_t) ((uint16_t) _pos - head);
+            head = (uint16_t) _pos;
+            if (dist == 0 || dist > (1 << MQTT_LZ_WINDOW_BITS) || dist > _pos)
+                return 0;
+
+            const uint8_t *a = _src + _pos, *b = a - dist;
+            size_t max = _len - _pos < MQTT_LZ_MAX_MATCH ? _len - _pos : MQTT_LZ_MAX_MATCH;
+            uint8_t n = 0;
+            while (n < max && a[n] == b[n])
+                n++;
+            return n >= MQTT_LZ_MIN_MATCH ? n : 0;
+        }
+
+        void fill_group(void) {
+            uint8_t flags = 0;
+            _group_len = 1;
+            _group_pos = 0;
+            for (uint8_t bit = 0; bit < 8 && _pos < _len; bit++) {
+                uint16_t dist;
+                uint8_t n = match(dist);
+                if (n == 0) {
+                    _group[_group_len++] = _src[_pos++];
+                    continue;
+                }
+
+                flags |= 1 << bit;
+                uint16_t ref = (uint16_t) (((dist - 1) << 4) | (n - MQTT_LZ_MIN_MATCH));
+                _group[_group_len++] = (uint8_t) (ref >> 8);
+                _group[_group_len++] = (uint8_t) ref;
+
+                // Positions inside the match are remembered too, they make for the next matches
+                for (_pos++; --n > 0; _pos++) {
+                    if (_len - _pos >= MQTT_LZ_MIN_MATCH)
+                        _head[hash(_src + _pos)] = (uint16_t) _pos;
+                }
+            }
+            _group[0] = flags;
+        }
+
+    public:
+        LZEncoder() {
+            set_source(NULL, 0);
+        }
+
+        LZEncoder(const uint8_t *src, size_t len) {
+            set_source(src, len);
+        }
+
+        // Runs the whole compression once without keeping the output, to learn its length
+        // and whether it is worth it at all
+        void set_source(const uint8_t *src, size_t len) {
+            _src = src;
+            _len = len;
+            _stored = false;
+            rewind();
+
+            _out_len = _group_len;
+            size_t stored_len = _group_len + _len;
+            while (_pos < _len && _out_len < stored_len) {
+                fill_group();
+                _out_len += _group_len;
+            }
+            if (_out_len >= stored_len) {
+                _stored = true;
+                _out_len = stored_len;
+            }
+            rewind();
+        }
+
+        // Start over from the header, the output is the same every time
+        void rewind(void) {
+            memset(_head, 0, sizeof(_head));
+            _pos = 0;
+            _group_pos = 0;
+            _group_len = 0;
+            _group[_group_len++] = MQTT_LZ_MAGIC | (_stored ? 0 : MQTT_LZ_WINDOW_BITS);
+            size_t len = _len;
+            do {
+                uint8_t digit = (uint8_t) (len & 0x7f);
+                len >>= 7;
+                if (len)
+                    digit |= 0x80;
+                _group[_group_len++] = digit;
+            } while (len);
+        }
+
+        // Up to size bytes of output, 0 once it is all out
+        size_t read(uint8_t *out, size_t size) {
+            size_t n = 0;
+            while (n < size) {
+                if (_group_pos == _group_len) {
+                    if (_pos >= _len)
+                        break;
+                    if (_stored) {
+                        size_t count = _len - _pos < size - n ? _len - _pos : size - n;
+                        memcpy(out + n, _src + _pos, count);
+                        _pos += count;
+                        n += count;
+                        continue;
+                    }
+                    fill_group();
+                }
+                size_t count = _group_len - _group_pos;
+                if (count > size - n)
+                    count = size - n;
+                memcpy(out + n, _group + _group_pos, count);
+                _group_pos += count;
+                n += count;
+            }
+            return n;
+        }
+
+        // Length of the whole output, header included
+        size_t length(void) const { return _out_len; }
+
+        bool stored(void) const { return _stored; }
+    };
+
+    // Decompresses a stream fed in pieces of any size through a window of its own,
+    // passing the output on to a sink as it goes
+    class LZDecoder {
+    public:
+        typedef void (*sink_t)(const uint8_t *data, size_t len, void *arg);
+
+    private:
+        enum {
+            LZ_HEADER, LZ_LENGTH, LZ_FLAGS, LZ_ITEM, LZ_REF, LZ_STORED, LZ_DONE, LZ_ERROR
+        };
+
+        uint8_t _window[1 << MQTT_LZ_WINDOW_BITS];
+        uint16_t _pos, _flushed;
+        uint8_t _state;
+        uint8_t _flags, _bit;
+        uint8_t _ref_hi;
+        uint8_t _shift;
+        bool _stored;
+        uint32_t _total, _out;
+
+        void flush(sink_t sink, void *arg) {
+            if (_pos > _flushed)
+                sink(_window + _flushed, _pos - _flushed, arg);
+            _flushed = _pos;
+        }
+
+        void put(uint8_t c, sink_t sink, void *arg) {
+            _window[_pos++] = c;
+            _out++;
+            if (_pos == sizeof(_window)) {
+                flush(sink, arg);
+                _pos = _flushed = 0;
+            }
+        }
+
+        void next_item(void) {
+            if (_out == _total)
+                _state = LZ_DONE;
+            else if (++_bit == 8)
+                _state = LZ_FLAGS;
+            else
+                _state = LZ_ITEM;
+        }
+
+        struct buffer_t {
+            uint8_t *data;
+            size_t size, len;
+        };
+
+        static void to_buffer(const uint8_t *data, size_t len, void *arg) {
+            buffer_t *b = (buffer_t *) arg;
+            size_t count = len < b->size - b->len ? len : b->size - b->len;
+            memcpy(b->data + b->len, data, count);
+            b->len += count;
+        }
+
+    public:
+        LZDecoder() { reset(); }
+
+        void reset(void) {
+            _pos = _flushed = 0;
+            _state = LZ_HEADER;
+            _shift = 0;
+            _total = _out = 0;
+        }
+
+        // Feed the next piece of the stream. False once it turns out corrupt, or was compressed
+        // with a larger window than MQTT_LZ_WINDOW_BITS
+        bool write(const uint8_t *in, size_t len, sink_t sink, void *arg) {
+            for (size_t i = 0; i < len && _state < LZ_DONE; i++) {
+                uint8_t c = in[i];
+                switch (_state) {
+                    case LZ_HEADER:
+                        if ((c & 0xf0) != MQTT_LZ_MAGIC || (c & 0x0f) > MQTT_LZ_WINDOW_BITS)
+                            _state = LZ_ERROR;
+                        else
+                            _state = LZ_LENGTH;
+                        _stored = (c & 0x0f) == 0;
+                        break;
+
+                    case LZ_LENGTH:
+                        _total |= (uint32_t) (c & 0x7f) << _shift;
+                        _shift += 7;
+                        if (c & 0x80)
+                            _state = _shift < 35 ? LZ_LENGTH : LZ_ERROR;
+                        else
+                            _state = _total == 0 ? LZ_DONE : _stored ? LZ_STORED : LZ_FLAGS;
+                        break;
+
+                    case LZ_STORED:
+                        put(c, sink, arg);
+                        if (_out == _total)
+                            _state = LZ_DONE;
+                        break;
+
+                    case LZ_FLAGS:
+                        _flags = c;
+                        _bit = 0;
+                        _state = LZ_ITEM;
+                        break;
+
+                    case LZ_ITEM:
+                        if (_flags & (1 << _bit)) {
+                            _ref_hi = c;
+                            _state = LZ_REF;
+                            break;
+                        }
+                        put(c, sink, arg);
+                        next_item();
+                        break;
+
+                    case LZ_REF: {
+                        uint16_t ref = (uint16_t) ((_ref_hi << 8) | c);
+                        uint16_t dist = (uint16_t) ((ref >> 4) + 1);
+                        uint8_t n = (uint8_t) ((ref & 0x0f) + MQTT_LZ_MIN_MATCH);
+                        if (dist > _out || dist > sizeof(_window) || n > _total - _out) {
+                            _state = LZ_ERROR;
+                            break;
+                        }
+                        while (n--)
+                            put(_window[(_pos - dist) & (sizeof(_window) - 1)], sink, arg);
+                        next_item();
+                        break;
+                    }
+                }
+            }
+            flush(sink, arg);
+            return _state != LZ_ERROR;
+        }
+
+        // Uncompressed length from the header, once it has been read
+        uint32_t total(void) const { return _total; }
+
+        // Bytes put out so far
+        uint32_t produced(void) const { return _out; }
+
+        bool done(void) const { return _state == LZ_DONE; }
+
+        bool error(void) const { return _state == LZ_ERROR; }
+
+        // Decompress a whole stream into out, returns its length or 0 if it is corrupt,
+        // cut short or longer than size, which error() then tells from an empty one
+        size_t decode(const uint8_t *in, size_t len, uint8_t *out, size_t size) {
+            buffer_t b = {out, size, 0};
+            reset();
+            if (!write(in, len, to_buffer, &b) || !done() || _total > size) {
+                _state = LZ_ERROR;
+                return 0;
+            }
+            return b.len;
+        }
+    };
+
+    // A publish whose payload is compressed as it is written out, a buffer-full at a time,
+    // so the compressed payload never has to be held in RAM. payload_len() is the compressed
+    // length, and payload() is NULL since the compressed payload is nowhere in memory
+    // source() is the uncompressed payload, which must outlive the message
+    // By convention its topic ends in MQTT_LZ_SUFFIX, so receivers know to decompress it
+    class LZPublish : public Publish {
+    protected:
+        LZEncoder _encoder;
+
+        bool write_payload(uint8_t *buf, size_t &bufpos) {
+            _encoder.rewind();
+            bufpos += _encoder.read(buf + bufpos, _encoder.length());
+            return true;
+        }
+
+        const uint8_t *direct_payload(size_t &len, bool &progmem) { return NULL; }
+
+        bool streamed_payload(size_t &len) {
+            _encoder.rewind();
+            len = _encoder.length();
+            return true;
+        }
+
+        size_t read_payload(uint8_t *buf, size_t size) {
+            return _encoder.read(buf, size);
+        }
+
+        virtual void init(uint8_t *payload, size_t len) {
+            _payload = payload;
+            _payload_len = len;
+            _payload_P = false;
+            _encoder.set_source(payload, len);
+        }
+
+    public:
+        LZPublish(const String &topic, const uint8_t *payload, size_t len) {
+            set_topic(topic);
+            init((uint8_t *) payload, len);
+        }
+
+        LZPublish(const char *topic, const uint8_t *payload, size_t len) {
+            set_topic(topic);
+            init((uint8_t *) payload, len);
+        }
+
+        LZPublish(const __FlashStringHelper *topic, const uint8_t *payload, size_t len) {
+            set_topic(topic);
+            init((uint8_t *) payload, len);
+        }
+
+        uint8_t *payload(void) const { return NULL; }
+
+        size_t payload_len(void) const { return _encoder.length(); }
+
+        char *payload_string(void) const { return NULL; }
+
+        const uint8_t *source(void) const { return _payload; }
+
+        size_t source_len(void) const { return _payload_len; }
+    };
+}
+
+#endif
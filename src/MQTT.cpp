@@ -12,16 +12,14 @@ namespace MQTT {
         bufpos += dlen;
     }
 
-    void write(uint8_t *buf, size_t &bufpos, String str) {
-        const char *c = str.c_str();
-        size_t length_pos = bufpos;
-        bufpos += 2;
-        uint16_t count = 0;
-        while (*c) {
-            buf[bufpos++] = (uint8_t) *c++;
-            count++;
-        }
-        write(buf, length_pos, count);
+    // Length-prefixed string, read from PROGMEM if progmem is set
+    void write(uint8_t *buf, size_t &bufpos, const char *str, uint16_t len, bool progmem = false) {
+        write(buf, bufpos, len);
+        if (progmem)
+            memcpy_P(buf + bufpos, str, len);
+        else
+            memcpy(buf + bufpos, str, len);
+        bufpos += len;
     }
 
     template<typename T>
@@ -45,7 +43,7 @@ namespace MQTT {
 
         String val;
         val.reserve(len);
-        for (uint8_t i = 0; i < len; i++)
+        for (uint16_t i = 0; i < len; i++)
             val += (char) read<uint8_t>(buf, pos);
 
         return val;
@@ -64,7 +62,7 @@ namespace MQTT {
             case MQTT_PUBREL:
             case MQTT_SUBSCRIBE:
             case MQTT_UNSUBSCRIBE:
-                buf[bufpos] |= 0x02;
+                buf[bufpos] |= 0x02 | (_flags & 0x08);
         }
         bufpos++;
 
@@ -82,6 +80,7 @@ namespace MQTT {
 
     bool Message::write_packet_id(uint8_t *buf, size_t &bufpos) {
         write(buf, bufpos, _packet_id);
+        return true;
     }
 
 
@@ -90,53 +89,144 @@ namespace MQTT {
         return send(stream, packet, block_size);
     }
 
+    // Write in blocks, as client.write on the cc3200 cannot take more than 100 bytes
+    static bool write_blocks(Stream &stream, const uint8_t *data, size_t len, size_t block_size) {
+        size_t sent = 0;
+        size_t count = 0;
+        size_t ret = 0;
+
+        if (block_size == 0) {
+            block_size = MQTT_SEND_BLOCK_SIZE;
+        }
+        while (sent < len) {
+            count = min(len - sent, block_size);
+            sent += (ret = stream.write(data + sent, count));
+            if (ret != count) break;
+        }
+
+        return (sent == len);
+    }
+
     bool Message::send(Stream &stream, uint8_t *buffer, size_t block_size) {
         size_t remaining_length = 0;
         write_variable_header(buffer + 5, remaining_length);
-        write_payload(buffer + 5, remaining_length);
+
+        // A payload that would overflow the buffer is written from where it is instead
+        size_t direct_len = 0;
+        bool direct_P = false;
+        const uint8_t *direct = direct_payload(direct_len, direct_P);
+        bool streamed = direct == NULL && streamed_payload(direct_len);
+        if ((direct == NULL && !streamed) || 5 + remaining_length + direct_len <= MQTT_MAX_PACKET_SIZE) {
+            write_payload(buffer + 5, remaining_length);
+            direct = NULL;
+            direct_len = 0;
+            streamed = false;
+        }
 
         uint8_t fixed_header[5];
         size_t fixed_len = 0;
-        write_fixed_header(fixed_header, fixed_len, remaining_length);
+        write_fixed_header(fixed_header, fixed_len, remaining_length + direct_len);
 
         uint8_t *real_packet = buffer + 5 - fixed_len;
         size_t real_len = remaining_length + fixed_len;
         memcpy(real_packet, fixed_header, fixed_len);
 
-//        Serial.print("Sending Packet(");
-//        Serial.print(real_len);
-//        Serial.println("):");
-//        for (int i = 0; i < real_len; ++i) {
-//            Serial.print(real_packet[i], 16);
-//            Serial.print(" ");
-//        }
-//        Serial.println();
-
-        // write with block to fix wired issue that client.write in cc3200 can not more than 100 bytes.
-        size_t sent = 0;
-        size_t count = 0;
-        size_t ret = 0;
-
-        if (block_size == 0) {
-            block_size = MQTT_SEND_BLOCK_SIZE;
+        if (!write_blocks(stream, real_packet, real_len, block_size))
+            return false;
+
+        if (streamed) {
+            size_t count;
+            while (direct_len && (count = read_payload(buffer, min(direct_len, (size_t) MQTT_MAX_PACKET_SIZE))) > 0) {
+                if (!write_blocks(stream, buffer, count, block_size))
+                    return false;
+                direct_len -= count;
+            }
+            return direct_len == 0;
         }
-        while (sent < real_len) {
-            count = min(real_len - sent, block_size);
-            sent += (ret = stream.write(const_cast<const uint8_t *>(real_packet + sent), count));
-            if (ret != count) break;
+        if (direct == NULL)
+            return true;
+        if (!direct_P)
+            return write_blocks(stream, direct, direct_len, block_size);
+
+        // PROGMEM goes out through the buffer, which is free again now, a buffer-full at a time
+        for (size_t pos = 0; pos < direct_len; pos += MQTT_MAX_PACKET_SIZE) {
+            size_t count = min(direct_len - pos, (size_t) MQTT_MAX_PACKET_SIZE);
+            memcpy_P(buffer, (PGM_P) (direct + pos), count);
+            if (!write_blocks(stream, buffer, count, block_size))
+                return false;
         }
+        return true;
+    }
 
-        return (sent == real_len);
+    bool Publish::well_formed(uint8_t flags, const uint8_t *data, size_t length) {
+        uint8_t qos = (flags >> 1) & 0x03;
+        if (qos == 3 || length < 2)
+            return false;
+        size_t header = 2 + ((data[0] << 8) | data[1]) + (qos ? 2 : 0);
+        return header <= length;
+    }
+
+    Publish::Publish(uint8_t flags, uint8_t *data, size_t length) :
+            Message(MQTT_PUBLISH, flags),
+            _topic_ref(""), _topic_len(0),
+            _topic_P(false),
+            _payload(data), _payload_len(0),
+            _payload_P(false) {
+        // Left empty rather than read past the end
+        if (!well_formed(flags, data, length))
+            return;
+
+        size_t pos = 0;
+        _topic_len = read<uint16_t>(data, pos);
+
+        // Slide the topic over its length bytes so it can be terminated where it is
+        memmove(data, data + pos, _topic_len);
+        data[_topic_len] = 0;
+        _topic_ref = (const char *) data;
+        pos += _topic_len;
+
+        if (qos() > 0)
+            _packet_id = read<uint16_t>(data, pos);
+        _payload = data + pos;
+        _payload_len = length - pos;
     }
 
     bool Publish::write_variable_header(uint8_t *buf, size_t &bufpos) {
-        write(buf, bufpos, _topic);
+        write(buf, bufpos, topic(), _topic_len, _topic_P);
         if (qos())
             write_packet_id(buf, bufpos);
+        return true;
     }
 
     bool Publish::write_payload(uint8_t *buf, size_t &bufpos) {
-        write(buf, bufpos, payload(), payload_len());
+        if (_payload_P) {
+            memcpy_P(buf + bufpos, (PGM_P) payload(), payload_len());
+            bufpos += payload_len();
+        } else if (buf + bufpos != payload()) {
+            write(buf, bufpos, payload(), payload_len());
+        } else {
+            // Formatted into place already, see PubSubClient::begin_publish()
+            bufpos += payload_len();
+        }
+        return true;
+    }
+
+    size_t Publish::packet_len(void) const {
+        size_t rlength = 2 + _topic_len + (qos() ? 2 : 0) + payload_len();
+        size_t len = 1 + rlength;
+        do {
+            len++;
+            rlength >>= 7;
+        } while (rlength);
+        return len;
+    }
+
+    size_t Publish::encode(uint8_t *buf) {
+        size_t len = 0;
+        write_fixed_header(buf, len, 2 + _topic_len + (qos() ? 2 : 0) + payload_len());
+        write_variable_header(buf, len);
+        write_payload(buf, len);
+        return len;
     }
 
     uint8_t Publish::response_type(void) const {
@@ -156,17 +246,58 @@ namespace MQTT {
         _flags = flags;
         memset(_buffer, 0, MQTT_MAX_PAYLOAD_SIZE);
 
+        _payload_len = 0;
+        if (!well_formed(flags, data, length))
+            return;
+
         size_t pos = 0;
-        _topic = read<String>(data, pos);
+        set_topic(read<String>(data, pos));
         if (qos() > 0)
             _packet_id = read<uint16_t>(data, pos);
-        _payload_len = length - pos;
+        _payload_len = min(length - pos, (size_t) MQTT_MAX_PAYLOAD_SIZE);
         if (_payload_len > 0) {
             memcpy(_buffer, data + pos, _payload_len);
         }
 
     }
 
+    // PublishTemplate class
+    PublishTemplate::PublishTemplate(const String &topic, uint8_t qos, bool retain) {
+        set_topic(topic);
+        set_qos(qos).set_retain(retain);
+        encode();
+    }
+
+    PublishTemplate::PublishTemplate(const char *topic, uint8_t qos, bool retain) {
+        set_topic(topic);
+        set_qos(qos).set_retain(retain);
+        encode();
+    }
+
+    PublishTemplate::PublishTemplate(const __FlashStringHelper *topic, uint8_t qos, bool retain) {
+        set_topic(topic);
+        set_qos(qos).set_retain(retain);
+        encode();
+    }
+
+    void PublishTemplate::encode(void) {
+        size_t len = 0;
+        if (_topic_len <= MQTT_TEMPLATE_TOPIC_SIZE)
+            write(_encoded, len, topic(), _topic_len, _topic_P);
+        _encoded_len = (uint8_t) len;
+    }
+
+    bool PublishTemplate::write_variable_header(uint8_t *buf, size_t &bufpos) {
+        if (_encoded_len == 0)
+            return Publish::write_variable_header(buf, bufpos);
+
+        memcpy(buf + bufpos, _encoded, _encoded_len);
+        bufpos += _encoded_len;
+        if (qos())
+            write_packet_id(buf, bufpos);
+        return true;
+    }
+
     // PublishAck class
     PublishAck::PublishAck(uint16_t pid) :
             Message(MQTT_PUBACK, pid) { }
@@ -177,6 +308,11 @@ namespace MQTT {
         _packet_id = read<uint16_t>(data, pos);
     }
 
+    bool PublishAck::write_variable_header(uint8_t *buf, size_t &bufpos) {
+        write_packet_id(buf, bufpos);
+        return true;
+    }
+
 
     // PublishRec class
     PublishRec::PublishRec(uint16_t pid) :
@@ -190,6 +326,7 @@ namespace MQTT {
 
     bool PublishRec::write_variable_header(uint8_t *buf, size_t &bufpos) {
         write_packet_id(buf, bufpos);
+        return true;
     }
 
 
@@ -205,12 +342,13 @@ namespace MQTT {
 
     bool PublishRel::write_variable_header(uint8_t *buf, size_t &bufpos) {
         write_packet_id(buf, bufpos);
+        return true;
     }
 
 
     // PublishComp class
     PublishComp::PublishComp(uint16_t pid) :
-            Message(MQTT_PUBREC, pid) { }
+            Message(MQTT_PUBCOMP, pid) { }
 
     PublishComp::PublishComp(uint8_t *data, size_t length) :
             Message(MQTT_PUBCOMP) {
@@ -220,6 +358,38 @@ namespace MQTT {
 
     bool PublishComp::write_variable_header(uint8_t *buf, size_t &bufpos) {
         write_packet_id(buf, bufpos);
+        return true;
+    }
+
+
+    // ConnectAck class
+    ConnectAck::ConnectAck(uint8_t *data, size_t length) :
+            Message(MQTT_CONNACK),
+            _session_present(false),
+            _rc(0xff) {
+        if (length >= 2) {
+            _session_present = data[0] & 0x01;
+            _rc = data[1];
+        }
+    }
+
+
+    // SubscribeAck class
+    SubscribeAck::SubscribeAck(uint8_t *data, size_t length) :
+            Message(MQTT_SUBACK),
+            _rc(0x80) {
+        size_t pos = 0;
+        _packet_id = read<uint16_t>(data, pos);
+        if (length > pos)
+            _rc = read<uint8_t>(data, pos);
+    }
+
+
+    // UnsubscribeAck class
+    UnsubscribeAck::UnsubscribeAck(uint8_t *data, size_t length) :
+            Message(MQTT_UNSUBACK) {
+        size_t pos = 0;
+        _packet_id = read<uint16_t>(data, pos);
     }
 
 }
\ No newline at end of file
@@ -22,9 +22,109 @@
 
 #define MQTT_SEND_BLOCK_SIZE 64
 
+// MQTT_MAX_PENDING_ACKS : Number of inbound PUBACKs coalesced into a single write
+#define MQTT_MAX_PENDING_ACKS 8
+
+// MQTT_MAX_INFLIGHT : Outbound packet ids that can be outstanding at once (a power of two)
+#ifdef MQTT_HOST_BUILD
+#define MQTT_MAX_INFLIGHT 1024
+#else
+#define MQTT_MAX_INFLIGHT 32
+#endif
+
+// MQTT_RX_QUEUE_SLOTS : Decoded publishes that can wait between parsing and the callback (at most 31)
+#ifdef MQTT_HOST_BUILD
+#define MQTT_RX_QUEUE_SLOTS 16
+#else
+#define MQTT_RX_QUEUE_SLOTS 2
+#endif
+
+// MQTT_RX_SLOTS : Inbound publishes held at once, queued or in their callback, MQTT_MAX_PACKET_SIZE + 1 bytes each
+// (2 to 32). Fewer than MQTT_RX_QUEUE_SLOTS + 1 saves RAM but shortens the queue and nested callbacks; a callback
+// waiting for a response needs a free slot for any publish that arrives ahead of it
+#ifdef __CC3200R1M1RGC__
+#define MQTT_RX_SLOTS 2
+#else
+#define MQTT_RX_SLOTS (MQTT_RX_QUEUE_SLOTS + 1)
+#endif
+
+// MQTT_MAX_INBOUND_QOS2 : Inbound QoS2 messages delivered and waiting for their PUBREL
+#define MQTT_MAX_INBOUND_QOS2 8
+
+// MQTT_QOS1_WINDOW : Recent inbound QoS1 packet ids remembered so redelivered duplicates skip the callback, 0 disables it
+#ifndef MQTT_QOS1_WINDOW
+#define MQTT_QOS1_WINDOW 0
+#endif
+
+// MQTT_TX_QUEUE : Let other threads publish through a lock-free queue drained by loop()
+#if defined(MQTT_HOST_BUILD) || defined(ESP32)
+#define MQTT_TX_QUEUE
+#endif
+
+// MQTT_TX_QUEUE_SLOTS : Packets the TX queue can hold (a power of two)
+#define MQTT_TX_QUEUE_SLOTS 16
+
+// MQTT_COROUTINES : Awaitable connect/publish/subscribe for C++20 host builds, see PubSubTask.h
+#if defined(MQTT_HOST_BUILD) && __cplusplus >= 202002L
+#define MQTT_COROUTINES
+#endif
+
+// MQTT_TEMPLATE_TOPIC_SIZE : Longest topic a PublishTemplate pre-encodes, longer ones are encoded every time
+#define MQTT_TEMPLATE_TOPIC_SIZE 64
+
+// MQTT_LZ_WINDOW_BITS : log2 of the LZ compression window, 8 to 12. Each LZDecoder holds a window
+#ifdef MQTT_HOST_BUILD
+#define MQTT_LZ_WINDOW_BITS 12
+#else
+#define MQTT_LZ_WINDOW_BITS 10
+#endif
+
+// MQTT_LZ_HASH_BITS : log2 of the entries in an LZEncoder's match table, two bytes each
+#define MQTT_LZ_HASH_BITS 9
+
+// MQTT_LZ_SUFFIX : Topic suffix marking LZ-compressed payloads
+#define MQTT_LZ_SUFFIX "/lz"
+
+// MQTT_LZ : Decompress publishes to topics ending in MQTT_LZ_SUFFIX on their way to the stream / chunk callback
+//#define MQTT_LZ
+
+// MQTT_DEADBAND_TOPICS : Topics set_deadband() can filter, 28 bytes each plus MQTT_DEADBAND_PAYLOAD_SIZE
+#ifdef MQTT_HOST_BUILD
+#define MQTT_DEADBAND_TOPICS 64
+#else
+#define MQTT_DEADBAND_TOPICS 8
+#endif
+
+// MQTT_DEADBAND_PAYLOAD_SIZE : Longest last payload set_deadband() keeps to compare byte for byte (up to 254)
+#ifdef MQTT_HOST_BUILD
+#define MQTT_DEADBAND_PAYLOAD_SIZE 64
+#else
+#define MQTT_DEADBAND_PAYLOAD_SIZE 16
+#endif
+
+// MQTT_RATE_PREFIXES : Topic prefixes that can have a publish rate limit of their own
+#define MQTT_RATE_PREFIXES 4
+
+// MQTT_LOCAL_SUBSCRIPTIONS : Topic filters subscribe_local() can deliver publishes to in-process
+#ifdef MQTT_HOST_BUILD
+#define MQTT_LOCAL_SUBSCRIPTIONS 16
+#else
+#define MQTT_LOCAL_SUBSCRIPTIONS 4
+#endif
+
+// MQTT_LOCAL_DEPTH : Loopback callbacks nested this deep, publishing from the innermost is not looped back
+#define MQTT_LOCAL_DEPTH 4
+
 // MQTT_KEEPALIVE : keepAlive interval in Seconds
 #define MQTT_KEEPALIVE 15
 
+// MQTT_RTO_INITIAL : Retransmit timeout in milliseconds until a round trip has been measured
+#define MQTT_RTO_INITIAL 3000
+
+// MQTT_RTO_MIN, MQTT_RTO_MAX : Bounds of the retransmit timeout in milliseconds
+#define MQTT_RTO_MIN 200
+#define MQTT_RTO_MAX 60000
+
 #define MQTT_CONNECT     1  // Client request to connect to Server
 #define MQTT_CONNACK     2  // Connect Acknowledgment
 #define MQTT_PUBLISH     3  // Publish message
@@ -63,12 +163,25 @@ namespace MQTT {
         // Abstract methods to be implemented by derived classes
         virtual bool write_variable_header(uint8_t *buf, size_t &bufpos) = 0;
 
-        virtual bool write_payload(uint8_t *buf, size_t &bufpos) { }
+        virtual bool write_payload(uint8_t *buf, size_t &bufpos) { return true; }
+
+        // A payload send() can write from where it is, rather than copy with write_payload()
+        virtual const uint8_t *direct_payload(size_t &len, bool &progmem) { return NULL; }
+
+        // A payload produced as it is written, e.g. compressed: its length up front,
+        // then read_payload() until it returns 0
+        virtual bool streamed_payload(size_t &len) { return false; }
+
+        virtual size_t read_payload(uint8_t *buf, size_t size) { return 0; }
 
     public:
+        virtual ~Message() { }
 
         virtual uint8_t response_type(void) const { return 0; }
 
+        // Flag the message as a retransmission (PUBLISH, PUBREL, SUBSCRIBE and UNSUBSCRIBE)
+        void mark_dup(void) { _flags |= 0x08; }
+
         // Send the message out
         bool send(Stream &stream, size_t block_size = MQTT_SEND_BLOCK_SIZE);
         bool send(Stream &stream, uint8_t *buffer, size_t block_size = MQTT_SEND_BLOCK_SIZE);
@@ -80,44 +193,160 @@ namespace MQTT {
         uint16_t packet_id(void) const { return _packet_id; }
     };
 
+    // Hands Publish a topic to reference rather than copy, which must then outlive the message
+    struct TopicRef {
+        const char *topic;
+
+        explicit TopicRef(const char *t) : topic(t) { }
+    };
+
     class Publish : public Message {
     protected:
-        String _topic;
+        String _topic;              // Owned copy
+        const char *_topic_ref;     // Or the topic, when only referenced
+        uint16_t _topic_len;
+        bool _topic_P;              // _topic_ref points to PROGMEM
         uint8_t *_payload;
         size_t _payload_len;
+        bool _payload_P;            // _payload points to PROGMEM
 
         bool write_variable_header(uint8_t *buf, size_t &bufpos);
 
         bool write_payload(uint8_t *buf, size_t &bufpos);
 
+        const uint8_t *direct_payload(size_t &len, bool &progmem) {
+            len = payload_len();
+            progmem = _payload_P;
+            return payload();
+        }
 
+        void set_topic(const String &topic) {
+            _topic = topic;
+            _topic_ref = NULL;
+            _topic_len = (uint16_t) topic.length();
+            _topic_P = false;
+        }
 
-        virtual void init(String topic, uint8_t *payload, size_t len) {
+        void set_topic(const char *topic) {
             _topic = topic;
+            _topic_ref = NULL;
+            _topic_len = (uint16_t) _topic.length();
+            _topic_P = false;
+        }
+
+        void set_topic(TopicRef topic) {
+            _topic_ref = topic.topic;
+            _topic_len = (uint16_t) strlen(topic.topic);
+            _topic_P = false;
+        }
+
+        void set_topic(const __FlashStringHelper *topic) {
+            _topic_ref = (PGM_P) topic;
+            _topic_len = (uint16_t) strlen_P((PGM_P) topic);
+            _topic_P = true;
+        }
+
+        virtual void init(uint8_t *payload, size_t len) {
             _payload = payload;
             _payload_len = len;
+            _payload_P = false;
         }
 
     public:
         Publish() :
                 Message(MQTT_PUBLISH),
-                _payload(NULL) { }
+                _topic_ref(NULL), _topic_len(0), _topic_P(false),
+                _payload(NULL), _payload_len(0), _payload_P(false) { }
+
+        Publish(const String &topic, uint8_t *payload, size_t len) :
+                Message(MQTT_PUBLISH) {
+            set_topic(topic);
+            init(payload, len);
+        }
+
+        Publish(const String &topic, const char *payload, size_t len = 0) :
+                Message(MQTT_PUBLISH) {
+            if (len == 0) {
+                len = strlen(payload);
+            }
+            set_topic(topic);
+            init((uint8_t *) payload, len);
+        }
+
+        Publish(const char *topic, uint8_t *payload, size_t len) :
+                Message(MQTT_PUBLISH) {
+            set_topic(topic);
+            init(payload, len);
+        }
 
-        Publish(String topic, uint8_t *payload, size_t len) :
+        // The topic is referenced like the payload, not copied, so nothing is allocated
+        Publish(TopicRef topic, uint8_t *payload, size_t len) :
                 Message(MQTT_PUBLISH) {
-            init(topic, payload, len);
+            set_topic(topic);
+            init(payload, len);
         }
 
-        Publish(String topic, const char *payload, size_t len = 0) :
+        Publish(const char *topic, const char *payload, size_t len = 0) :
                 Message(MQTT_PUBLISH) {
             if (len == 0) {
                 len = strlen(payload);
             }
-            init(topic, (uint8_t *) payload, len);
+            set_topic(topic);
+            init((uint8_t *) payload, len);
         }
 
+        // Topic in PROGMEM, e.g. F("sensors/temp"), copied into the packet only when it is sent
+        Publish(const __FlashStringHelper *topic, uint8_t *payload, size_t len) :
+                Message(MQTT_PUBLISH) {
+            set_topic(topic);
+            init(payload, len);
+        }
+
+        // Payload in PROGMEM as well, see set_payload_P()
+        Publish(const char *topic, const __FlashStringHelper *payload) :
+                Message(MQTT_PUBLISH) {
+            set_topic(topic);
+            set_payload_P((PGM_P) payload, strlen_P((PGM_P) payload));
+        }
+
+        Publish(const __FlashStringHelper *topic, const __FlashStringHelper *payload) :
+                Message(MQTT_PUBLISH) {
+            set_topic(topic);
+            set_payload_P((PGM_P) payload, strlen_P((PGM_P) payload));
+        }
+
+        // Construct from a network buffer, the payload is used in place
+        // Check well_formed() first, a packet that is not comes out empty
+        Publish(uint8_t flags, uint8_t *data, size_t length);
+
+        // Whether the topic and packet id of a network buffer fit in its length
+        static bool well_formed(uint8_t flags, const uint8_t *data, size_t length);
+
         uint8_t response_type(void) const;
 
+        // Size of the whole packet, fixed header included
+        size_t packet_len(void) const;
+
+        // Encode the whole packet into buf, which must hold packet_len() bytes
+        size_t encode(uint8_t *buf);
+
+        // Point at a different payload (BufferedPublish copies it)
+        Publish &set_payload(const uint8_t *payload, size_t len) {
+            init((uint8_t *) payload, len);
+            return *this;
+        }
+
+        // Use a payload in PROGMEM, copied out in chunks as the packet is written
+        // payload() and payload_string() then point to PROGMEM too
+        Publish &set_payload_P(PGM_P payload, size_t len) {
+            _payload = (uint8_t *) payload;
+            _payload_len = len;
+            _payload_P = true;
+            return *this;
+        }
+
+        bool payload_P(void) const { return _payload_P; }
+
         // Get or set retain flag
         bool retain(void) const { return (bool) (_flags & 0x01); }
 
@@ -164,7 +393,12 @@ namespace MQTT {
             return *this;
         }
 
-        virtual char *topic(void) const { return (char *) _topic.c_str(); }
+        // Points to PROGMEM if constructed from a __FlashStringHelper
+        virtual char *topic(void) const { return (char *) (_topic_ref ? _topic_ref : _topic.c_str()); }
+
+        size_t topic_len(void) const { return _topic_len; }
+
+        bool topic_P(void) const { return _topic_P; }
 
         virtual uint8_t *payload(void) const { return _payload; }
 
@@ -177,21 +411,22 @@ namespace MQTT {
     protected:
         uint8_t _buffer[MQTT_MAX_PAYLOAD_SIZE];
 
-        virtual void init(String topic, uint8_t *payload, size_t len) {
-            _topic = topic;
+        virtual void init(uint8_t *payload, size_t len) {
             _payload_len = len;
+            _payload_P = false;
 
             memcpy(_buffer, payload, len);
             memset(_buffer + len, 0, MQTT_MAX_PAYLOAD_SIZE - len);
         }
 
     public:
-        BufferedPublish(String topic, uint8_t *payload, size_t len) {
-            init(topic, payload, len);
+        BufferedPublish(const String &topic, uint8_t *payload, size_t len) {
+            set_topic(topic);
+            init(payload, len);
         }
 
-        BufferedPublish(String topic, String &payload) {
-            _topic = topic;
+        BufferedPublish(const String &topic, String &payload) {
+            set_topic(topic);
             _payload_len = 0;
             memset(_buffer, 0, MQTT_MAX_PAYLOAD_SIZE);
             if (payload.length() > 0) {
@@ -200,17 +435,22 @@ namespace MQTT {
             }
         }
 
-        BufferedPublish(String topic, const __FlashStringHelper *payload) {
-            _topic = topic;
+        BufferedPublish(const String &topic, const __FlashStringHelper *payload) {
+            set_topic(topic);
             _payload_len = strlen_P((PGM_P) payload);
-            strncpy((char *) _payload, (PGM_P) payload, _payload_len);
+            if (_payload_len > MQTT_MAX_PAYLOAD_SIZE)
+                _payload_len = MQTT_MAX_PAYLOAD_SIZE;
+            memset(_buffer, 0, MQTT_MAX_PAYLOAD_SIZE);
+            memcpy_P(_buffer, (PGM_P) payload, _payload_len);
         }
 
-        BufferedPublish(String topic, PGM_P payload, size_t length) {
-            _topic = topic;
+        BufferedPublish(const String &topic, PGM_P payload, size_t length) {
+            set_topic(topic);
             _payload_len = length;
+            if (_payload_len > MQTT_MAX_PAYLOAD_SIZE)
+                _payload_len = MQTT_MAX_PAYLOAD_SIZE;
             memset(_buffer, 0, MQTT_MAX_PAYLOAD_SIZE);
-            memcpy_P(_buffer, payload, length);
+            memcpy_P(_buffer, payload, _payload_len);
         }
 
         // Construct from a network buffer
@@ -222,10 +462,31 @@ namespace MQTT {
         virtual char *payload_string(void) const { return (char *) _buffer; }
     };
 
+    // A publish repeated with fresh payloads, e.g. periodic telemetry
+    // The topic is encoded with its length prefix once, so each send only adds the
+    // packet id and payload
+    class PublishTemplate : public Publish {
+    protected:
+        uint8_t _encoded[2 + MQTT_TEMPLATE_TOPIC_SIZE];
+        uint8_t _encoded_len;       // 0 if the topic did not fit
+
+        bool write_variable_header(uint8_t *buf, size_t &bufpos);
+
+        void encode(void);
+
+    public:
+        PublishTemplate(const String &topic, uint8_t qos = 0, bool retain = false);
+
+        PublishTemplate(const char *topic, uint8_t qos = 0, bool retain = false);
+
+        PublishTemplate(const __FlashStringHelper *topic, uint8_t qos = 0, bool retain = false);
+
+    };
+
     // Response to Publish when qos == 1
     class PublishAck : public Message {
     private:
-        bool write_variable_header(uint8_t *buf, size_t &bufpos) { }
+        bool write_variable_header(uint8_t *buf, size_t &bufpos);
 
     public:
         // Construct with a packet id
@@ -282,10 +543,56 @@ namespace MQTT {
         PublishComp(uint8_t *data, size_t length);
     };
 
+    // Response to Connect
+    class ConnectAck : public Message {
+    private:
+        bool _session_present;
+        uint8_t _rc;
+
+        bool write_variable_header(uint8_t *buf, size_t &bufpos) { return true; }
+
+    public:
+        // Construct from a network buffer
+        ConnectAck(uint8_t *data, size_t length);
+
+        bool session_present(void) const { return _session_present; }
+
+        // 0 means the connection was accepted
+        uint8_t return_code(void) const { return _rc; }
+    };
+
+
+    // Response to Subscribe
+    class SubscribeAck : public Message {
+    private:
+        uint8_t _rc;
+
+        bool write_variable_header(uint8_t *buf, size_t &bufpos) { return true; }
+
+    public:
+        // Construct from a network buffer
+        SubscribeAck(uint8_t *data, size_t length);
+
+        // Granted QoS of the first topic, 0x80 on failure
+        uint8_t return_code(void) const { return _rc; }
+    };
+
+
+    // Response to Unsubscribe
+    class UnsubscribeAck : public Message {
+    private:
+        bool write_variable_header(uint8_t *buf, size_t &bufpos) { return true; }
+
+    public:
+        // Construct from a network buffer
+        UnsubscribeAck(uint8_t *data, size_t length);
+    };
+
+
     // Ping the broker
     class Ping : public Message {
     private:
-        bool write_variable_header(uint8_t *buf, size_t &bufpos) { }
+        bool write_variable_header(uint8_t *buf, size_t &bufpos) { return true; }
     public:
         // Constructor
         Ping() :
@@ -303,7 +610,7 @@ namespace MQTT {
     // Response to Ping
     class PingResp : public Message {
     private:
-        bool write_variable_header(uint8_t *buf, size_t &bufpos) { }
+        bool write_variable_header(uint8_t *buf, size_t &bufpos) { return true; }
 
     public:
         // Constructor
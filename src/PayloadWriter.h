@@ -0,0 +1,298 @@
+/*
+ PayloadWriter.h - Formats numbers and a small JSON subset straight into a byte buffer.
+*/
+
+#ifndef PayloadWriter_h
+#define PayloadWriter_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace MQTT {
+    // Anything that does not fit sets overflow() and is dropped, so a sketch only has to
+    // check once at the end. Nothing is allocated and nothing is NUL-terminated
+    class PayloadWriter {
+    private:
+        uint8_t *_buf;
+        size_t _size;
+        size_t _len;
+        bool _overflow;
+        bool _after_key;
+        uint8_t _depth;
+        uint32_t _started;          // Bit per nesting level: an element was written, the next needs a comma
+
+        void put(const char *s, size_t n) {
+            if (_overflow || n > _size - _len) {
+                _overflow = true;
+                return;
+            }
+            memcpy(_buf + _len, s, n);
+            _len += n;
+        }
+
+        void put(char c) {
+            put(&c, 1);
+        }
+
+        void put_unsigned(unsigned long v) {
+            char digits[20];
+            uint8_t n = 0;
+            do {
+                digits[sizeof(digits) - ++n] = (char) ('0' + v % 10);
+                v /= 10;
+            } while (v);
+            put(digits + sizeof(digits) - n, n);
+        }
+
+        // Comma before any but the first element of an object or array
+        void separate(void) {
+            if (_after_key) {
+                _after_key = false;
+                return;
+            }
+            if (_depth == 0)
+                return;
+
+            uint32_t bit = 1UL << (_depth - 1);
+            if (_started & bit)
+                put(',');
+            _started |= bit;
+        }
+
+        void open(char c) {
+            separate();
+            put(c);
+            if (_depth >= 32) {
+                _overflow = true;
+                return;
+            }
+            _started &= ~(1UL << _depth);
+            _depth++;
+        }
+
+        void close(char c) {
+            if (_depth)
+                _depth--;
+            put(c);
+        }
+
+        void quoted(const char *s) {
+            put('"');
+            for (const char *run = s; ; s++) {
+                char c = *s;
+                if (c != 0 && c != '"' && c != '\\' && (uint8_t) c >= 0x20)
+                    continue;
+
+                put(run, s - run);
+                if (c == 0)
+                    break;
+
+                static const char hex[] = "0123456789abcdef";
+                char esc[6] = {'\\', c, 0, 0, 0, 0};
+                if ((uint8_t) c < 0x20) {
+                    esc[1] = 'u';
+                    esc[2] = esc[3] = '0';
+                    esc[4] = hex[(uint8_t) c >> 4];
+                    esc[5] = hex[c & 0x0f];
+                    put(esc, 6);
+                } else {
+                    put(esc, 2);
+                }
+                run = s + 1;
+            }
+            put('"');
+        }
+
+    public:
+        PayloadWriter(uint8_t *buf, size_t size) :
+                _buf(buf), _size(size), _len(0),
+                _overflow(false), _after_key(false),
+                _depth(0), _started(0) { }
+
+        // Plain text and numbers, no separators
+        PayloadWriter &add(const char *s) {
+            put(s, strlen(s));
+            return *this;
+        }
+
+        PayloadWriter &add(char c) {
+            put(c);
+            return *this;
+        }
+
+        PayloadWriter &add(long v) {
+            if (v < 0) {
+                put('-');
+                put_unsigned(0UL - (unsigned long) v);
+            } else {
+                put_unsigned((unsigned long) v);
+            }
+            return *this;
+        }
+
+        PayloadWriter &add(int v) { return add((long) v); }
+
+        PayloadWriter &add(unsigned long v) {
+            put_unsigned(v);
+            return *this;
+        }
+
+        PayloadWriter &add(unsigned int v) { return add((unsigned long) v); }
+
+        // Fixed point: add_fixed(2345, 2) writes 23.45
+        PayloadWriter &add_fixed(long v, uint8_t decimals) {
+            unsigned long u = v < 0 ? 0UL - (unsigned long) v : (unsigned long) v;
+            unsigned long scale = 1;
+            for (uint8_t i = 0; i < decimals; i++)
+                scale *= 10;
+
+            if (v < 0)
+                put('-');
+            put_unsigned(u / scale);
+            if (decimals) {
+                put('.');
+                unsigned long frac = u % scale;
+                for (unsigned long s = scale / 10; s > 1 && frac < s; s /= 10)
+                    put('0');
+                put_unsigned(frac);
+            }
+            return *this;
+        }
+
+        // Rounded to decimals places (at most 9), a magnitude beyond 4294967295 sets overflow()
+        PayloadWriter &add(double v, uint8_t decimals = 2) {
+            if (v != v) {
+                put("nan", 3);
+                return *this;
+            }
+            if (v < 0) {
+                put('-');
+                v = -v;
+            }
+            if (v >= 4294967295.0) {
+                _overflow = true;
+                return *this;
+            }
+            if (decimals > 9)
+                decimals = 9;
+
+            unsigned long scale = 1;
+            for (uint8_t i = 0; i < decimals; i++)
+                scale *= 10;
+
+            unsigned long whole = (unsigned long) v;
+            unsigned long frac = (unsigned long) ((v - whole) * scale + 0.5);
+            if (frac >= scale) {
+                whole++;
+                frac -= scale;
+            }
+
+            put_unsigned(whole);
+            if (decimals) {
+                put('.');
+                for (unsigned long s = scale / 10; s > 1 && frac < s; s /= 10)
+                    put('0');
+                put_unsigned(frac);
+            }
+            return *this;
+        }
+
+        // JSON: commas, quotes and escapes are taken care of
+        // e.g. w.begin_object().key("t").value(21.5, 1).key("ok").value(true).end_object()
+        PayloadWriter &begin_object(void) {
+            open('{');
+            return *this;
+        }
+
+        PayloadWriter &end_object(void) {
+            close('}');
+            return *this;
+        }
+
+        PayloadWriter &begin_array(void) {
+            open('[');
+            return *this;
+        }
+
+        PayloadWriter &end_array(void) {
+            close(']');
+            return *this;
+        }
+
+        PayloadWriter &key(const char *k) {
+            separate();
+            quoted(k);
+            put(':');
+            _after_key = true;
+            return *this;
+        }
+
+        PayloadWriter &value(const char *s) {
+            separate();
+            quoted(s);
+            return *this;
+        }
+
+        PayloadWriter &value(long v) {
+            separate();
+            return add(v);
+        }
+
+        PayloadWriter &value(int v) { return value((long) v); }
+
+        PayloadWriter &value(unsigned long v) {
+            separate();
+            return add(v);
+        }
+
+        PayloadWriter &value(unsigned int v) { return value((unsigned long) v); }
+
+        PayloadWriter &value_fixed(long v, uint8_t decimals) {
+            separate();
+            return add_fixed(v, decimals);
+        }
+
+        // NaN is written as null, JSON has no other way to say it
+        PayloadWriter &value(double v, uint8_t decimals = 2) {
+            separate();
+            if (v != v) {
+                put("null", 4);
+                return *this;
+            }
+            return add(v, decimals);
+        }
+
+        PayloadWriter &value(bool b) {
+            separate();
+            if (b)
+                put("true", 4);
+            else
+                put("false", 5);
+            return *this;
+        }
+
+        PayloadWriter &null(void) {
+            separate();
+            put("null", 4);
+            return *this;
+        }
+
+        const uint8_t *data(void) const { return _buf; }
+
+        size_t length(void) const { return _len; }
+
+        bool overflow(void) const { return _overflow; }
+
+        // Start over on the same buffer
+        void clear(void) {
+            _len = 0;
+            _overflow = false;
+            _after_key = false;
+            _depth = 0;
+            _started = 0;
+        }
+    };
+}
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ PosixClient.cpp - Client over a plain BSD socket, for building the library on a host.
+*/
+
+#include "PosixClient.h"
+
+#ifdef MQTT_HOST_BUILD
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+int PosixClient::open(const struct sockaddr *addr, socklen_t len) {
+    int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return 0;
+
+    // Packets are already written whole, don't let Nagle hold them back
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Returns with the handshake under way, what is written meanwhile is held back
+    // until the socket becomes writable, and a refusal shows up as a read or write error
+    if (::connect(fd, addr, len) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return 0;
+    }
+    _fd = fd;
+    _open = true;
+    return 1;
+}
+
+int PosixClient::connect(IPAddress ip, uint16_t port) {
+    stop();
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    uint8_t octets[4] = {ip[0], ip[1], ip[2], ip[3]};
+    memcpy(&addr.sin_addr, octets, 4);
+    return open((struct sockaddr *) &addr, sizeof(addr));
+}
+
+int PosixClient::connect(const char *host, uint16_t port) {
+    stop();
+
+    if (!(_addr_len && _port == port && _host == host) && !resolve(host, port))
+        return 0;
+    return open((struct sockaddr *) &_addr, _addr_len);
+}
+
+bool PosixClient::resolve(const char *host, uint16_t port) {
+    char service[6];
+    snprintf(service, sizeof(service), "%u", port);
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, service, &hints, &res) != 0)
+        return false;
+
+    // Only the first address, the connect does not wait to see whether it answers
+    memcpy(&_addr, res->ai_addr, res->ai_addrlen);
+    _addr_len = res->ai_addrlen;
+    _host = host;
+    _port = port;
+    freeaddrinfo(res);
+    return true;
+}
+
+size_t PosixClient::write(uint8_t b) {
+    return write(&b, 1);
+}
+
+size_t PosixClient::send_some(const uint8_t *buf, size_t size) {
+    size_t sent = 0;
+    while (sent < size) {
+        ssize_t n = send(_fd, buf + sent, size - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                _open = false;
+            break;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+size_t PosixClient::write(const uint8_t *buf, size_t size) {
+    if (_fd < 0 || !_open)
+        return 0;
+
+    // Nothing overtakes what is already held back
+    size_t sent = write_pending() ? send_some(buf, size) : 0;
+    if (!_open)
+        return sent;
+
+    size_t held = min(size - sent, MQTT_SOCKET_BACKLOG - _backlog.size());
+    _backlog.insert(_backlog.end(), buf + sent, buf + sent + held);
+    return sent + held;
+}
+
+bool PosixClient::write_pending(void) {
+    if (_backlog.empty())
+        return true;
+
+    size_t sent = _fd >= 0 && _open ? send_some(&_backlog[0], _backlog.size()) : 0;
+    if (!_open) {
+        // Nowhere to go any more
+        _backlog.clear();
+        return false;
+    }
+    _backlog.erase(_backlog.begin(), _backlog.begin() + sent);
+    return _backlog.empty();
+}
+
+int PosixClient::available() {
+    if (_fd < 0)
+        return 0;
+    write_pending();
+
+    int count = 0;
+    if (ioctl(_fd, FIONREAD, &count) < 0)
+        return 0;
+
+    // Nothing to read may also mean the other end has closed, which only a read tells
+    if (count == 0 && _open)
+        peek();
+    return count;
+}
+
+int PosixClient::read() {
+    uint8_t b;
+    return read(&b, 1) == 1 ? b : -1;
+}
+
+int PosixClient::read(uint8_t *buf, size_t size) {
+    if (_fd < 0)
+        return -1;
+
+    ssize_t n = recv(_fd, buf, size, MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        _open = false;
+    return n > 0 ? (int) n : -1;
+}
+
+int PosixClient::peek() {
+    if (_fd < 0)
+        return -1;
+
+    uint8_t b;
+    ssize_t n = recv(_fd, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        _open = false;
+    return n == 1 ? b : -1;
+}
+
+void PosixClient::flush() {
+    write_pending();
+}
+
+void PosixClient::stop() {
+    if (_fd >= 0) {
+        // A last try for what is held back, e.g. a DISCONNECT
+        write_pending();
+        close(_fd);
+        _fd = -1;
+    }
+    _open = false;
+    _backlog.clear();
+}
+
+uint8_t PosixClient::connected() {
+    // Like the Arduino clients, stay "connected" while unread data remains
+    return _fd >= 0 && (_open || available() > 0);
+}
+
+#endif // MQTT_HOST_BUILD
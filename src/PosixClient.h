@@ -0,0 +1,82 @@
+/*
+ PosixClient.h - Client over a plain BSD socket, for building the library on a host.
+*/
+
+#ifndef PosixClient_h
+#define PosixClient_h
+
+#ifdef MQTT_HOST_BUILD
+
+#include <Arduino.h>
+#include <Client.h>
+#include <IPAddress.h>
+#include <sys/socket.h>
+#include <vector>
+
+// MQTT_SOCKET_BACKLOG : Bytes held back while the socket is full, writes beyond it come up short
+#define MQTT_SOCKET_BACKLOG 65536
+
+class PosixClient : public Client {
+private:
+    int _fd;
+    bool _open;                     // Cleared by the first read or write to fail, or end of stream
+    std::vector<uint8_t> _backlog;  // Written but not yet taken by the socket
+
+    // Last name resolved, reused while connect() is given the same one
+    String _host;
+    uint16_t _port;
+    struct sockaddr_storage _addr;
+    socklen_t _addr_len;
+
+    int open(const struct sockaddr *addr, socklen_t len);
+
+    // Send what the socket takes without blocking
+    size_t send_some(const uint8_t *buf, size_t size);
+
+public:
+    PosixClient() : _fd(-1), _open(false), _port(0), _addr_len(0) { }
+
+    ~PosixClient() { stop(); }
+
+    // Neither waits for the TCP handshake. A host name is only looked up (which
+    // blocks) when it differs from the last one, see resolve()
+    int connect(IPAddress ip, uint16_t port);
+
+    int connect(const char *host, uint16_t port);
+
+    // Look up host ahead of connecting to it, so connect() does not have to
+    bool resolve(const char *host, uint16_t port);
+
+    size_t write(uint8_t b);
+
+    size_t write(const uint8_t *buf, size_t size);
+
+    int available();
+
+    int read();
+
+    int read(uint8_t *buf, size_t size);
+
+    int peek();
+
+    void flush();
+
+    void stop();
+
+    uint8_t connected();
+
+    operator bool() { return _fd >= 0; }
+
+    // The underlying socket, for registering with poll()/epoll(). -1 when closed
+    int fd(void) const { return _fd; }
+
+    // The socket is non-blocking: what it does not take is held back, and retried by the
+    // next write, available() or write_pending(), which returns true once nothing is left
+    size_t pending(void) const { return _backlog.size(); }
+
+    bool write_pending(void);
+};
+
+#endif // MQTT_HOST_BUILD
+
+#endif
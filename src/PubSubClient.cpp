@@ -7,30 +7,81 @@
 #include "PubSubClient.h"
 #include "MQTT.h"
 #include <string.h>
+#include <math.h>
 
 PubSubClient::PubSubClient() :
-        _max_retries(10),
+        server_port(0),
+        _ssl(false),
         _callback(NULL),
         _callback_data(NULL),
-        _stream(NULL) { }
+        _stream(NULL),
+        _chunk_callback(NULL),
+        _chunk_data(NULL),
+        _max_retries(10),
+        nextMsgId(0),
+        lastOutActivity(0),
+        lastInActivity(0),
+        pingOutstanding(false),
+        _connecting(false),
+        _backoff_min(0),
+        _backoff_max(0),
+        _backoff(0),
+        _ack_len(0),
+        _qos2_count(0),
+        _rx_busy(0),
+        _rx_head(0),
+        _rx_count(0),
+        _rx_high_water(MQTT_RX_QUEUE_SLOTS) { }
 
 PubSubClient::PubSubClient(IPAddress &ip, uint16_t port, bool ssl) :
-        _max_retries(10),
-        _callback(NULL),
-        _callback_data(NULL),
-        _stream(NULL),
         server_ip(ip),
         server_port(port),
-        _ssl(ssl) { }
-
-PubSubClient::PubSubClient(String hostname, uint16_t port, bool ssl) :
-        _max_retries(10),
+        _ssl(ssl),
         _callback(NULL),
         _callback_data(NULL),
         _stream(NULL),
+        _chunk_callback(NULL),
+        _chunk_data(NULL),
+        _max_retries(10),
+        nextMsgId(0),
+        lastOutActivity(0),
+        lastInActivity(0),
+        pingOutstanding(false),
+        _connecting(false),
+        _backoff_min(0),
+        _backoff_max(0),
+        _backoff(0),
+        _ack_len(0),
+        _qos2_count(0),
+        _rx_busy(0),
+        _rx_head(0),
+        _rx_count(0),
+        _rx_high_water(MQTT_RX_QUEUE_SLOTS) { }
+
+PubSubClient::PubSubClient(const String &hostname, uint16_t port, bool ssl) :
         server_hostname(hostname),
         server_port(port),
-        _ssl(ssl) { }
+        _ssl(ssl),
+        _callback(NULL),
+        _callback_data(NULL),
+        _stream(NULL),
+        _chunk_callback(NULL),
+        _chunk_data(NULL),
+        _max_retries(10),
+        nextMsgId(0),
+        lastOutActivity(0),
+        lastInActivity(0),
+        pingOutstanding(false),
+        _connecting(false),
+        _backoff_min(0),
+        _backoff_max(0),
+        _backoff(0),
+        _ack_len(0),
+        _qos2_count(0),
+        _rx_busy(0),
+        _rx_head(0),
+        _rx_count(0),
+        _rx_high_water(MQTT_RX_QUEUE_SLOTS) { }
 
 PubSubClient &PubSubClient::set_server(IPAddress &ip, uint16_t port, bool ssl) {
     server_ip = ip;
@@ -39,7 +90,7 @@ PubSubClient &PubSubClient::set_server(IPAddress &ip, uint16_t port, bool ssl) {
     return *this;
 }
 
-PubSubClient &PubSubClient::set_server(String hostname, uint16_t port, bool ssl) {
+PubSubClient &PubSubClient::set_server(const String &hostname, uint16_t port, bool ssl) {
     server_hostname = hostname;
     server_port = port;
     _ssl = ssl;
@@ -53,7 +104,7 @@ PubSubClient &PubSubClient::unset_server(void) {
     return *this;
 }
 
-PubSubClient &PubSubClient::set_auth(String u, String p) {
+PubSubClient &PubSubClient::set_auth(const String &u, const String &p) {
     username = u;
     password = p;
     return *this;
@@ -77,206 +128,441 @@ PubSubClient &PubSubClient::unset_callback(void) {
     return *this;
 }
 
-PubSubClient &PubSubClient::set_stream(Stream &s) {
-    _stream = &s;
+PubSubClient &PubSubClient::set_reconnect_backoff(unsigned long min_ms, unsigned long max_ms) {
+    _backoff_min = min_ms;
+    _backoff_max = max(min_ms, max_ms);
+    _backoff = 0;
+    _timers.disarm(MQTT_TIMER_RECONNECT);
     return *this;
 }
 
-PubSubClient &PubSubClient::unset_stream(void) {
-    _stream = NULL;
+PubSubClient &PubSubClient::set_rx_high_water(uint8_t n) {
+    _rx_high_water = max((uint8_t) 1, min(n, (uint8_t) MQTT_RX_QUEUE_SLOTS));
     return *this;
 }
 
-bool PubSubClient::connect(String id) {
-    return connect(id, "", 0, false, "");
+PubSubClient &PubSubClient::set_chunk_callback(chunk_callback_t cb, void *data) {
+    _chunk_callback = cb;
+    _chunk_data = data;
+    return *this;
 }
 
-bool PubSubClient::connect(String id, String willTopic, uint8_t willQos, bool willRetain, String willMessage) {
-    if (!connected()) {
-        int result = 0;
-#ifdef __AIRBIT_CC3200__
-        if (_ssl) {
-            if (server_hostname.length() > 0)
-                result = _client.sslConnect(server_hostname.c_str(), server_port);
-            else
-                result = _client.sslConnect(server_ip, server_port);
-        } else {
-#endif
-            if (server_hostname.length() > 0)
-                result = _client.connect(server_hostname.c_str(), server_port);
-            else
-                result = _client.connect(server_ip, server_port);
-#ifdef __AIRBIT_CC3200__
-        }
-#endif
+PubSubClient &PubSubClient::unset_chunk_callback(void) {
+    _chunk_callback = NULL;
+    _chunk_data = NULL;
+    return *this;
+}
 
-        if (result) {
-            nextMsgId = 1;
-            uint8_t d[9] = {0x00, 0x06, 'M', 'Q', 'I', 's', 'd', 'p', MQTTPROTOCOLVERSION};
-            // Leave room in the buffer for header and variable length field
-            uint16_t length = 5;
-            memcpy(buffer + length, d, 9);
-            length += 9;
-
-            uint8_t v;
-            if (willTopic.length()) {
-                if (willQos > 2)
-                    willQos = 2;
-                v = (uint8_t) (0x06 | (willQos << 3) | (willRetain << 5));
-            } else
-                v = 0x02;
-
-            if (username.length()) {
-                v = (uint8_t) (v | 0x80);
-                if (password.length())
-                    v = (uint8_t) (v | 0x40);
-            }
+PubSubClient &PubSubClient::set_stream_threshold(size_t bytes) {
+    _stream_threshold = bytes;
+    return *this;
+}
 
-            buffer[length++] = v;
+PubSubClient &PubSubClient::set_stream(Stream &s) {
+    _stream = &s;
+    return *this;
+}
 
-            buffer[length++] = ((MQTT_KEEPALIVE) >> 8);
-            buffer[length++] = ((MQTT_KEEPALIVE) & 0xFF);
-            length = writeString(id, buffer, length);
-            if (willTopic.length()) {
-                length = writeString(willTopic, buffer, length);
-                length = writeString(willMessage, buffer, length);
-            }
+PubSubClient &PubSubClient::unset_stream(void) {
+    _stream = NULL;
+    return *this;
+}
 
-            if (username.length()) {
-                length = writeString(username, buffer, length);
-                if (password.length())
-                    length = writeString(password, buffer, length);
-            }
+bool PubSubClient::connect(const String &id) {
+    return connect(id.c_str(), NULL, 0, false, NULL);
+}
+
+bool PubSubClient::connect(const char *id) {
+    return connect(id, NULL, 0, false, NULL);
+}
 
-            write(MQTTCONNECT, buffer, (uint16_t) (length - 5));
+bool PubSubClient::connect(const String &id, const String &willTopic, uint8_t willQos, bool willRetain,
+                           const String &willMessage) {
+    return connect(id.c_str(), willTopic.c_str(), willQos, willRetain, willMessage.c_str());
+}
 
-            lastInActivity = lastOutActivity = millis();
+bool PubSubClient::connect(const char *id, const char *willTopic, uint8_t willQos, bool willRetain,
+                           const char *willMessage) {
+    if (!connected()) {
+        if (!backoff_elapsed())
+            return false;
 
-            while (!_client.available()) {
+        if (send_connect(id, willTopic, willQos, willRetain, willMessage)) {
+            // Nothing else is being sent, so the TX buffer can take the CONNACK
+            mqtt_packet_t packet;
+            while ((packet = readPacket(buffer)).total == 0) {
                 unsigned long t = millis();
-                if (t - lastInActivity > MQTT_KEEPALIVE * 1000UL) {
+                if (t - lastInActivity > MQTT_KEEPALIVE * 1000UL || !_client.connected()) {
                     _client.stop();
+                    backoff();
                     return false;
                 }
             }
 
-            mqtt_packet_t packet = readPacket();
-
             if (packet.total == 4 && buffer[3] == 0) {
-                lastInActivity = millis();
-                pingOutstanding = false;
+                connack_received();
                 return true;
             }
         }
         _client.stop();
+        backoff();
     }
     return false;
 }
 
-uint8_t PubSubClient::readByte() {
-    while (!_client.available()) { }
-    return (uint8_t) _client.read();
+bool PubSubClient::connect_async(const char *id) {
+    if (connected() || !backoff_elapsed())
+        return false;
+
+    if (!send_connect(id, NULL, 0, false, NULL)) {
+        _client.stop();
+        backoff();
+        return false;
+    }
+
+    // The ping timeout bounds the wait, and keeps the keepalive quiet meanwhile
+    _connecting = true;
+    _timers.arm(MQTT_TIMER_PING_TIMEOUT, lastOutActivity + MQTT_KEEPALIVE * 1000UL);
+    return true;
+}
+
+#ifdef MQTT_HOST_BUILD
+bool PubSubClient::resolve(void) {
+    return server_hostname.length() == 0 || _client.resolve(server_hostname.c_str(), server_port);
+}
+#endif
+
+bool PubSubClient::backoff_elapsed(void) {
+    if (_timers.is_armed(MQTT_TIMER_RECONNECT)) {
+        if (!_timers.due(MQTT_TIMER_RECONNECT, millis()))
+            return false;
+        _timers.disarm(MQTT_TIMER_RECONNECT);
+    }
+    return true;
+}
+
+bool PubSubClient::send_connect(const char *id, const char *willTopic, uint8_t willQos, bool willRetain,
+                                const char *willMessage) {
+    int result = 0;
+#ifdef __AIRBIT_CC3200__
+    if (_ssl) {
+        if (server_hostname.length() > 0)
+            result = _client.sslConnect(server_hostname.c_str(), server_port);
+        else
+            result = _client.sslConnect(server_ip, server_port);
+    } else {
+#endif
+        if (server_hostname.length() > 0)
+            result = _client.connect(server_hostname.c_str(), server_port);
+        else
+            result = _client.connect(server_ip, server_port);
+#ifdef __AIRBIT_CC3200__
+    }
+#endif
+
+    if (!result)
+        return false;
+
+    nextMsgId = 1;
+    memset(_inflight, 0, sizeof(_inflight));
+    _ack_len = 0;
+    clear_rx_queue();
+    _qos2_count = 0;
+    _timers.armed = 0;
+    _rtt.reset();
+    pingOutstanding = false;
+    _connecting = false;
+    uint8_t d[9] = {0x00, 0x06, 'M', 'Q', 'I', 's', 'd', 'p', MQTTPROTOCOLVERSION};
+    // Leave room in the buffer for header and variable length field
+    uint16_t length = 5;
+    memcpy(buffer + length, d, 9);
+    length += 9;
+
+    bool will = willTopic != NULL && *willTopic;
+    uint8_t v;
+    if (will) {
+        if (willQos > 2)
+            willQos = 2;
+        v = (uint8_t) (0x06 | (willQos << 3) | (willRetain << 5));
+    } else
+        v = 0x02;
+
+    if (username.length()) {
+        v = (uint8_t) (v | 0x80);
+        if (password.length())
+            v = (uint8_t) (v | 0x40);
+    }
+
+    buffer[length++] = v;
+
+    buffer[length++] = ((MQTT_KEEPALIVE) >> 8);
+    buffer[length++] = ((MQTT_KEEPALIVE) & 0xFF);
+    length = writeString(id, buffer, length);
+    if (will) {
+        length = writeString(willTopic, buffer, length);
+        length = writeString(willMessage ? willMessage : "", buffer, length);
+    }
+
+    if (username.length()) {
+        length = writeString(username.c_str(), buffer, length);
+        if (password.length())
+            length = writeString(password.c_str(), buffer, length);
+    }
+
+    write(MQTTCONNECT, buffer, (uint16_t) (length - 5));
+
+    lastInActivity = lastOutActivity = millis();
+    return true;
+}
+
+void PubSubClient::connack_received(void) {
+    // CONNECT to CONNACK gives the first round trip sample
+    lastInActivity = millis();
+    _rtt.sample(lastInActivity - lastOutActivity);
+    pingOutstanding = false;
+    _backoff = 0;
+    update_keepalive();
+}
+
+void PubSubClient::backoff(void) {
+    if (_backoff_min == 0)
+        return;
+
+    _backoff = _backoff ? min(_backoff * 2, _backoff_max) : _backoff_min;
+    _timers.arm(MQTT_TIMER_RECONNECT, millis() + _backoff);
 }
 
-mqtt_packet_t PubSubClient::readPacket() {
+mqtt_packet_t PubSubClient::readPacket(uint8_t *buf, MQTT::Publish *pub, size_t size) {
+    // Only what is available is read, a packet that has not all arrived yet is
+    // picked up where it was left by the next call
+    mqtt_rx_state_t &st = _rx_part;
     mqtt_packet_t packet;
+    packet.header = 0;
+    packet.data = buf;
+    packet.length = 0;
+    packet.total = 0;
+    packet.streamed = 0;
+
+    // Up to four length bytes, 268435455 at most
+    while (st.lensize == 0) {
+        if (!_client.available())
+            return read_pending(packet);
+
+        uint8_t digit = (uint8_t) _client.read();
+        buf[st.len++] = digit;
+        if (st.len == 1)
+            continue;
+        st.length += (uint32_t) (digit & 0x7f) << (7 * (st.len - 2));
+        if (!(digit & 0x80) || st.len == 5)
+            st.lensize = (uint8_t) (st.len - 1);
+    }
 
-    uint16_t lensize;
-    uint16_t len = 0;
-    buffer[len++] = readByte();
-    bool isPublish = (buffer[0] & 0xF0) == MQTTPUBLISH;
-    uint8_t shifter = 0;
-    uint16_t length = 0;
-    uint8_t digit = 0;
-    uint16_t skip = 0;
-    uint8_t start = 0;
+    uint32_t start = 1 + st.lensize;
+    bool isPublish = (buf[0] & 0xF0) == MQTTPUBLISH;
+    if (isPublish && pub && (_stream || _chunk_callback) && start + st.length > MQTT_MAX_PACKET_SIZE) {
+        // Too big to keep: read the topic and packet id, then hand the payload to the
+        // sink in chunks the size of whatever is left of buf
+        while (st.len < start + 2) {
+            if (!_client.available())
+                return read_pending(packet);
+            buf[st.len++] = (uint8_t) _client.read();
+        }
 
-    do {
-        digit = readByte();
-        buffer[len++] = digit;
-        length += (digit & 0x7f) << shifter;
-        shifter += 7;
-    } while (digit & 0x80);
-    lensize = (uint8_t) (len - 1);
+        // Kept, parsing the topic moves it over its length
+        if (st.header == 0) {
+            st.header = (uint16_t) (2 + ((buf[start] << 8) | buf[start + 1]));
+            if (buf[0] & (MQTTQOS1 | MQTTQOS2))
+                st.header += 2;
+        }
+        uint16_t header = st.header;
+
+        if (start + header - 2 >= MQTT_MAX_PACKET_SIZE) {
+            // Not even the topic fits, skip the packet
+            while (st.offset < st.length - 2) {
+                if (!_client.available())
+                    return read_pending(packet);
+                _client.read();
+                st.offset++;
+            }
+            st = mqtt_rx_state_t();
+            return packet;
+        }
 
-    if (isPublish) {
-        // Read in topic length to calculate bytes to skip over for Stream writing
-        buffer[len++] = readByte();
-        buffer[len++] = readByte();
-        skip = (buffer[lensize + 1] << 8) | buffer[lensize + 2];
-        start = 2;
-        if (buffer[0] & MQTTQOS1) {
-            // skip message id
-            skip += 2;
+        while (st.len < start + header) {
+            if (!_client.available())
+                return read_pending(packet);
+            buf[st.len++] = (uint8_t) _client.read();
         }
-    }
 
-    for (uint16_t i = start; i < length; i++) {
-        digit = readByte();
-        if (_stream) if (isPublish && len - lensize - 2 > skip)
-            send(digit);
-        if (len < MQTT_MAX_PACKET_SIZE) {
-            buffer[len] = digit;
+        uint32_t total = st.length - header;
+        if (!st.parsed) {
+            // Parsed here for the sink, the topic is terminated in place so this happens once
+            *pub = MQTT::Publish(buf[0] & 0x0f, buf + start, header);
+            st.parsed = true;
+#ifdef MQTT_LZ
+            if (MQTT::lz_flagged(pub->topic(), pub->topic_len())) {
+                _lz.reset();
+                _lz_pub = pub;
+            }
+#endif
+        }
+
+#ifdef MQTT_LZ
+        bool lz = _lz_pub == pub && MQTT::lz_flagged(pub->topic(), pub->topic_len());
+#endif
+        uint8_t *chunk = buf + st.len;
+        size_t room = MQTT_MAX_PACKET_SIZE - st.len;
+        while (st.offset < total) {
+            if (!_client.available())
+                return read_pending(packet);
+
+            int n = _client.read(chunk, min(room, (size_t) (total - st.offset)));
+            if (n <= 0)
+                return read_pending(packet);
+#ifdef MQTT_LZ
+            // Whatever follows a corrupt stream is dropped, and lz_finish() reports it
+            if (lz)
+                _lz.write(chunk, n, lz_sink, this);
+            else
+#endif
+            sink_chunk(*pub, chunk, n, st.offset, total);
+            st.offset += n;
+        }
+#ifdef MQTT_LZ
+        if (lz)
+            lz_finish();
+#endif
+        packet.streamed = st.offset;
+    } else {
+        while (st.len - start < st.length) {
+            if (!_client.available())
+                return read_pending(packet);
+            uint8_t digit = (uint8_t) _client.read();
+            if (st.len < size)
+                buf[st.len] = digit;
+            st.len++;
         }
-        len++;
-    }
 
-    if ((!_stream) && (len > MQTT_MAX_PACKET_SIZE)) {
-        len = 0; // This will cause the packet to be ignored.
+        if (st.len > size) {
+            st = mqtt_rx_state_t(); // This will cause the packet to be ignored.
+            return packet;
+        }
     }
 
-    packet.header = buffer[0];
-    packet.data = buffer + lensize + 1;
-    packet.length = (size_t) (len - lensize - 1);
-    packet.total = len;
+    packet.header = buf[0];
+    packet.data = buf + start;
+    packet.length = (size_t) (st.len - start);
+    packet.total = st.len;
+    st = mqtt_rx_state_t();
+    return packet;
+}
 
+mqtt_packet_t &PubSubClient::read_pending(mqtt_packet_t &packet) {
+    // With the connection gone the rest will never come
+    if (!_client.connected())
+        _rx_part = mqtt_rx_state_t();
     return packet;
 }
 
-MQTT::Message *PubSubClient::readMessage() {
-    mqtt_packet_t packet = readPacket();
-    uint8_t type = packet.header >> 4;
-    uint8_t flags = (uint8_t) (packet.header & 0x0f);
+void PubSubClient::sink_chunk(const MQTT::Publish &pub, const uint8_t *chunk, size_t length, uint32_t offset,
+                              uint32_t total) {
+    if (_stream)
+        _stream->write(chunk, length);
+    if (_chunk_callback)
+        _chunk_callback(pub, chunk, length, offset, total, _chunk_data);
+}
 
-    MQTT::Message *message = NULL;
-    switch (type) {
-        case MQTT_CONNACK:
-            break;
-        case MQTT_PUBLISH:
-            message = new MQTT::BufferedPublish(flags, packet.data, packet.length);
-            break;
+#ifdef MQTT_LZ
+void PubSubClient::lz_sink(const uint8_t *data, size_t len, void *client) {
+    PubSubClient *c = (PubSubClient *) client;
+    c->sink_chunk(*c->_lz_pub, data, len, c->_lz.produced() - len, c->_lz.total());
+}
+
+void PubSubClient::lz_finish(void) {
+    if (_lz.done())
+        return;
+    _lz_errors++;
+    if (_chunk_callback)
+        _chunk_callback(*_lz_pub, NULL, 0, _lz.produced(), _lz.total(), _chunk_data);
+}
+#endif
+
+bool PubSubClient::processPacket(mqtt_packet_t &packet, uint8_t match_type, uint16_t match_pid) {
+    // Decoded on the stack, so acks and pings never touch the heap
+    switch (packet.header >> 4) {
+        case MQTT_CONNACK: {
+            MQTT::ConnectAck msg(packet.data, packet.length);
+            return processMessage(&msg, match_type, match_pid);
+        }
+        case MQTT_PUBACK: {
+            MQTT::PublishAck msg(packet.data, packet.length);
+            return processMessage(&msg, match_type, match_pid);
+        }
+        case MQTT_PUBREC: {
+            MQTT::PublishRec msg(packet.data, packet.length);
+            return processMessage(&msg, match_type, match_pid);
+        }
+        case MQTT_PUBREL: {
+            MQTT::PublishRel msg(packet.data, packet.length);
+            return processMessage(&msg, match_type, match_pid);
+        }
+        case MQTT_PUBCOMP: {
+            MQTT::PublishComp msg(packet.data, packet.length);
+            return processMessage(&msg, match_type, match_pid);
+        }
+        case MQTT_SUBACK: {
+            MQTT::SubscribeAck msg(packet.data, packet.length);
+            return processMessage(&msg, match_type, match_pid);
+        }
+        case MQTT_UNSUBACK: {
+            MQTT::UnsubscribeAck msg(packet.data, packet.length);
+            return processMessage(&msg, match_type, match_pid);
+        }
+        case MQTT_PINGREQ: {
+            MQTT::Ping msg(packet.data, packet.length);
+            return processMessage(&msg, match_type, match_pid);
+        }
+        case MQTT_PINGRESP: {
+            MQTT::PingResp msg(packet.data, packet.length);
+            return processMessage(&msg, match_type, match_pid);
+        }
+        default:
+            return false;
+    }
+}
+
+
+bool PubSubClient::processMessage(MQTT::Message *msg, uint8_t match_type, uint16_t match_pid) {
+    lastInActivity = millis();
+
+    // The exchange this completes no longer needs its packet id
+    switch (msg->type()) {
         case MQTT_PUBACK:
-            message = new MQTT::PublishAck(packet.data, packet.length);
-            break;
-        case MQTT_PUBREC:
-            message = new MQTT::PublishRec(packet.data, packet.length);
-            break;
-        case MQTT_PUBREL:
-            message = new MQTT::PublishRel(packet.data, packet.length);
-            break;
         case MQTT_PUBCOMP:
-            message = new MQTT::PublishComp(packet.data, packet.length);
-            break;
         case MQTT_SUBACK:
-            break;
         case MQTT_UNSUBACK:
+            release_packet_id(msg->packet_id());
             break;
-        case MQTT_PINGREQ:
-            message = new MQTT::Ping(packet.data, packet.length);
+    }
+
+#ifdef MQTT_COROUTINES
+    switch (msg->type()) {
+        case MQTT_CONNACK:
+            if (resolve_waiter(MQTT_CONNACK, 0, static_cast<MQTT::ConnectAck *>(msg)->return_code() == 0))
+                return false;
             break;
-        case MQTT_PINGRESP:
-            message = new MQTT::PingResp(packet.data, packet.length);
+        case MQTT_SUBACK:
+            if (resolve_waiter(MQTT_SUBACK, msg->packet_id(), static_cast<MQTT::SubscribeAck *>(msg)->return_code() != 0x80))
+                return false;
             break;
-        default:
+        case MQTT_PUBACK:
+        case MQTT_PUBREC:
+        case MQTT_PUBCOMP:
+            if (resolve_waiter(msg->type(), msg->packet_id(), true))
+                return false;
             break;
     }
-
-    return message;
-}
-
-
-bool PubSubClient::processMessage(MQTT::Message *msg, uint8_t match_type, uint16_t match_pid) {
-    lastInActivity = millis();
+#endif
     if (msg->type() == match_type) {
         if (match_pid)
             return msg->packet_id() == match_pid;
@@ -287,167 +573,292 @@ bool PubSubClient::processMessage(MQTT::Message *msg, uint8_t match_type, uint16
         case MQTT_PUBLISH: {
             MQTT::Publish *pub = static_cast<MQTT::Publish *>(msg);    // RTTI is disabled, so no dynamic_cast<>()
 
-            if (_callback)
-                _callback(*pub, _callback_data);
+            if (pub->qos() == 2) {
+                // receive() recorded the id and answered any resend, so this is the first
+                if (_callback)
+                    _callback(*pub, _callback_data);
+                queue_ack(MQTTPUBREC, pub->packet_id());
+                break;
+            }
 
+#if MQTT_QOS1_WINDOW > 0
             if (pub->qos() == 1) {
-                MQTT::PublishAck puback(pub->packet_id());
-                puback.send(_client);
-                lastOutActivity = millis();
+                // A redelivery of something the callback already had only needs its PUBACK
+                if (pub->dup() && _qos1_seen.contains(pub->packet_id())) {
+                    queue_ack(MQTTPUBACK, pub->packet_id());
+                    break;
+                }
+                _qos1_seen.add(pub->packet_id());
+            }
+#endif
 
-            } else if (pub->qos() == 2) {
-                uint8_t retries = 0;
+            if (_callback)
+                _callback(*pub, _callback_data);
 
-                MQTT::PublishRec pubrec(pub->packet_id());
-                if (!sendReliably(pubrec))
-                    return false;
+            if (pub->qos() == 1)
+                queue_ack(MQTTPUBACK, pub->packet_id());
 
-                MQTT::PublishComp pubcomp(pub->packet_id());
-                pubcomp.send(_client);
-                lastOutActivity = millis();
-            }
+            break;
+        }
 
+        case MQTT_PUBREL: {
+            // Complete the handshake, also for ids we no longer know about
+            uint8_t i = qos2_find(msg->packet_id());
+            if (i < _qos2_count)
+                qos2_remove(i);
+            queue_ack(MQTTPUBCOMP, msg->packet_id());
             break;
         }
 
         case MQTT_PINGREQ: {
             MQTT::PingResp pr;
-            pr.send(_client);
+            send(pr);
             lastOutActivity = millis();
             break;
         }
 
+        case MQTT_CONNACK:
+            if (!_connecting)
+                break;
+
+            _connecting = false;
+            _timers.disarm(MQTT_TIMER_PING_TIMEOUT);
+            if (static_cast<MQTT::ConnectAck *>(msg)->return_code() == 0) {
+                connack_received();
+            } else {
+                _client.stop();
+                backoff();
+            }
+            break;
+
         case MQTT_PINGRESP:
             pingOutstanding = false;
+            _timers.disarm(MQTT_TIMER_PING_TIMEOUT);
     }
 
     return false;
 }
 
 bool PubSubClient::loop() {
-    if (connected()) {
-        unsigned long t = millis();
-        if ((t - lastInActivity > keepalive * 1000UL) || (t - lastOutActivity > keepalive * 1000UL)) {
-            if (pingOutstanding) {
-                _client.stop();
-                return false;
-            } else {
-                buffer[0] = MQTTPINGREQ;
-                buffer[1] = 0;
-                send((const uint8_t *) buffer, 2);
-                lastOutActivity = t;
-                lastInActivity = t;
-                pingOutstanding = true;
-            }
-        }
-        if (_client.available()) {
+    return loop(0) >= 0;
+}
 
-            MQTT::Message *msg = readMessage();
-            if (msg) {
-                processMessage(msg);
-                delete(msg);
-            }
+int PubSubClient::loop(unsigned long budget_us, unsigned long *wait_ms) {
+    int more = -1;
+    if (connected() && check_keepalive()) {
+        flush_tx_queue();
+#ifdef MQTT_COROUTINES
+        expire_waiters();
+#endif
 
+        // Always handle at least one publish, then keep going while the budget lasts
+        unsigned long start = micros();
+        fill_rx_queue();
+        while (dispatch_rx_queue()) {
+            fill_rx_queue();
+            if (micros() - start >= budget_us)
+                break;
         }
-        return true;
+        flush_acks();
+        more = _rx_count || _client.available();
     }
-    return false;
+
+    if (wait_ms)
+        *wait_ms = next_timeout();
+    return more;
 }
 
-bool PubSubClient::wait_for(uint8_t match_type, uint16_t match_pid) {
-    while (!_client.available()) {
-        if (millis() - lastInActivity > keepalive * 1000UL)
-            return false;
-        delayMicroseconds(100);
+bool PubSubClient::check_keepalive(void) {
+    unsigned long t = millis();
+    if (_timers.due(MQTT_TIMER_PING_TIMEOUT, t)) {
+        _client.stop();
+        _timers.armed = 0;
+        _connecting = false;
+        backoff();
+        return false;
     }
 
-    while (millis() < lastInActivity + (keepalive * 1000)) {
-        // Read the packet and check it
-        MQTT::Message *msg = readMessage();
-        if (msg != NULL) {
-            bool ret = processMessage(msg, match_type, match_pid);
-            delete msg;
-            if (ret)
-                return true;
-        }
-
-        delayMicroseconds(100);
+    update_keepalive();
+    if (_timers.due(MQTT_TIMER_KEEPALIVE, t)) {
+        buffer[0] = MQTTPINGREQ;
+        buffer[1] = 0;
+        send((const uint8_t *) buffer, 2);
+        lastOutActivity = t;
+        lastInActivity = t;
+        pingOutstanding = true;
+        _timers.disarm(MQTT_TIMER_KEEPALIVE);
+        _timers.arm(MQTT_TIMER_PING_TIMEOUT, t + keepalive * 1000UL);
     }
+    return true;
+}
 
-    return false;
+int PubSubClient::on_readable(void) {
+    if (!connected())
+        return -1;
+
+    fill_rx_queue();
+    while (dispatch_rx_queue())
+        fill_rx_queue();
+    return _rx_count || _client.available();
 }
 
-bool PubSubClient::publish(String topic, String payload) {
-    return publish(topic, (const uint8_t *) payload.c_str(), payload.length(), false);
+bool PubSubClient::on_writable(void) {
+#ifdef MQTT_HOST_BUILD
+    // What the socket would not take before goes first
+    _client.write_pending();
+#endif
+    bool rc = flush_acks();
+    return flush_tx_queue() && rc;
 }
 
-bool PubSubClient::publish(String topic, const uint8_t *payload, unsigned int plength, bool retained) {
-    if (connected()) {
-        MQTT::Publish pub(topic, (uint8_t *) payload, plength);
-        pub.set_retain(retained);
-        return publish(pub);
-    }
-    return false;
+bool PubSubClient::wants_write(void) const {
+#ifdef MQTT_HOST_BUILD
+    if (_client.pending())
+        return true;
+#endif
+#ifdef MQTT_TX_QUEUE
+    // Publishes held back by the rate limit wait for on_timeout()
+    if (!_tx_queue.empty() && !(_timers.is_armed(MQTT_TIMER_RATE) && !_timers.due(MQTT_TIMER_RATE, millis())))
+        return true;
+#endif
+    return _ack_len > 0;
 }
 
-bool PubSubClient::publish_P(String topic, const uint8_t *PROGMEM payload, unsigned int plength, bool retained) {
-    uint8_t llen = 0;
-    uint8_t digit;
-    unsigned int rc = 0;
-    uint16_t tlen;
-    unsigned int pos = 0;
-    unsigned int i;
-    uint8_t header;
-    unsigned int len;
+unsigned long PubSubClient::on_timeout(void) {
+    if (connected() && check_keepalive()) {
+        if (_timers.due(MQTT_TIMER_RATE, millis()))
+            flush_tx_queue();
+#ifdef MQTT_COROUTINES
+        expire_waiters();
+#endif
+    }
+    return next_timeout();
+}
 
-    if (!connected()) {
-        return false;
+void PubSubClient::update_keepalive(void) {
+    if (pingOutstanding || _connecting) {
+        _timers.disarm(MQTT_TIMER_KEEPALIVE);
+        return;
     }
 
-    tlen = (uint16_t) topic.length();
+    // Whichever direction has been quiet longest decides when to ping
+    unsigned long now = millis();
+    unsigned long oldest = (now - lastInActivity > now - lastOutActivity) ? lastInActivity : lastOutActivity;
+    _timers.arm(MQTT_TIMER_KEEPALIVE, oldest + keepalive * 1000UL);
+}
+
+unsigned long PubSubClient::next_timeout(void) {
+    if (_rx_count)
+        return 0;
+    if (connected())
+        update_keepalive();
+    else
+        _timers.armed &= 1 << MQTT_TIMER_RECONNECT;
 
-    header = MQTTPUBLISH;
-    if (retained) {
-        header |= 1;
-    }
-    buffer[pos++] = header;
-    len = plength + 2 + tlen;
-    do {
-        digit = (uint8_t) (len & 0x7f);
-        len >>= 7;
-        if (len)
-            digit |= 0x80;
-        buffer[pos++] = digit;
-        llen++;
-    } while (len);
+    return _timers.next(millis());
+}
 
-    pos = writeString(topic, buffer, pos);
+bool PubSubClient::wait_for(uint8_t match_type, uint16_t match_pid, unsigned long timeout_ms) {
+    // A callback dispatched below may publish and wait in turn, so the deadline is kept here
+    // and the timer only shows the innermost one, with the outer one put back on return
+    unsigned long deadline = millis() + timeout_ms;
+    bool outer = _timers.is_armed(MQTT_TIMER_RETRANSMIT);
+    unsigned long outer_at = _timers.at[MQTT_TIMER_RETRANSMIT];
+    _timers.arm(MQTT_TIMER_RETRANSMIT, deadline);
+
+    // Responses that free the packet id may be read by such a nested wait instead
+    bool tracked = match_pid && packet_id_outstanding(match_pid)
+                   && (match_type == MQTT_PUBACK || match_type == MQTT_PUBCOMP
+                       || match_type == MQTT_SUBACK || match_type == MQTT_UNSUBACK);
+
+    bool rc = false;
+    for (;;) {
+        if (tracked && !packet_id_outstanding(match_pid)) {
+            rc = true;
+            break;
+        }
+        if ((long) (millis() - deadline) >= 0 || !_client.connected())
+            break;
 
-    rc += send((const uint8_t *) buffer, pos);
+        // Publishes read meanwhile are queued behind the others to keep their order
+        // Making room runs callbacks, which may read what was available themselves
+        // With every slot held further up the stack, responses can still be read
+        make_rx_room();
+        if (!_client.available() || rx_blocked()) {
+            delayMicroseconds(100);
+            continue;
+        }
 
-    for (i = 0; i < plength; i++) {
-        rc += send((uint8_t) pgm_read_byte_near(payload + i));
+        if (receive(match_type, match_pid)) {
+            rc = true;
+            break;
+        }
     }
 
-    lastOutActivity = millis();
+    if (outer)
+        _timers.arm(MQTT_TIMER_RETRANSMIT, outer_at);
+    else
+        _timers.disarm(MQTT_TIMER_RETRANSMIT);
+    flush_acks();
+    return rc;
+}
 
-    return rc == tlen + 4 + plength;
+bool PubSubClient::publish(const String &topic, const String &payload) {
+    return publish(topic.c_str(), (const uint8_t *) payload.c_str(), payload.length(), false);
 }
 
-bool PubSubClient::write(uint8_t header, uint8_t *buf, uint16_t length) {
-    uint8_t lenBuf[4];
-    uint8_t llen = 0;
-    uint8_t digit;
-    uint8_t pos = 0;
-    size_t rc;
-    size_t len = length;
-    do {
-        digit = (uint8_t) (len & 0x7f);
-        len >>= 7;
-        if (len)
-            digit |= 0x80;
-        lenBuf[pos++] = digit;
-        llen++;
+bool PubSubClient::publish(const char *topic, const char *payload) {
+    return publish(topic, (const uint8_t *) payload, strlen(payload), false);
+}
+
+bool PubSubClient::publish(const String &topic, const uint8_t *payload, unsigned int plength, bool retained) {
+    return publish(topic.c_str(), payload, plength, retained);
+}
+
+bool PubSubClient::publish(const char *topic, const uint8_t *payload, unsigned int plength, bool retained) {
+    MQTT::Publish pub(MQTT::TopicRef(topic), (uint8_t *) payload, plength);
+    pub.set_retain(retained);
+    return publish(pub);
+}
+
+bool PubSubClient::publish(const __FlashStringHelper *topic, const uint8_t *payload, unsigned int plength,
+                           bool retained) {
+    MQTT::Publish pub(topic, (uint8_t *) payload, plength);
+    pub.set_retain(retained);
+    return publish(pub);
+}
+
+bool PubSubClient::publish_P(const String &topic, const uint8_t *PROGMEM payload, unsigned int plength, bool retained) {
+    return publish_P(topic.c_str(), payload, plength, retained);
+}
+
+bool PubSubClient::publish_P(const char *topic, const uint8_t *PROGMEM payload, unsigned int plength, bool retained) {
+    MQTT::Publish pub(MQTT::TopicRef(topic), (uint8_t *) NULL, 0);
+    pub.set_payload_P((PGM_P) payload, plength).set_retain(retained);
+    return publish(pub);
+}
+
+bool PubSubClient::publish_P(const __FlashStringHelper *topic, const uint8_t *PROGMEM payload, unsigned int plength,
+                             bool retained) {
+    MQTT::Publish pub(topic, (uint8_t *) NULL, 0);
+    pub.set_payload_P((PGM_P) payload, plength).set_retain(retained);
+    return publish(pub);
+}
+
+bool PubSubClient::write(uint8_t header, uint8_t *buf, uint32_t length) {
+    uint8_t lenBuf[4];
+    uint8_t llen = 0;
+    uint8_t digit;
+    uint8_t pos = 0;
+    size_t rc;
+    size_t len = length;
+    do {
+        digit = (uint8_t) (len & 0x7f);
+        len >>= 7;
+        if (len)
+            digit |= 0x80;
+        lenBuf[pos++] = digit;
+        llen++;
     } while (len);
 
     buf[4 - llen] = header;
@@ -458,38 +869,71 @@ bool PubSubClient::write(uint8_t header, uint8_t *buf, uint16_t length) {
     return (rc == 1 + llen + length);
 }
 
-bool PubSubClient::subscribe(String topic, uint8_t qos) {
+bool PubSubClient::subscribe(const String &topic, uint8_t qos) {
+    return subscribe_topic(topic.c_str(), qos, false);
+}
+
+bool PubSubClient::subscribe(const char *topic, uint8_t qos) {
+    return subscribe_topic(topic, qos, false);
+}
+
+bool PubSubClient::subscribe(const __FlashStringHelper *topic, uint8_t qos) {
+    return subscribe_topic((PGM_P) topic, qos, true);
+}
+
+bool PubSubClient::subscribe_topic(const char *topic, uint8_t qos, bool progmem) {
     if (qos < 0 || qos > 1)
         return false;
 
-    if (connected()) {
-        // Leave room in the buffer for header and variable length field
-        uint16_t length = 5;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
-        }
-        buffer[length++] = (uint8_t) (nextMsgId >> 8);
-        buffer[length++] = (uint8_t) (nextMsgId & 0xFF);
-        length = writeString(topic, buffer, length);
-        buffer[length++] = qos;
-        return write(MQTTSUBSCRIBE | MQTTQOS1, buffer, (uint16_t) (length - 5));
-    }
+    if (!connected())
+        return false;
+
+    uint16_t pid = next_packet_id();
+    if (pid == 0)
+        return false;
+    if (send_subscribe(topic, qos, pid, progmem))
+        return true;
+    release_packet_id(pid);
     return false;
 }
 
-bool PubSubClient::unsubscribe(String topic) {
-    if (connected()) {
-        uint16_t length = 5;
-        nextMsgId++;
-        if (nextMsgId == 0) {
-            nextMsgId = 1;
-        }
-        buffer[length++] = (uint8_t) (nextMsgId >> 8);
-        buffer[length++] = (uint8_t) (nextMsgId & 0xFF);
-        length = writeString(topic, buffer, length);
-        return write(MQTTUNSUBSCRIBE | MQTTQOS1, buffer, (uint16_t) (length - 5));
-    }
+bool PubSubClient::send_subscribe(const char *topic, uint8_t qos, uint16_t pid, bool progmem) {
+    // Leave room in the buffer for header and variable length field
+    uint16_t length = 5;
+    buffer[length++] = (uint8_t) (pid >> 8);
+    buffer[length++] = (uint8_t) (pid & 0xFF);
+    length = writeString(topic, buffer, length, progmem);
+    buffer[length++] = qos;
+    return write(MQTTSUBSCRIBE | MQTTQOS1, buffer, (uint16_t) (length - 5));
+}
+
+bool PubSubClient::unsubscribe(const String &topic) {
+    return unsubscribe_topic(topic.c_str(), false);
+}
+
+bool PubSubClient::unsubscribe(const char *topic) {
+    return unsubscribe_topic(topic, false);
+}
+
+bool PubSubClient::unsubscribe(const __FlashStringHelper *topic) {
+    return unsubscribe_topic((PGM_P) topic, true);
+}
+
+bool PubSubClient::unsubscribe_topic(const char *topic, bool progmem) {
+    if (!connected())
+        return false;
+
+    uint16_t pid = next_packet_id();
+    if (pid == 0)
+        return false;
+
+    uint16_t length = 5;
+    buffer[length++] = (uint8_t) (pid >> 8);
+    buffer[length++] = (uint8_t) (pid & 0xFF);
+    length = writeString(topic, buffer, length, progmem);
+    if (write(MQTTUNSUBSCRIBE | MQTTQOS1, buffer, (uint16_t) (length - 5)))
+        return true;
+    release_packet_id(pid);
     return false;
 }
 
@@ -498,32 +942,337 @@ void PubSubClient::disconnect(void) {
     buffer[1] = 0;
     send((const uint8_t *) buffer, 2);
     _client.stop();
+#ifdef MQTT_COROUTINES
+    fail_waiters();
+#endif
+    _connecting = false;
     lastInActivity = lastOutActivity = millis();
 }
 
-uint16_t PubSubClient::writeString(String string, uint8_t *buf, uint16_t pos) {
-    const char *idp = string.c_str();
-    uint16_t i = 0;
-    pos += 2;
-    while (*idp) {
-        buf[pos++] = (uint8_t) *idp++;
-        i++;
-    }
-    buf[pos - i - 2] = (uint8_t) (i >> 8);
-    buf[pos - i - 1] = (uint8_t) (i & 0xFF);
-    return pos;
+uint16_t PubSubClient::writeString(const char *string, uint8_t *buf, uint16_t pos, bool progmem) {
+    uint16_t i = (uint16_t) (progmem ? strlen_P(string) : strlen(string));
+    buf[pos++] = (uint8_t) (i >> 8);
+    buf[pos++] = (uint8_t) (i & 0xFF);
+    if (progmem)
+        memcpy_P(buf + pos, string, i);
+    else
+        memcpy(buf + pos, string, i);
+    return pos + i;
 }
 
 
 bool PubSubClient::connected() {
     bool rc = _client.connected();
-    if (!rc)
+    if (!rc) {
         _client.stop();
+#ifdef MQTT_COROUTINES
+        fail_waiters();
+#endif
+    }
 
     return rc;
 }
 
+bool PubSubClient::queue_ack(uint8_t header, uint16_t pid) {
+    if (_ack_len + 4u > sizeof(_ack_buffer) && !flush_acks())
+        return false;
+
+    _ack_buffer[_ack_len++] = header;
+    _ack_buffer[_ack_len++] = 2;
+    _ack_buffer[_ack_len++] = (uint8_t) (pid >> 8);
+    _ack_buffer[_ack_len++] = (uint8_t) (pid & 0xFF);
+    return true;
+}
+
+int8_t PubSubClient::free_rx_slot(void) const {
+    for (uint8_t i = 0; i < MQTT_RX_SLOTS; i++)
+        if (!(_rx_busy & (1UL << i)))
+            return i;
+    return -1;
+}
+
+bool PubSubClient::receive(uint8_t match_type, uint16_t match_pid) {
+    // A packet partly read stays where it was going, a slot is not marked busy until it is queued
+    if (_rx_part.len == 0) {
+        int header = _client.peek();
+        if (header < 0)
+            return false;
+        if ((header & 0xF0) != MQTTPUBLISH)
+            _rx_part.slot = -1;
+        else if ((_rx_part.slot = free_rx_slot()) < 0)
+            return false;
+    }
+
+    if (_rx_part.slot < 0) {
+        // Anything larger than _rx_small is dropped, none of the responses to this client are
+        mqtt_packet_t packet = readPacket(_rx_small, NULL, sizeof(_rx_small));
+        return packet.total && processPacket(packet, match_type, match_pid);
+    }
+
+    uint8_t i = (uint8_t) _rx_part.slot;
+    mqtt_rx_slot_t &slot = _rx_slots[i];
+    mqtt_packet_t packet = readPacket(slot.data, &slot.pub);
+    if (packet.total == 0)
+        return false;
+
+    packet.data[packet.length] = 0;
+    if (packet.streamed == 0) {
+        // A topic or packet id running past the end is a protocol violation, which closes the connection
+        if (!MQTT::Publish::well_formed(packet.header & 0x0f, packet.data, packet.length)) {
+            _client.stop();
+            backoff();
+            return false;
+        }
+        slot.pub = MQTT::Publish(packet.header & 0x0f, packet.data, packet.length);
+    }
+
+    // The id is recorded here rather than on dispatch: a PUBREL is handled straight away
+    // and must not clear it while a resend of the same publish is still queued
+    if (slot.pub.qos() == 2 && !qos2_record(slot.pub.packet_id())) {
+        queue_ack(MQTTPUBREC, slot.pub.packet_id());
+        return false;
+    }
+
+    if (packet.streamed == 0) {
+#ifdef MQTT_LZ
+        if ((_stream || _chunk_callback) && MQTT::lz_flagged(slot.pub.topic(), slot.pub.topic_len())) {
+            _lz.reset();
+            _lz_pub = &slot.pub;
+            _lz.write(slot.pub.payload(), slot.pub.payload_len(), lz_sink, this);
+            lz_finish();
+            slot.pub.set_payload(slot.pub.payload(), 0);
+        } else
+#endif
+        if ((_stream || _chunk_callback) && slot.pub.payload_len() > _stream_threshold)
+            sink_chunk(slot.pub, slot.pub.payload(), slot.pub.payload_len(), 0, slot.pub.payload_len());
+    }
+
+    _rx_busy |= 1UL << i;
+    _rx_queue[(_rx_head + _rx_count++) % MQTT_RX_QUEUE_SLOTS] = i;
+    return false;
+}
+
+void PubSubClient::fill_rx_queue(void) {
+    while (_rx_count < _rx_high_water && _client.available() && !rx_blocked())
+        receive();
+}
+
+bool PubSubClient::rx_blocked(void) {
+    if (_rx_part.len)
+        return false;
+    int header = _client.peek();
+    return header >= 0 && (header & 0xF0) == MQTTPUBLISH && free_rx_slot() < 0;
+}
+
+bool PubSubClient::make_rx_room(void) {
+    while (_rx_count >= _rx_high_water || free_rx_slot() < 0) {
+        if (!dispatch_rx_queue())
+            return false;
+    }
+    return true;
+}
+
+bool PubSubClient::dispatch_rx_queue(void) {
+    if (_rx_count == 0)
+        return false;
+
+    // Taken off first, the callback may wait for a response and queue more publishes meanwhile
+    uint8_t i = _rx_queue[_rx_head];
+    _rx_head = (uint8_t) ((_rx_head + 1) % MQTT_RX_QUEUE_SLOTS);
+    _rx_count--;
+
+    processMessage(&_rx_slots[i].pub);
+    _rx_busy &= ~(1UL << i);
+    return true;
+}
+
+void PubSubClient::clear_rx_queue(void) {
+    _rx_part = mqtt_rx_state_t();
+    while (_rx_count) {
+        // Never delivered, so a resend after reconnecting must not be taken for a duplicate
+        MQTT::Publish &pub = _rx_slots[_rx_queue[_rx_head]].pub;
+        uint8_t q = qos2_find(pub.packet_id());
+        if (pub.qos() == 2 && q < _qos2_count)
+            qos2_remove(q);
+
+        _rx_busy &= ~(1UL << _rx_queue[_rx_head]);
+        _rx_head = (uint8_t) ((_rx_head + 1) % MQTT_RX_QUEUE_SLOTS);
+        _rx_count--;
+    }
+}
+
+uint16_t PubSubClient::next_packet_id(void) {
+    // Handed out in sequence, so with responses coming back roughly in order the next
+    // slot is nearly always free; only with every slot taken does this sweep them all
+    for (uint16_t n = 0; n < MQTT_MAX_INFLIGHT; n++) {
+        if (++nextMsgId == 0)
+            nextMsgId = 1;
+
+        uint16_t &slot = _inflight[nextMsgId & (MQTT_MAX_INFLIGHT - 1)];
+        if (slot == 0) {
+            slot = nextMsgId;
+            return nextMsgId;
+        }
+    }
+    return 0;
+}
+
+void PubSubClient::release_packet_id(uint16_t pid) {
+    // A late duplicate response must not free a newer id sharing the slot
+    uint16_t &slot = _inflight[pid & (MQTT_MAX_INFLIGHT - 1)];
+    if (slot == pid)
+        slot = 0;
+}
+
+uint8_t PubSubClient::qos2_find(uint16_t pid) const {
+    uint8_t i = 0;
+    while (i < _qos2_count && _qos2_pids[i] != pid)
+        i++;
+    return i;
+}
+
+bool PubSubClient::qos2_record(uint16_t pid) {
+    if (qos2_find(pid) < _qos2_count)
+        return false;
+
+    // With the table full the oldest id, the likeliest to have lost its PUBREL,
+    // makes way; a late PUBREL for it still gets its PUBCOMP
+    if (_qos2_count == MQTT_MAX_INBOUND_QOS2)
+        qos2_remove(0);
+    _qos2_pids[_qos2_count++] = pid;
+    return true;
+}
+
+void PubSubClient::qos2_remove(uint8_t i) {
+    // Kept oldest first
+    memmove(_qos2_pids + i, _qos2_pids + i + 1, (--_qos2_count - i) * sizeof(_qos2_pids[0]));
+}
+
+bool PubSubClient::flush_acks(void) {
+    if (_ack_len == 0)
+        return true;
+
+    // Clear first, send() flushes the queue itself before anything else goes out
+    size_t len = _ack_len;
+    _ack_len = 0;
+    bool rc = send((const uint8_t *) _ack_buffer, len) == len;
+    lastOutActivity = millis();
+    return rc;
+}
+
+#ifdef MQTT_TX_QUEUE
+// Topic of a publish encoded in a TX queue slot
+static const char *slot_topic(const uint8_t *data, uint16_t &len) {
+    size_t pos = 1;
+    while (data[pos++] & 0x80) { }
+    len = (uint16_t) ((data[pos] << 8) | data[pos + 1]);
+    return (const char *) data + pos + 2;
+}
+#endif
+
+bool PubSubClient::flush_tx_queue(void) {
+    bool rc = true;
+#ifdef MQTT_TX_QUEUE
+    // Gather as many queued packets as fit into the buffer and write them in one go
+    MQTT::TxQueue<MQTT_TX_QUEUE_SLOTS, MQTT_MAX_PACKET_SIZE>::slot_t *slot;
+    size_t len = 0;
+    unsigned long now = millis();
+    _timers.disarm(MQTT_TIMER_RATE);
+    while ((slot = _tx_queue.front()) != NULL) {
+        uint16_t tlen;
+        const char *topic = slot_topic(slot->data, tlen);
+        if (rate_limited()) {
+            unsigned long wait = rate_wait(topic, tlen, false, now);
+            if (wait) {
+                if (_rate_coalesce && tx_superseded(slot)) {
+                    _tx_queue.pop();
+                    _coalesced++;
+                    continue;
+                }
+                _timers.arm(MQTT_TIMER_RATE, now + wait);
+                break;
+            }
+            rate_take(topic, tlen, false);
+        }
+
+        if (slot->loopback && !_local_pinned && local_wanted(topic, tlen, false)) {
+            // Written on its own and handed over from a copy, subscribers may publish in turn
+            // and reuse buffer, or flush this queue again
+            if (len)
+                rc = send(buffer, len) == len && rc;
+            len = 0;
+            size_t n = slot->len;
+            bool sent = send(slot->data, n) == n;
+            lastOutActivity = millis();
+            if (_deadband_count && sent)
+                deadband_slot_sent(slot);
+            memcpy(_local_pin, slot->data, n);
+            _tx_queue.pop();
+            rc = sent && rc;
+            if (sent)
+                local_deliver_pinned(n);
+            continue;
+        }
+
+        if (len + slot->len > MQTT_MAX_PACKET_SIZE) {
+            rc = send(buffer, len) == len && rc;
+            len = 0;
+        }
+        memcpy(buffer + len, slot->data, slot->len);
+        len += slot->len;
+        if (_deadband_count)
+            deadband_slot_sent(slot);
+        _tx_queue.pop();
+    }
+    if (len) {
+        rc = send(buffer, len) == len && rc;
+        lastOutActivity = millis();
+    }
+#endif
+    return rc;
+}
+
+#ifdef MQTT_TX_QUEUE
+bool PubSubClient::publish_async(const char *topic, const uint8_t *payload, size_t plength, bool retained) {
+    size_t tlen = strlen(topic);
+    size_t len = 2 + tlen + plength;
+    if (len + 5 > MQTT_MAX_PACKET_SIZE)
+        return false;
+
+    MQTT::TxQueue<MQTT_TX_QUEUE_SLOTS, MQTT_MAX_PACKET_SIZE>::slot_t *slot = _tx_queue.claim();
+    if (slot == NULL)
+        return false;
+
+    // Encoded in place, nothing here touches the client's own buffer
+    uint8_t *buf = slot->data;
+    size_t pos = 0;
+    buf[pos++] = (uint8_t) (MQTTPUBLISH | (retained ? 1 : 0));
+    do {
+        uint8_t digit = (uint8_t) (len & 0x7f);
+        len >>= 7;
+        if (len)
+            digit |= 0x80;
+        buf[pos++] = digit;
+    } while (len);
+
+    buf[pos++] = (uint8_t) (tlen >> 8);
+    buf[pos++] = (uint8_t) (tlen & 0xFF);
+    memcpy(buf + pos, topic, tlen);
+    pos += tlen;
+    memcpy(buf + pos, payload, plength);
+    pos += plength;
+
+    slot->len = pos;
+    slot->loopback = false;
+    _tx_queue.commit(slot);
+    return true;
+}
+#endif
+
 size_t PubSubClient::send(const uint8_t *buf, size_t len) {
+    // Acks for messages already received must not be overtaken by later packets
+    flush_acks();
+
     size_t sent = 0;
     size_t count = 0;
     size_t ret = 0;
@@ -536,62 +1285,885 @@ size_t PubSubClient::send(const uint8_t *buf, size_t len) {
     return sent;
 }
 
-size_t PubSubClient::send(uint8_t c) {
-    return _client.write(c);
-}
-
 bool PubSubClient::send(MQTT::Message &message) {
+    flush_acks();
     return message.send(_client, buffer);
 }
 
+// FNV-1a, to tell most topics apart without comparing them
+static uint32_t fnv1a(const void *data, size_t len, bool progmem) {
+    const uint8_t *p = (const uint8_t *) data;
+    uint32_t h = 2166136261UL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= progmem ? pgm_read_byte(p + i) : p[i];
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+// Skip the digits at p, NULL if there are none
+static const char *skip_digits(const char *p, const char *end) {
+    const char *start = p;
+    while (p < end && *p >= '0' && *p <= '9')
+        p++;
+    return p == start ? NULL : p;
+}
+
+// End of the JSON number at p, NULL if what is there is not one, e.g. "2024-01-01" or "1.2.3"
+static const char *skip_number(const char *p, const char *end) {
+    if (p < end && *p == '-')
+        p++;
+    if (p < end && *p == '0')
+        p++;
+    else if ((p = skip_digits(p, end)) == NULL)
+        return NULL;
+    if (p < end && *p == '.' && (p = skip_digits(p + 1, end)) == NULL)
+        return NULL;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-'))
+            p++;
+        p = skip_digits(p, end);
+    }
+    return p;
+}
+
+// The payload as a number if that is all it is, e.g. "21.5", otherwise NaN
+static float payload_number(const uint8_t *payload, size_t len) {
+    MQTT::JsonReader n(payload, len);
+    if (n.type() != MQTT::JSON_NUMBER)
+        return NAN;
+
+    const char *end = (const char *) payload + len;
+    const char *p = skip_number(n.raw(), end);
+    if (p == NULL)
+        return NAN;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p == end ? (float) n.to_double() : NAN;
+}
+
+// Topic filter matching: '+' stands for one level, a trailing '#' for any number of them
+static bool topic_matches(const char *filter, const char *topic, size_t len, bool progmem) {
+    size_t i = 0;
+#define TOPIC_AT(n) ((char) (progmem ? pgm_read_byte(topic + (n)) : topic[n]))
+    // Wildcards never match the server's own $ topics
+    if ((*filter == '+' || *filter == '#') && len && TOPIC_AT(0) == '$')
+        return false;
+
+    for (; *filter; filter++) {
+        if (*filter == '#')
+            return true;
+        if (*filter == '+') {
+            while (i < len && TOPIC_AT(i) != '/')
+                i++;
+            continue;
+        }
+        // "a/#" matches "a" as well
+        if (i == len)
+            return strcmp(filter, "/#") == 0;
+        if (*filter != TOPIC_AT(i))
+            return false;
+        i++;
+    }
+#undef TOPIC_AT
+    return i == len;
+}
+
+bool PubSubClient::subscribe_local(const char *filter, mqtt_local_mode_t mode, callback_t cb, void *data) {
+    uint8_t i = 0;
+    while (i < _local_count && !(_local[i].callback == cb && strcmp(_local[i].filter, filter) == 0))
+        i++;
+    if (i == _local_count) {
+        if (i == MQTT_LOCAL_SUBSCRIPTIONS)
+            return false;
+        _local_count++;
+    }
+    _local[i].filter = filter;
+    _local[i].callback = cb;
+    _local[i].data = data;
+    _local[i].mode = mode;
+    return true;
+}
+
+void PubSubClient::unsubscribe_local(const char *filter) {
+    // Kept in order, so subscribers hear of a publish in the order they subscribed
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < _local_count; i++) {
+        if (strcmp(_local[i].filter, filter) != 0)
+            _local[n++] = _local[i];
+    }
+    _local_count = n;
+}
+
+bool PubSubClient::local_only(const MQTT::Publish &pub) const {
+    for (uint8_t i = 0; i < _local_count; i++) {
+        if (_local[i].mode == MQTT_LOCAL_ONLY
+            && topic_matches(_local[i].filter, pub.topic(), pub.topic_len(), pub.topic_P()))
+            return true;
+    }
+    return false;
+}
+
+bool PubSubClient::local_wanted(const char *topic, size_t len, bool progmem) const {
+    if (_local_depth == MQTT_LOCAL_DEPTH)
+        return false;
+    for (uint8_t i = 0; i < _local_count; i++) {
+        if (topic_matches(_local[i].filter, topic, len, progmem))
+            return true;
+    }
+    return false;
+}
+
+void PubSubClient::local_deliver(MQTT::Publish &pub) {
+    // Payloads made up as they are sent, e.g. compressed, have nothing to hand over
+    if ((pub.payload() == NULL && pub.payload_len()) || !local_wanted(pub.topic(), pub.topic_len(), pub.topic_P()))
+        return;
+
+    uint8_t *payload = pub.payload();
+    size_t len = pub.payload_len();
+    if (payload < buffer || payload >= buffer + sizeof(buffer)) {
+        local_dispatch(pub);
+        return;
+    }
+
+    // A payload begin_publish() wrote into buffer would be overwritten by the first subscriber
+    // that publishes in turn, so they all get it from the one pinned copy. Nested in a
+    // delivery that holds it already, such a publish is not handed over
+    if (_local_pinned)
+        return;
+    memcpy(_local_pin, payload, len);
+    _local_pin[len] = 0;
+    pub.set_payload(_local_pin, len);
+    _local_pinned = true;
+    local_dispatch(pub);
+    _local_pinned = false;
+    pub.set_payload(payload, len);
+}
+
+void PubSubClient::local_deliver_pinned(size_t len) {
+    size_t pos = 1;
+    while (_local_pin[pos++] & 0x80) { }
+    _local_pin[len] = 0;
+    MQTT::Publish pub(_local_pin[0] & 0x0f, _local_pin + pos, len - pos);
+
+    _local_pinned = true;
+    local_dispatch(pub);
+    _local_pinned = false;
+}
+
+void PubSubClient::local_dispatch(MQTT::Publish &pub) {
+    _local_depth++;
+    for (uint8_t i = 0; i < _local_count; i++) {
+        local_sub_t &sub = _local[i];
+        if (!topic_matches(sub.filter, pub.topic(), pub.topic_len(), pub.topic_P()))
+            continue;
+        if (sub.callback)
+            sub.callback(pub, sub.data);
+        else if (_callback)
+            _callback(pub, _callback_data);
+    }
+    _local_depth--;
+}
+
 bool PubSubClient::publish(MQTT::Publish &pub) {
-    if (!connected())
+    if (_local_count == 0 || !local_only(pub))
+        return publish_remote(pub);
+
+    // Kept off the network, so it needs no packet id
+    if (pub.qos())
+        release_packet_id(pub.packet_id());
+    local_deliver(pub);
+    return true;
+}
+
+bool PubSubClient::publish_remote(MQTT::Publish &pub) {
+    if (pub.qos() && pub.packet_id() == 0)
+        return false;
+    if (!connected()) {
+        if (pub.qos())
+            release_packet_id(pub.packet_id());
         return false;
+    }
+
+    mqtt_deadband_t *db = _deadband_count ? deadband_entry(pub) : NULL;
+    float value = 0;
+    if (db) {
+        value = payload_number(pub.payload(), pub.payload_len());
+        if (deadband_drop(*db, pub.payload(), pub.payload_len(), value)) {
+            // The exchange never starts, so neither does its packet id's
+            if (pub.qos())
+                release_packet_id(pub.packet_id());
+            _suppressed++;
+            return true;
+        }
+    }
+
+    bool queued = false;
+    if (rate_limited() && !rate_admit(pub, queued)) {
+        if (pub.qos())
+            release_packet_id(pub.packet_id());
+        return false;
+    }
 
     switch (pub.qos()) {
         case 0: {
-            send(pub);
-            lastOutActivity = millis();
+            if (queued)
+                break;
+            if (!send(pub))
+                return false;
             break;
         }
         case 1: {
-            if (!sendReliably(pub))
+            if (!sendReliably(pub)) {
+                release_packet_id(pub.packet_id());
                 return false;
+            }
             break;
         }
 
         case 2: {
-            if (!sendReliably(pub))
-                return false;
-
             MQTT::PublishRel pubrel(pub.packet_id());
-            if (!sendReliably(pubrel))
+            if (!sendReliably(pub) || !sendReliably(pubrel)) {
+                release_packet_id(pub.packet_id());
                 return false;
+            }
 
             break;
         }
         default:
             break;
     }
-    lastOutActivity = millis();
+    // A queued publish counts once flush_tx_queue() sends it, it may yet be coalesced away
+    if (!queued) {
+        lastOutActivity = millis();
+        if (db)
+            deadband_sent(*db, pub.payload(), pub.payload_len(), value);
+        if (_local_count)
+            local_deliver(pub);
+    }
     return true;
 }
 
-bool PubSubClient::sendReliably(MQTT::Message &message) {
-    uint8_t retries = 0;
-    send:
-    send(message);
-    lastOutActivity = millis();
+PubSubClient &PubSubClient::set_rate_limit(uint32_t rate, uint32_t burst) {
+    _rate.set(rate, burst, millis());
+    return *this;
+}
 
-    if (message.response_type() == 0)
+bool PubSubClient::set_rate_limit(const char *prefix, uint32_t rate, uint32_t burst) {
+    size_t len = strlen(prefix);
+    uint8_t i = 0;
+    while (i < _rate_prefix_count && !(_rate_prefix[i].prefix_len == len && memcmp(_rate_prefix[i].prefix, prefix, len) == 0))
+        i++;
+
+    if (rate == 0) {
+        if (i < _rate_prefix_count)
+            _rate_prefix[i] = _rate_prefix[--_rate_prefix_count];
         return true;
+    }
+    if (i == _rate_prefix_count) {
+        if (i == MQTT_RATE_PREFIXES || len > 255)
+            return false;
+        _rate_prefix_count++;
+    }
+    _rate_prefix[i].prefix = prefix;
+    _rate_prefix[i].prefix_len = (uint8_t) len;
+    _rate_prefix[i].set(rate, burst, millis());
+    return true;
+}
+
+static bool topic_starts_with(const char *topic, size_t len, bool progmem, const char *prefix, size_t prefix_len) {
+    if (len < prefix_len)
+        return false;
+    for (size_t i = 0; i < prefix_len; i++) {
+        if ((char) (progmem ? pgm_read_byte(topic + i) : topic[i]) != prefix[i])
+            return false;
+    }
+    return true;
+}
 
-    if (!wait_for(message.response_type(), message.packet_id())) {
-        if (retries < _max_retries) {
-            retries++;
-            goto send;
+unsigned long PubSubClient::rate_wait(const char *topic, size_t len, bool progmem, unsigned long now) {
+    unsigned long wait = _rate.wait(now);
+    for (uint8_t i = 0; i < _rate_prefix_count; i++) {
+        mqtt_bucket_t &b = _rate_prefix[i];
+        if (topic_starts_with(topic, len, progmem, b.prefix, b.prefix_len)) {
+            unsigned long w = b.wait(now);
+            if (w > wait)
+                wait = w;
         }
+    }
+    return wait;
+}
+
+void PubSubClient::rate_take(const char *topic, size_t len, bool progmem) {
+    _rate.take();
+    for (uint8_t i = 0; i < _rate_prefix_count; i++) {
+        mqtt_bucket_t &b = _rate_prefix[i];
+        if (topic_starts_with(topic, len, progmem, b.prefix, b.prefix_len))
+            b.take();
+    }
+}
+
+bool PubSubClient::rate_block(const char *topic, size_t len, bool progmem) {
+    unsigned long wait;
+    while ((wait = rate_wait(topic, len, progmem, millis())) > 0) {
+        // Not wait_for(), which would run callbacks under the caller and take over its
+        // retransmit timer: publishes read meanwhile only join the RX queue
+        unsigned long until = millis() + wait;
+        while ((long) (millis() - until) < 0 && _client.connected()) {
+            fill_rx_queue();
+            delay(1);
+        }
+        if (!connected())
+            return false;
+    }
+    rate_take(topic, len, progmem);
+    return true;
+}
+
+bool PubSubClient::rate_admit(MQTT::Publish &pub, bool &queued) {
+    queued = false;
+#ifdef MQTT_TX_QUEUE
+    // Rather than wait, QoS 0 goes to the back of the queue, also to stay behind what is held there
+    if (pub.qos() == 0 && pub.packet_len() <= MQTT_MAX_PACKET_SIZE
+        && (!_tx_queue.empty() || rate_wait(pub.topic(), pub.topic_len(), pub.topic_P(), millis()))) {
+        MQTT::TxQueue<MQTT_TX_QUEUE_SLOTS, MQTT_MAX_PACKET_SIZE>::slot_t *slot = _tx_queue.claim();
+        if (slot != NULL) {
+            slot->len = pub.encode(slot->data);
+            slot->loopback = _local_count != 0;
+            _tx_queue.commit(slot);
+            queued = true;
+            flush_tx_queue();
+            return true;
+        }
+    }
+#endif
+    return rate_block(pub.topic(), pub.topic_len(), pub.topic_P());
+}
+
+#ifdef MQTT_TX_QUEUE
+bool PubSubClient::tx_superseded(const MQTT::TxQueue<MQTT_TX_QUEUE_SLOTS, MQTT_MAX_PACKET_SIZE>::slot_t *slot) {
+    uint16_t len;
+    const char *topic = slot_topic(slot->data, len);
+
+    MQTT::TxQueue<MQTT_TX_QUEUE_SLOTS, MQTT_MAX_PACKET_SIZE>::slot_t *later;
+    for (size_t i = 1; (later = _tx_queue.peek(i)) != NULL; i++) {
+        uint16_t later_len;
+        const char *later_topic = slot_topic(later->data, later_len);
+        if (later->data[0] == slot->data[0] && later_len == len && memcmp(later_topic, topic, len) == 0)
+            return true;
+    }
+    return false;
+}
+#endif
+
+bool PubSubClient::set_deadband(const char *topic, float deadband, unsigned long max_silence_ms) {
+    size_t len = strlen(topic);
+    mqtt_deadband_t *db = deadband_find(topic, len, false);
+    if (db == NULL) {
+        if (_deadband_count == MQTT_DEADBAND_TOPICS)
+            return false;
+        db = &_deadband[_deadband_count++];
+        db->topic_hash = fnv1a(topic, len, false);
+        db->primed = false;
+    }
+    db->topic = topic;
+    db->deadband = deadband;
+    db->max_silence = max_silence_ms;
+    return true;
+}
+
+void PubSubClient::unset_deadband(const char *topic) {
+    mqtt_deadband_t *db = deadband_find(topic, strlen(topic), false);
+    if (db)
+        *db = _deadband[--_deadband_count];
+}
+
+mqtt_deadband_t *PubSubClient::deadband_find(const char *topic, size_t len, bool progmem) {
+    uint32_t topic_hash = fnv1a(topic, len, progmem);
+    for (uint8_t i = 0; i < _deadband_count; i++) {
+        mqtt_deadband_t &db = _deadband[i];
+        if (db.topic_hash == topic_hash && strlen(db.topic) == len
+            && topic_starts_with(topic, len, progmem, db.topic, len))
+            return &db;
+    }
+    return NULL;
+}
+
+mqtt_deadband_t *PubSubClient::deadband_entry(const MQTT::Publish &pub) {
+    // PROGMEM payloads are constant anyway, and LZPublish has none to look at
+    if (pub.payload() == NULL || pub.payload_P())
+        return NULL;
+    return deadband_find(pub.topic(), pub.topic_len(), pub.topic_P());
+}
+
+bool PubSubClient::deadband_drop(const mqtt_deadband_t &entry, const uint8_t *payload, size_t len,
+                                 float value) const {
+    if (!entry.primed)
         return false;
+    if (entry.max_silence && millis() - entry.sent >= entry.max_silence)
+        return false;
+    if (len <= MQTT_DEADBAND_PAYLOAD_SIZE && len == entry.payload_len && memcmp(payload, entry.payload, len) == 0)
+        return true;
+
+    // Always against the last value that went out, so slow drift still gets through
+    return entry.deadband >= 0 && value == value && entry.value == entry.value
+           && fabs(value - entry.value) <= entry.deadband;
+}
+
+void PubSubClient::deadband_sent(mqtt_deadband_t &entry, const uint8_t *payload, size_t len, float value) {
+    if (len <= MQTT_DEADBAND_PAYLOAD_SIZE) {
+        memcpy(entry.payload, payload, len);
+        entry.payload_len = (uint8_t) len;
+    } else {
+        entry.payload_len = MQTT_DEADBAND_PAYLOAD_SIZE + 1;
+    }
+    entry.value = value;
+    entry.sent = millis();
+    entry.primed = true;
+}
+
+#ifdef MQTT_TX_QUEUE
+void PubSubClient::deadband_slot_sent(const MQTT::TxQueue<MQTT_TX_QUEUE_SLOTS, MQTT_MAX_PACKET_SIZE>::slot_t *slot) {
+    uint16_t tlen;
+    const char *topic = slot_topic(slot->data, tlen);
+    mqtt_deadband_t *db = deadband_find(topic, tlen, false);
+    if (db == NULL)
+        return;
+
+    // Only QoS 0 is queued, so the payload follows the topic straight away
+    const uint8_t *payload = (const uint8_t *) topic + tlen;
+    size_t len = slot->len - (payload - slot->data);
+    deadband_sent(*db, payload, len, payload_number(payload, len));
+}
+#endif
+
+bool PubSubClient::publish(MQTT::PublishTemplate &tpl, const uint8_t *payload, size_t plength) {
+    if (tpl.qos()) {
+        uint16_t pid = next_packet_id();
+        if (pid == 0)
+            return false;
+        tpl.set_qos(tpl.qos(), pid);
     }
+
+    // A retransmission of the last round may have left the DUP flag set
+    tpl.set_payload(payload, plength).unset_dup();
+    return publish(tpl);
+}
+
+size_t PubSubClient::publish_batch(mqtt_batch_item_t *items, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        items[i].ok = false;
+        items[i].suppressed = false;
+        items[i].packet_id = 0;
+    }
+
+    size_t i = 0;
+    while (i < count && connected()) {
+        if (items[i].qos > 1) {
+            mqtt_batch_item_t &item = items[i++];
+            item.packet_id = next_packet_id();
+            if (item.packet_id == 0)
+                break;
+
+            MQTT::Publish pub(MQTT::TopicRef(item.topic), (uint8_t *) item.payload, item.length);
+            pub.set_retain(item.retain).set_qos(2, item.packet_id);
+            unsigned long suppressed = _suppressed;
+            item.ok = publish(pub);
+            item.suppressed = _suppressed != suppressed;
+            continue;
+        }
+
+        // Up to the next QoS 2 item, or as far as there are packet ids and the rate limit allows
+        size_t end = i;
+        for (; end < count && items[end].qos < 2; end++) {
+            // The deadband filter judges against the last one sent, so an item to a topic the
+            // run sends already waits for the next run
+            mqtt_deadband_t *db = batch_deadband(items[end]);
+            if (db) {
+                size_t k = i;
+                while (k < end && (items[k].ok || batch_deadband(items[k]) != db))
+                    k++;
+                if (k < end)
+                    break;
+            }
+            if (batch_settle(items[end], db))
+                continue;
+            if (items[end].qos == 1 && (items[end].packet_id = next_packet_id()) == 0)
+                break;
+            if (rate_limited()) {
+                size_t tlen = strlen(items[end].topic);
+                // Only the first item of a run waits for its turn
+                if ((end > i && rate_wait(items[end].topic, tlen, false, millis()))
+                    || !rate_block(items[end].topic, tlen, false)) {
+                    release_packet_id(items[end].packet_id);
+                    items[end].packet_id = 0;
+                    break;
+                }
+            }
+        }
+        if (end == i)
+            break;
+
+        unsigned long sent = millis();
+        if (batch_send(items, i, end, false))
+            batch_acks(items, i, end, sent);
+        else
+            batch_release(items, i, end);
+        batch_done(items, i, end);
+        i = end;
+    }
+
+    size_t ok = 0;
+    for (i = 0; i < count; i++)
+        ok += items[i].ok;
+    return ok;
+}
+
+// QoS 0 items are done once the buffer holding them has been written
+static void batch_written(mqtt_batch_item_t *items, size_t from, size_t to) {
+    for (size_t i = from; i < to; i++) {
+        if (items[i].qos == 0)
+            items[i].ok = true;
+    }
+}
+
+bool PubSubClient::batch_send(mqtt_batch_item_t *items, size_t from, size_t to, bool dup) {
+    size_t len = 0;
+    size_t first = from;
+    bool wrote = false;
+
+    for (size_t i = from; i < to; i++) {
+        mqtt_batch_item_t &item = items[i];
+        // Settled before the run, or acknowledged already
+        if (item.ok || (dup && (item.qos == 0 || !packet_id_outstanding(item.packet_id))))
+            continue;
+        wrote = true;
+
+        MQTT::Publish pub(MQTT::TopicRef(item.topic), (uint8_t *) item.payload, item.length);
+        pub.set_retain(item.retain);
+        if (item.qos)
+            pub.set_qos(1, item.packet_id);
+        if (dup)
+            pub.set_dup();
+
+        size_t plen = pub.packet_len();
+        if (len && len + plen > MQTT_MAX_PACKET_SIZE) {
+            if (send(buffer, len) != len)
+                return false;
+            if (!dup)
+                batch_written(items, first, i);
+            len = 0;
+            first = i;
+        }
+
+        if (plen > MQTT_MAX_PACKET_SIZE) {
+            // Too big to gather with others, it takes the chunked path on its own
+            if (!send(pub))
+                return false;
+            if (!dup)
+                batch_written(items, i, i + 1);
+            first = i + 1;
+        } else {
+            len += pub.encode(buffer + len);
+        }
+    }
+
+    if (len) {
+        if (send(buffer, len) != len)
+            return false;
+        if (!dup)
+            batch_written(items, first, to);
+    }
+    // Nothing went out if the filters settled every item, so the keepalive still falls due
+    if (wrote)
+        lastOutActivity = millis();
     return true;
 }
+
+void PubSubClient::batch_acks(mqtt_batch_item_t *items, size_t from, size_t to, unsigned long sent) {
+    bool sampled = false;
+    for (uint8_t retries = 0; ; retries++) {
+        bool pending = false;
+        for (size_t i = from; i < to; i++) {
+            mqtt_batch_item_t &item = items[i];
+            if (item.qos != 1 || item.ok)
+                continue;
+
+            // PUBACKs for later items free their ids while an earlier one is waited for
+            if (packet_id_outstanding(item.packet_id)) {
+                unsigned long elapsed = millis() - sent;
+                if (elapsed >= _rtt.rto || !wait_for(MQTT_PUBACK, item.packet_id, _rtt.rto - elapsed)) {
+                    pending = true;
+                    continue;
+                }
+
+                // Only a response to a single transmission is an unambiguous sample (Karn)
+                if (retries == 0 && !sampled) {
+                    _rtt.sample(millis() - sent);
+                    sampled = true;
+                }
+            }
+            item.ok = true;
+        }
+
+        if (!pending)
+            return;
+
+        if (retries >= _max_retries || !_client.connected())
+            break;
+
+        _rtt.back_off();
+        sent = millis();
+        if (!batch_send(items, from, to, true))
+            break;
+    }
+    batch_release(items, from, to);
+}
+
+void PubSubClient::batch_release(mqtt_batch_item_t *items, size_t from, size_t to) {
+    for (size_t i = from; i < to; i++) {
+        if (items[i].qos == 1 && !items[i].ok)
+            release_packet_id(items[i].packet_id);
+    }
+}
+
+mqtt_deadband_t *PubSubClient::batch_deadband(const mqtt_batch_item_t &item) {
+    if (_deadband_count == 0 || item.payload == NULL)
+        return NULL;
+    return deadband_find(item.topic, strlen(item.topic), false);
+}
+
+bool PubSubClient::batch_settle(mqtt_batch_item_t &item, mqtt_deadband_t *db) {
+    if (_local_count) {
+        MQTT::Publish pub(MQTT::TopicRef(item.topic), (uint8_t *) item.payload, item.length);
+        if (local_only(pub))
+            return item.ok = true;
+    }
+    if (db && deadband_drop(*db, item.payload, item.length, payload_number(item.payload, item.length))) {
+        _suppressed++;
+        return item.ok = item.suppressed = true;
+    }
+    return false;
+}
+
+void PubSubClient::batch_done(mqtt_batch_item_t *items, size_t from, size_t to) {
+    for (size_t i = from; i < to; i++) {
+        mqtt_batch_item_t &item = items[i];
+        if (!item.ok || item.suppressed)
+            continue;
+
+        MQTT::Publish pub(MQTT::TopicRef(item.topic), (uint8_t *) item.payload, item.length);
+        pub.set_retain(item.retain);
+        bool local = _local_count && local_only(pub);
+        mqtt_deadband_t *db = local ? NULL : batch_deadband(item);
+        if (db)
+            deadband_sent(*db, item.payload, item.length, payload_number(item.payload, item.length));
+        if (_local_count)
+            local_deliver(pub);
+    }
+}
+
+MQTT::PayloadWriter PubSubClient::begin_publish(MQTT::Publish &pub) {
+    // Where Message::send() puts the payload: after room for the fixed header, the topic and packet id
+    size_t offset = 5 + 2 + pub.topic_len() + (pub.qos() ? 2 : 0);
+    if (pub.qos() || offset > MQTT_MAX_PACKET_SIZE)
+        return MQTT::PayloadWriter(buffer, 0);
+    return MQTT::PayloadWriter(buffer + offset, MQTT_MAX_PACKET_SIZE - offset);
+}
+
+bool PubSubClient::end_publish(MQTT::Publish &pub, MQTT::PayloadWriter &payload) {
+    if (pub.qos() || payload.overflow())
+        return false;
+
+    pub.set_payload(payload.data(), payload.length());
+    return publish(pub);
+}
+
+bool PubSubClient::sendReliably(MQTT::Message &message) {
+    uint8_t retries = 0;
+    for (;;) {
+        unsigned long sent = millis();
+        send(message);
+        lastOutActivity = sent;
+
+        if (message.response_type() == 0)
+            return true;
+
+        if (wait_for(message.response_type(), message.packet_id(), _rtt.rto)) {
+            // Only a response to a single transmission is an unambiguous sample (Karn)
+            if (retries == 0)
+                _rtt.sample(millis() - sent);
+            return true;
+        }
+
+        if (retries++ >= _max_retries || !_client.connected())
+            return false;
+
+        _rtt.back_off();
+        message.mark_dup();
+    }
+}
+
+#ifdef MQTT_COROUTINES
+// Frame header remembering which pool the frame came from, sized to keep frames aligned
+#define MQTT_FRAME_HEADER sizeof(max_align_t)
+
+void *mqtt_frame_allocate(PubSubClient *client, size_t size) {
+    MQTT::FramePool *pool = client ? &client->_frames : NULL;
+    uint8_t *p = (uint8_t *) (pool ? pool->allocate(size + MQTT_FRAME_HEADER) : malloc(size + MQTT_FRAME_HEADER));
+    if (p == NULL)
+        return NULL;
+    *(MQTT::FramePool **) p = pool;
+    return p + MQTT_FRAME_HEADER;
+}
+
+void mqtt_frame_release(void *frame, size_t size) {
+    uint8_t *p = (uint8_t *) frame - MQTT_FRAME_HEADER;
+    MQTT::FramePool *pool = *(MQTT::FramePool **) p;
+    if (pool)
+        pool->release(p, size + MQTT_FRAME_HEADER);
+    else
+        free(p);
+}
+
+void PubSubClient::add_waiter(mqtt_waiter_t *waiter) {
+    mqtt_waiter_t *&bucket = _waiters[waiter->pid & (MQTT_WAITER_BUCKETS - 1)];
+    waiter->next = bucket;
+    bucket = waiter;
+    if (waiter->timed)
+        _timers.arm_earliest(MQTT_TIMER_WAITERS, waiter->deadline);
+}
+
+bool PubSubClient::resolve_waiter(uint8_t type, uint16_t pid, bool ok) {
+    for (mqtt_waiter_t **w = &_waiters[pid & (MQTT_WAITER_BUCKETS - 1)]; *w; w = &(*w)->next) {
+        mqtt_waiter_t *waiter = *w;
+        if (waiter->type == type && waiter->pid == pid) {
+            // Unlink before resuming, the coroutine may well add a new waiter
+            *w = waiter->next;
+            waiter->ok = ok;
+            waiter->handle.resume();
+            return true;
+        }
+    }
+    return false;
+}
+
+void PubSubClient::fail_waiters(void) {
+    for (uint8_t i = 0; i < MQTT_WAITER_BUCKETS; i++) {
+        while (_waiters[i]) {
+            mqtt_waiter_t *waiter = _waiters[i];
+            _waiters[i] = waiter->next;
+            waiter->ok = false;
+            waiter->handle.resume();
+        }
+    }
+}
+
+void PubSubClient::expire_waiters(void) {
+    unsigned long now = millis();
+    if (!_timers.due(MQTT_TIMER_WAITERS, now))
+        return;
+    _timers.disarm(MQTT_TIMER_WAITERS);
+
+    // Unlink them all before resuming any, a resumed coroutine may add new waiters
+    mqtt_waiter_t *expired = NULL;
+    for (uint8_t i = 0; i < MQTT_WAITER_BUCKETS; i++) {
+        mqtt_waiter_t **w = &_waiters[i];
+        while (*w) {
+            mqtt_waiter_t *waiter = *w;
+            if (waiter->timed && (long) (now - waiter->deadline) >= 0) {
+                *w = waiter->next;
+                waiter->next = expired;
+                expired = waiter;
+                continue;
+            }
+            if (waiter->timed)
+                _timers.arm_earliest(MQTT_TIMER_WAITERS, waiter->deadline);
+            w = &waiter->next;
+        }
+    }
+
+    while (expired) {
+        mqtt_waiter_t *waiter = expired;
+        expired = waiter->next;
+        waiter->ok = false;
+        waiter->handle.resume();
+    }
+}
+
+MQTT::Task<bool> PubSubClient::co_send_reliably(MQTT::Message &message) {
+    uint8_t retries = 0;
+    for (;;) {
+        unsigned long sent = millis();
+        send(message);
+        lastOutActivity = sent;
+
+        bool ok = co_await response_t(*this, message.response_type(), message.packet_id(), _rtt.rto);
+        if (ok) {
+            // Only a response to a single transmission is an unambiguous sample (Karn)
+            if (retries == 0)
+                _rtt.sample(millis() - sent);
+            co_return true;
+        }
+
+        if (retries++ >= _max_retries || !_client.connected())
+            co_return false;
+
+        _rtt.back_off();
+        message.mark_dup();
+    }
+}
+
+MQTT::Task<bool> PubSubClient::co_connect(String id) {
+    if (connected() || !backoff_elapsed())
+        co_return false;
+
+    // Results of co_await are kept in locals rather than used in conditions,
+    // GCC 12 miscompiles some of those
+    bool ok = send_connect(id.c_str(), NULL, 0, false, NULL);
+    if (ok)
+        ok = co_await response_t(*this, MQTT_CONNACK, 0);
+    if (ok) {
+        connack_received();
+        co_return true;
+    }
+    _client.stop();
+    backoff();
+    co_return false;
+}
+
+MQTT::Task<bool> PubSubClient::co_publish(MQTT::Publish &pub) {
+    if (!connected() || (pub.qos() && pub.packet_id() == 0))
+        co_return false;
+
+    if (pub.qos() == 0) {
+        send(pub);
+        lastOutActivity = millis();
+        co_return true;
+    }
+
+    bool ok = co_await co_send_reliably(pub);
+    if (!ok || pub.qos() == 1)
+        co_return ok;
+
+    MQTT::PublishRel pubrel(pub.packet_id());
+    ok = co_await co_send_reliably(pubrel);
+    co_return ok;
+}
+
+MQTT::Task<bool> PubSubClient::co_subscribe(String topic, uint8_t qos) {
+    if (qos > 1 || !connected())
+        co_return false;
+
+    uint16_t pid = next_packet_id();
+    if (pid == 0)
+        co_return false;
+    if (!send_subscribe(topic.c_str(), qos, pid)) {
+        release_packet_id(pid);
+        co_return false;
+    }
+    bool ok = co_await response_t(*this, MQTT_SUBACK, pid);
+    co_return ok;
+}
+#endif
@@ -9,9 +9,43 @@
 
 #include <Arduino.h>
 #include <Stream.h>
-#include <WiFi.h>
 #include <IPAddress.h>
 #include "MQTT.h"
+#include "PayloadWriter.h"
+#include "JsonReader.h"
+#include "LZCodec.h"
+
+#ifdef MQTT_TX_QUEUE
+#include "TxQueue.h"
+#endif
+
+#ifdef MQTT_COROUTINES
+#include "FramePool.h"
+#include "PubSubTask.h"
+
+// MQTT_WAITER_BUCKETS : Hash buckets for coroutines waiting on a response (a power of two)
+#define MQTT_WAITER_BUCKETS 64
+
+// A coroutine suspended until the response with this type and packet id arrives
+struct mqtt_waiter_t {
+    uint8_t type;
+    uint16_t pid;
+    bool ok;
+    bool timed;                 // Given up on at deadline, with ok false
+    unsigned long deadline;
+    std::coroutine_handle<> handle;
+    mqtt_waiter_t *next;
+};
+#endif
+
+// Define MQTT_HOST_BUILD to run over plain sockets (e.g. on a Linux gateway) instead of WiFi
+#ifdef MQTT_HOST_BUILD
+#include "PosixClient.h"
+typedef PosixClient mqtt_transport_t;
+#else
+#include <WiFi.h>
+typedef WiFiClient mqtt_transport_t;
+#endif
 
 #define MQTTPROTOCOLVERSION 3
 #define MQTTCONNECT     1 << 4  // Client request to connect to Server
@@ -39,12 +73,250 @@ struct mqtt_packet_t {
     uint8_t *data;
     size_t length;
     size_t total;
+    size_t streamed;    // Payload bytes handed to the stream / chunk callback instead
+};
+
+// How far readPacket() got with a packet that has not all arrived yet
+struct mqtt_rx_state_t {
+    uint32_t len;       // Bytes of it in the buffer so far, 0 when none is under way
+    uint32_t length;    // Remaining length from the fixed header
+    uint32_t offset;    // Payload bytes streamed or skipped so far
+    uint16_t header;    // Variable header length of a streamed PUBLISH, 0 until known
+    uint8_t lensize;    // Bytes of remaining length, 0 until all are read
+    bool parsed;        // A streamed PUBLISH has its topic parsed
+    int8_t slot;        // RX slot it is read into, -1 for _rx_small
+
+    mqtt_rx_state_t() : len(0), length(0), offset(0), header(0), lensize(0), parsed(false), slot(-1) { }
+};
+
+// A received packet and, for a PUBLISH, the message parsed in place from it
+struct mqtt_rx_slot_t {
+    MQTT::Publish pub;
+    uint8_t data[MQTT_MAX_PACKET_SIZE + 1];     // One spare byte to NUL-terminate the payload
+};
+
+// One message of a publish_batch(), QoS 0, 1 or 2
+struct mqtt_batch_item_t {
+    const char *topic;
+    const uint8_t *payload;
+    size_t length;
+    uint8_t qos;
+    bool retain;
+    bool ok;                // Set by publish_batch(): written for QoS 0, acknowledged otherwise
+    bool suppressed;        // Set by publish_batch(): ok, but dropped by the deadband filter
+    uint16_t packet_id;     // Taken by publish_batch()
+};
+
+// Last publish that went out to a topic under set_deadband()
+struct mqtt_deadband_t {
+    const char *topic;          // Referenced, not copied
+    uint32_t topic_hash;        // FNV-1a of the topic, so most entries are passed over without a compare
+    float value;                // The payload as a number, NaN if it is not one
+    float deadband;             // Numbers within this of value are dropped, negative to compare bytes only
+    unsigned long max_silence;  // After this many milliseconds one goes out regardless, 0 for never
+    unsigned long sent;         // millis() when it went out
+    uint8_t payload[MQTT_DEADBAND_PAYLOAD_SIZE];
+    uint8_t payload_len;        // MQTT_DEADBAND_PAYLOAD_SIZE + 1 if it was too long to keep
+    bool primed;                // Anything went out since set_deadband()
+};
+
+// Token bucket letting rate publishes a second through on average and burst of them at once
+// Counted in thousandths of a publish, refilled by rate of those every millisecond, so a
+// steady stream goes out at exactly rate per second
+struct mqtt_bucket_t {
+    const char *prefix;         // Topics it applies to, NULL for all of them
+    uint8_t prefix_len;
+    uint32_t rate;              // 0 for no limit
+    uint32_t burst, tokens;     // In thousandths
+    unsigned long last;         // millis() of the last refill
+
+    mqtt_bucket_t() : prefix(NULL), prefix_len(0), rate(0) { }
+
+    void set(uint32_t r, uint32_t b, unsigned long now) {
+        rate = r;
+        burst = tokens = (b ? b : 1) * 1000UL;
+        last = now;
+    }
+
+    // Milliseconds until one publish may go, 0 if it may now
+    unsigned long wait(unsigned long now) {
+        if (rate == 0)
+            return 0;
+
+        // What one millisecond adds beyond the burst is kept, or a caller sending the moment
+        // it may would lose the fraction gained past a whole publish every time
+        unsigned long elapsed = now - last;
+        uint32_t full = burst + (rate < 1000 ? rate : 1000) - 1;
+        last = now;
+        if (elapsed > (full - tokens) / rate)
+            tokens = full;
+        else
+            tokens += rate * elapsed;
+        return tokens >= 1000 ? 0 : (1000 - tokens + rate - 1) / rate;
+    }
+
+    void take(void) {
+        if (rate)
+            tokens -= 1000;
+    }
+};
+
+// What publish() does with a publish whose topic matches a subscribe_local() filter
+enum mqtt_local_mode_t {
+    MQTT_LOCAL_ONLY,            // Deliver it in-process and nowhere else
+    MQTT_LOCAL_AND_REMOTE       // Deliver it in-process and send it to the server as well
+};
+
+// Returned by next_timeout() when nothing is scheduled
+#define MQTT_NO_DEADLINE ((unsigned long) -1)
+
+// Everything the client needs to wake up for
+enum mqtt_timer_t {
+    MQTT_TIMER_KEEPALIVE,       // Connection idle, send a PINGREQ
+    MQTT_TIMER_PING_TIMEOUT,    // No PINGRESP, drop the connection
+    MQTT_TIMER_RETRANSMIT,      // No response to a reliable packet, resend it
+    MQTT_TIMER_RECONNECT,       // End of the reconnect backoff
+    MQTT_TIMER_RATE,            // Rate limit lets the next queued publish go
+    MQTT_TIMER_WAITERS,         // A coroutine's response is overdue, resend
+    MQTT_TIMER_COUNT
+};
+
+// A handful of millis() deadlines, all comparisons are safe across rollover
+struct mqtt_timers_t {
+    unsigned long at[MQTT_TIMER_COUNT];
+    uint8_t armed;
+
+    mqtt_timers_t() : armed(0) { }
+
+    void arm(uint8_t timer, unsigned long when) {
+        at[timer] = when;
+        armed |= 1 << timer;
+    }
+
+    // Arm, unless it is already armed for sooner
+    void arm_earliest(uint8_t timer, unsigned long when) {
+        if (!is_armed(timer) || (long) (when - at[timer]) < 0)
+            arm(timer, when);
+    }
+
+    void disarm(uint8_t timer) { armed &= ~(1 << timer); }
+
+    bool is_armed(uint8_t timer) const { return armed & (1 << timer); }
+
+    bool due(uint8_t timer, unsigned long now) const {
+        return is_armed(timer) && (long) (now - at[timer]) >= 0;
+    }
+
+    // Milliseconds from now until the earliest armed deadline
+    unsigned long next(unsigned long now) const {
+        unsigned long wait = MQTT_NO_DEADLINE;
+        for (uint8_t i = 0; i < MQTT_TIMER_COUNT; i++) {
+            if (!is_armed(i))
+                continue;
+            long left = (long) (at[i] - now);
+            if (left <= 0)
+                return 0;
+            if ((unsigned long) left < wait)
+                wait = (unsigned long) left;
+        }
+        return wait;
+    }
+};
+
+#if MQTT_QOS1_WINDOW > 0
+// The last MQTT_QOS1_WINDOW packet ids in a ring, behind a 64 bit filter that
+// answers most lookups for ids not in the ring without scanning it
+struct mqtt_pid_window_t {
+    uint16_t ring[MQTT_QOS1_WINDOW];
+    uint8_t bits[8];
+    uint8_t head, count;
+
+    mqtt_pid_window_t() : head(0), count(0) { memset(bits, 0, sizeof(bits)); }
+
+    bool contains(uint16_t pid) const {
+        if (!(bits[(pid >> 3) & 7] & (1 << (pid & 7))))
+            return false;
+        for (uint8_t i = 0; i < count; i++)
+            if (ring[i] == pid)
+                return true;
+        return false;
+    }
+
+    void add(uint16_t pid) {
+        if (count < MQTT_QOS1_WINDOW) {
+            ring[count++] = pid;
+        } else {
+            // Evict the oldest id, its filter bit stays only if another id shares it
+            uint16_t old = ring[head];
+            ring[head] = pid;
+            head = (uint8_t) ((head + 1) % MQTT_QOS1_WINDOW);
+
+            bits[(old >> 3) & 7] &= ~(1 << (old & 7));
+            for (uint8_t i = 0; i < count; i++)
+                if ((ring[i] & 63) == (old & 63))
+                    bits[(old >> 3) & 7] |= 1 << (old & 7);
+        }
+        bits[(pid >> 3) & 7] |= 1 << (pid & 7);
+    }
+};
+#endif
+
+// Round trip time estimator (RFC 6298) setting the retransmit timeout of reliable sends
+// srtt and rttvar are kept scaled by 8 and 4 as in BSD TCP, so integer maths keeps their precision
+struct mqtt_rtt_t {
+    unsigned long srtt8, rttvar4;
+    unsigned long rto;          // Current retransmit timeout in milliseconds
+    unsigned long samples;      // Round trips measured since connecting
+    unsigned long retransmits;  // Packets sent again since connecting
+
+    mqtt_rtt_t() { reset(); }
+
+    void reset(void) {
+        srtt8 = rttvar4 = samples = retransmits = 0;
+        rto = MQTT_RTO_INITIAL;
+    }
+
+    // Feed the time between sending a packet once (never a retransmission) and its response
+    void sample(unsigned long ms) {
+        if (samples++ == 0) {
+            srtt8 = ms << 3;
+            rttvar4 = ms << 1;
+        } else {
+            long err = (long) ms - (long) (srtt8 >> 3);
+            srtt8 += err;
+            if (err < 0)
+                err = -err;
+            rttvar4 += err - (long) (rttvar4 >> 2);
+        }
+
+        rto = (srtt8 >> 3) + rttvar4;
+        if (rto < MQTT_RTO_MIN)
+            rto = MQTT_RTO_MIN;
+        if (rto > MQTT_RTO_MAX)
+            rto = MQTT_RTO_MAX;
+    }
+
+    // Double the timeout after it expired, until the next sample
+    void back_off(void) {
+        rto = rto * 2 < MQTT_RTO_MAX ? rto * 2 : MQTT_RTO_MAX;
+        retransmits++;
+    }
+
+    // Smoothed round trip time and its mean deviation in milliseconds
+    unsigned long srtt(void) const { return srtt8 >> 3; }
+
+    unsigned long rttvar(void) const { return rttvar4 >> 2; }
 };
 
 class PubSubClient {
 public:
     typedef void(*callback_t)(const MQTT::Publish &, void *);
 
+    // Gets the payload of publishes too big for a receive slot piece by piece as it arrives
+    // pub has the topic and packet id, offset counts from the start of the payload
+    typedef void(*chunk_callback_t)(const MQTT::Publish &pub, const uint8_t *chunk, size_t length,
+                                    uint32_t offset, uint32_t total, void *data);
+
 private:
 
     IPAddress server_ip;
@@ -55,17 +327,193 @@ private:
     callback_t _callback;
     void *_callback_data;
     Stream *_stream;
+    chunk_callback_t _chunk_callback;
+    void *_chunk_data;
+    size_t _stream_threshold = 0;
+
+#ifdef MQTT_LZ
+    // Decompresses payloads of flagged topics on their way to the stream / chunk callback
+    MQTT::LZDecoder _lz;
+    const MQTT::Publish *_lz_pub = NULL;
+    unsigned long _lz_errors = 0;
+
+    static void lz_sink(const uint8_t *data, size_t len, void *client);
+
+    // Once a compressed payload has all been read, report it if it did not decode
+    void lz_finish(void);
+#endif
+
+    // Report-by-exception state, see set_deadband()
+    mqtt_deadband_t _deadband[MQTT_DEADBAND_TOPICS] = {};
+    uint8_t _deadband_count = 0;
+    unsigned long _suppressed = 0;
+
+    mqtt_deadband_t *deadband_find(const char *topic, size_t len, bool progmem);
 
-    WiFiClient _client;
+    // Entry filtering pub's topic, NULL if there is none or the payload cannot be looked at
+    mqtt_deadband_t *deadband_entry(const MQTT::Publish &pub);
+
+    // Whether a payload only repeats what went out last
+    bool deadband_drop(const mqtt_deadband_t &entry, const uint8_t *payload, size_t len, float value) const;
+
+    // Remember a payload that has gone out, not merely been queued
+    void deadband_sent(mqtt_deadband_t &entry, const uint8_t *payload, size_t len, float value);
+
+    // Publish rate limits, see set_rate_limit()
+    mqtt_bucket_t _rate;
+    mqtt_bucket_t _rate_prefix[MQTT_RATE_PREFIXES];
+    uint8_t _rate_prefix_count = 0;
+    bool _rate_coalesce = false;
+    unsigned long _coalesced = 0;
+
+    bool rate_limited(void) const { return _rate.rate || _rate_prefix_count; }
+
+    // Milliseconds until a publish to topic may go out under every limit it falls under
+    unsigned long rate_wait(const char *topic, size_t len, bool progmem, unsigned long now);
+
+    void rate_take(const char *topic, size_t len, bool progmem);
+
+    // Wait until a publish to topic may go and take its tokens, queueing incoming publishes meanwhile
+    bool rate_block(const char *topic, size_t len, bool progmem);
+
+    // Let pub go now, or queue it if it is QoS 0 and would have to wait
+    bool rate_admit(MQTT::Publish &pub, bool &queued);
+
+    // Loopback subscriptions, see subscribe_local()
+    struct local_sub_t {
+        const char *filter;     // Referenced, not copied
+        callback_t callback;
+        void *data;
+        mqtt_local_mode_t mode;
+    };
+    local_sub_t _local[MQTT_LOCAL_SUBSCRIPTIONS] = {};
+    uint8_t _local_count = 0;
+    uint8_t _local_depth = 0;       // Loopback callbacks on the stack
+
+    // A payload subscribers publishing in turn would overwrite, copied here while they have it
+    uint8_t _local_pin[MQTT_MAX_PACKET_SIZE + 1];
+    bool _local_pinned = false;
+
+    // Whether a loopback subscription keeps pub off the network
+    bool local_only(const MQTT::Publish &pub) const;
+
+    // Whether any loopback subscription would be handed a publish to topic, at this depth
+    bool local_wanted(const char *topic, size_t len, bool progmem) const;
+
+    // Hand pub to every loopback subscription matching its topic
+    void local_deliver(MQTT::Publish &pub);
+
+    // Hand the publish packet of len bytes copied to _local_pin over
+    void local_deliver_pinned(size_t len);
+
+    void local_dispatch(MQTT::Publish &pub);
+
+    // Send pub to the server, handing it to loopback subscribers once it has gone out
+    bool publish_remote(MQTT::Publish &pub);
+
+    // Hand a piece of a payload to the stream and chunk callback
+    void sink_chunk(const MQTT::Publish &pub, const uint8_t *chunk, size_t length, uint32_t offset, uint32_t total);
+
+    mqtt_transport_t _client;
     uint8_t buffer[MQTT_MAX_PACKET_SIZE];
     uint16_t keepalive = MQTT_KEEPALIVE;
     uint8_t _max_retries;
     uint16_t nextMsgId;
+    // Outstanding packet ids, each in slot (id % MQTT_MAX_INFLIGHT), 0 for a free slot
+    uint16_t _inflight[MQTT_MAX_INFLIGHT] = {};
     unsigned long lastOutActivity;
     unsigned long lastInActivity;
     bool pingOutstanding;
+    bool _connecting;       // CONNECT sent by connect_async(), CONNACK not in yet
+    mqtt_timers_t _timers;
+    mqtt_rtt_t _rtt;
+    unsigned long _backoff_min, _backoff_max, _backoff;
+
+    // PUBACKs, PUBRECs and PUBCOMPs for inbound messages, written out together at the end of a loop() pass
+    uint8_t _ack_buffer[MQTT_MAX_PENDING_ACKS * 4] = {};
+    uint8_t _ack_len;
+
+    // Packet ids of inbound QoS2 messages already delivered, until the server releases them
+    uint16_t _qos2_pids[MQTT_MAX_INBOUND_QOS2] = {};
+    uint8_t _qos2_count;
+
+#if MQTT_QOS1_WINDOW > 0
+    // Inbound QoS1 ids recently delivered, kept across reconnects since that is when servers redeliver
+    mqtt_pid_window_t _qos1_seen;
+#endif
+
+    // Inbound publishes are read into their own slots, apart from the TX buffer, and
+    // parsed in place: their payload stays valid until the callback returns, even if
+    // it publishes
+    mqtt_rx_slot_t _rx_slots[MQTT_RX_SLOTS];
+    uint32_t _rx_busy;      // Slots queued or in their callback
+    static_assert(MQTT_RX_SLOTS >= 2 && MQTT_RX_SLOTS <= 32, "MQTT_RX_SLOTS must be from 2 to 32");
+
+    // Everything else is a few bytes and read here, so responses still get through
+    // while callbacks further up the stack hold every slot
+    uint8_t _rx_small[8] = {};
+
+    // Inbound publishes parsed but not yet handed to the callback. Reading stops
+    // once _rx_high_water of them are waiting, leaving the rest to TCP flow control
+    uint8_t _rx_queue[MQTT_RX_QUEUE_SLOTS] = {};
+    uint8_t _rx_head, _rx_count, _rx_high_water;
+    mqtt_rx_state_t _rx_part;
 
-    size_t send(uint8_t c);
+    // A slot to read into, -1 if all are taken
+    int8_t free_rx_slot(void) const;
+
+    // Whether the next packet is a publish with no slot to read it into
+    bool rx_blocked(void);
+
+    // Read one packet: a publish is queued, anything else processed straight away
+    // Returns true if that matched the type and packet id given, as processMessage() does,
+    // false without reading anything when every slot is taken
+    bool receive(uint8_t match_type = 0, uint16_t match_pid = 0);
+
+    // Read packets until the RX queue reaches its high-water mark
+    void fill_rx_queue(void);
+
+    // Dispatch queued publishes until there is room to receive another one
+    // False if every slot is held by callbacks further up the stack
+    bool make_rx_room(void);
+
+    // Process the oldest queued publish, false if there was none
+    bool dispatch_rx_queue(void);
+
+    // Drop every queued publish
+    void clear_rx_queue(void);
+
+    // Queue a PUBACK/PUBREC/PUBCOMP, flushing first if the batch is full
+    bool queue_ack(uint8_t header, uint16_t pid);
+
+    // Index of an inbound QoS2 packet id in _qos2_pids, _qos2_count if it is not there
+    uint8_t qos2_find(uint16_t pid) const;
+
+    // Remember an inbound QoS2 packet id, false if it was already there
+    bool qos2_record(uint16_t pid);
+
+    // Forget the inbound QoS2 packet id at index i
+    void qos2_remove(uint8_t i);
+
+    // Write out any queued PUBACKs
+    bool flush_acks(void);
+
+#ifdef MQTT_TX_QUEUE
+    // Packets encoded by publish_async() on other threads
+    MQTT::TxQueue<MQTT_TX_QUEUE_SLOTS, MQTT_MAX_PACKET_SIZE> _tx_queue;
+#endif
+
+    // Send everything publish_async() has queued, only from the owning thread
+    // as far as the rate limit allows
+    bool flush_tx_queue(void);
+
+#ifdef MQTT_TX_QUEUE
+    // Whether a publish with the same topic and flags is queued behind slot
+    bool tx_superseded(const MQTT::TxQueue<MQTT_TX_QUEUE_SLOTS, MQTT_MAX_PACKET_SIZE>::slot_t *slot);
+
+    // Deadband bookkeeping for a queued publish as it goes out
+    void deadband_slot_sent(const MQTT::TxQueue<MQTT_TX_QUEUE_SLOTS, MQTT_MAX_PACKET_SIZE>::slot_t *slot);
+#endif
 
     size_t send(const uint8_t *buf, size_t len);
 
@@ -73,36 +521,140 @@ private:
 
     bool sendReliably(MQTT::Message &message);
 
-    mqtt_packet_t readPacket();
+    // Write items [from, to) of a batch back to back, as few buffer-fulls as possible
+    // With dup set only the QoS 1 ones still waiting for their PUBACK go out again
+    bool batch_send(mqtt_batch_item_t *items, size_t from, size_t to, bool dup);
+
+    // Collect the PUBACKs for items [from, to) sent at sent, retransmitting on timeout
+    void batch_acks(mqtt_batch_item_t *items, size_t from, size_t to, unsigned long sent);
+
+    bool packet_id_outstanding(uint16_t pid) const {
+        return _inflight[pid & (MQTT_MAX_INFLIGHT - 1)] == pid;
+    }
+
+    // Release the packet ids of QoS 1 items in [from, to) that were not acknowledged
+    void batch_release(mqtt_batch_item_t *items, size_t from, size_t to);
+
+    // The deadband entry for an item's topic, NULL if it has none
+    mqtt_deadband_t *batch_deadband(const mqtt_batch_item_t &item);
 
-    MQTT::Message *readMessage();
+    // Settle a QoS 0 or 1 item that publish() would not send, kept local or dropped by db,
+    // before its run goes out. False if it has to be sent
+    bool batch_settle(mqtt_batch_item_t &item, mqtt_deadband_t *db);
 
-    uint8_t readByte();
+    // What publish() does once a publish went out, for the items of a run that made it:
+    // remember them for the deadband filter and hand them to loopback subscribers, in order
+    void batch_done(mqtt_batch_item_t *items, size_t from, size_t to);
 
-    bool write(uint8_t header, uint8_t *buf, uint16_t length);
+    // Read a packet into buf (size bytes) without waiting for more to arrive
+    // total is 0 until all of it has, the rest is read into the same buf by the next call
+    // A PUBLISH streamed to the sink is parsed into pub, so it can only be streamed with one
+    mqtt_packet_t readPacket(uint8_t *buf, MQTT::Publish *pub = NULL, size_t size = MQTT_MAX_PACKET_SIZE);
 
-    uint16_t writeString(String string, uint8_t *buf, uint16_t pos);
+    // What readPacket() returns while a packet is incomplete, dropping it if the connection is gone
+    mqtt_packet_t &read_pending(mqtt_packet_t &packet);
 
-    // Wait for a certain type of packet to come back, optionally check its packet id
-    bool wait_for(uint8_t wait_type, uint16_t wait_pid = 0);
+    // Decode anything but a PUBLISH onto the stack and process it
+    bool processPacket(mqtt_packet_t &packet, uint8_t match_type, uint16_t match_pid);
+
+    bool write(uint8_t header, uint8_t *buf, uint32_t length);
+
+    // Length-prefixed string, read from PROGMEM if progmem is set
+    uint16_t writeString(const char *string, uint8_t *buf, uint16_t pos, bool progmem = false);
+
+    // Wait up to timeout_ms for a certain type of packet to come back, optionally check its packet id
+    bool wait_for(uint8_t wait_type, uint16_t wait_pid, unsigned long timeout_ms);
 
     bool processMessage(MQTT::Message *msg, uint8_t match_type = 0, uint16_t match_pid = 0);
 
+    // Re-arm the keepalive timer from the last in/out activity
+    void update_keepalive(void);
+
+    // Send a ping or drop the connection if the keepalive timers say so
+    // Returns false if the connection was dropped
+    bool check_keepalive(void);
+
+    // Schedule the next connect() attempt after a failure or dropped connection
+    void backoff(void);
+
+    // False while the reconnect backoff is still running
+    bool backoff_elapsed(void);
+
+    // Open the transport and send CONNECT
+    bool send_connect(const char *id, const char *willTopic, uint8_t willQos, bool willRetain, const char *willMessage);
+
+    // Bookkeeping once the CONNACK has accepted us
+    void connack_received(void);
+
+    // Encode and send a SUBSCRIBE for one topic
+    bool send_subscribe(const char *topic, uint8_t qos, uint16_t pid, bool progmem = false);
+
+    bool subscribe_topic(const char *topic, uint8_t qos, bool progmem);
+
+    bool unsubscribe_topic(const char *topic, bool progmem);
+
+#ifdef MQTT_COROUTINES
+    MQTT::FramePool _frames;
+    mqtt_waiter_t *_waiters[MQTT_WAITER_BUCKETS] = {};
+
+    // Awaitable that parks the calling coroutine in _waiters, for at most timeout_ms if not 0
+    class response_t {
+    private:
+        PubSubClient &_client;
+        mqtt_waiter_t _waiter;
+
+    public:
+        response_t(PubSubClient &client, uint8_t type, uint16_t pid, unsigned long timeout_ms = 0) :
+                _client(client) {
+            _waiter.type = type;
+            _waiter.pid = pid;
+            _waiter.ok = false;
+            _waiter.timed = timeout_ms != 0;
+            _waiter.deadline = millis() + timeout_ms;
+        }
+
+        bool await_ready() { return !_client.connected(); }
+
+        void await_suspend(std::coroutine_handle<> h) {
+            _waiter.handle = h;
+            _client.add_waiter(&_waiter);
+        }
+
+        bool await_resume() { return _waiter.ok; }
+    };
+
+    void add_waiter(mqtt_waiter_t *waiter);
+
+    // Resume the coroutine waiting for this response, if any
+    bool resolve_waiter(uint8_t type, uint16_t pid, bool ok);
+
+    // Resume every waiting coroutine with a failure, e.g. when the connection is lost
+    void fail_waiters(void);
+
+    // Resume the coroutines whose response is overdue with a failure
+    void expire_waiters(void);
+
+    // sendReliably() for coroutines: resend with the same RTO and retries until the response comes
+    MQTT::Task<bool> co_send_reliably(MQTT::Message &message);
+
+    friend void *mqtt_frame_allocate(PubSubClient *client, size_t size);
+#endif
+
 
 public:
     PubSubClient();
 
     PubSubClient(IPAddress &ip, uint16_t port = 1883, bool ssl = false);
 
-    PubSubClient(String hostname, uint16_t port = 1883, bool ssl = false);
+    PubSubClient(const String &hostname, uint16_t port = 1883, bool ssl = false);
 
     PubSubClient &set_server(IPAddress &ip, uint16_t port = 1883, bool ssl = false);
 
-    PubSubClient &set_server(String hostname, uint16_t port = 1883, bool ssl = false);
+    PubSubClient &set_server(const String &hostname, uint16_t port = 1883, bool ssl = false);
 
     PubSubClient &unset_server(void);
 
-    PubSubClient &set_auth(String u, String p);
+    PubSubClient &set_auth(const String &u, const String &p);
 
     PubSubClient &unset_auth(void);
 
@@ -118,41 +670,230 @@ public:
         return *this;
     }
 
+    // Stop reading from the network once this many publishes wait for the callback
+    // (1 to MQTT_RX_QUEUE_SLOTS), so a slow callback throttles the server through TCP
+    PubSubClient &set_rx_high_water(uint8_t n);
+
+    // Publishes read but not yet handed to the callback
+    uint8_t rx_pending(void) const { return _rx_count; }
+
+    // Wait between failed connect() attempts, doubling from min_ms up to max_ms
+    // connect() returns false without trying while the backoff is running. 0 disables it
+    PubSubClient &set_reconnect_backoff(unsigned long min_ms, unsigned long max_ms);
+
+    // With a stream or chunk callback set, every publish payload is passed on to it as well as
+    // to the callback. Publishes larger than MQTT_MAX_PACKET_SIZE, normally dropped, are passed
+    // on as they are read instead, and the callback then gets them with an empty payload
+    // With MQTT_LZ defined, payloads of topics ending in MQTT_LZ_SUFFIX, whatever their size,
+    // are passed on decompressed, with offset and total counting uncompressed bytes.
+    // One that is corrupt or cut short ends with a call with a NULL chunk and counts in lz_errors()
     Stream *stream(void) const { return _stream; }
 
     PubSubClient &set_stream(Stream &s);
 
     PubSubClient &unset_stream(void);
 
-    bool connect(String id);
+    PubSubClient &set_chunk_callback(chunk_callback_t cb, void *data = NULL);
+
+    PubSubClient &unset_chunk_callback(void);
+
+    // Only pass on payloads longer than bytes, leaving those that fit a slot to the callback alone
+    // 0, the default, passes on every one
+    PubSubClient &set_stream_threshold(size_t bytes);
+
+#ifdef MQTT_LZ
+    // Compressed payloads passed on that turned out corrupt or cut short
+    unsigned long lz_errors(void) const { return _lz_errors; }
+#endif
+
+    // The const char * and __FlashStringHelper * (F("...")) versions never touch the heap
+    bool connect(const String &id);
 
-    bool connect(String id, String willTopic, uint8_t willQos, bool willRetain, String willMessage);
+    bool connect(const char *id);
+
+    bool connect(const String &id, const String &willTopic, uint8_t willQos, bool willRetain, const String &willMessage);
+
+    bool connect(const char *id, const char *willTopic, uint8_t willQos, bool willRetain, const char *willMessage);
+
+    // Send CONNECT and return without waiting for the CONNACK, which on_readable() or loop()
+    // then handles. connecting() stays true until it arrives; a refusal, or no answer within
+    // MQTT_KEEPALIVE seconds, closes the connection and starts the reconnect backoff
+    bool connect_async(const char *id);
+
+    bool connecting(void) const { return _connecting; }
 
     void disconnect(void);
 
-    bool publish(String topic, String payload);
+    bool publish(const String &topic, const String &payload);
+
+    bool publish(const char *topic, const char *payload);
+
+    bool publish(const String &topic, const uint8_t *payload, unsigned int plength, bool retained = false);
+
+    bool publish(const char *topic, const uint8_t *payload, unsigned int plength, bool retained = false);
+
+    bool publish(const __FlashStringHelper *topic, const uint8_t *payload, unsigned int plength, bool retained = false);
+
+    // Payload in PROGMEM, copied into the packet a buffer-sized chunk at a time as it is sent
+    bool publish_P(const String &topic, const uint8_t PROGMEM *payload, unsigned int, bool retained = false);
+
+    bool publish_P(const char *topic, const uint8_t PROGMEM *payload, unsigned int, bool retained = false);
+
+    bool publish_P(const __FlashStringHelper *topic, const uint8_t PROGMEM *payload, unsigned int,
+                   bool retained = false);
 
-    bool publish(String topic, const uint8_t *payload, unsigned int plength, bool retained = false);
+    bool subscribe(const String &topic, uint8_t qos = 0);
 
-    bool publish_P(String topic, const uint8_t PROGMEM *payload, unsigned int, bool retained = false);
+    bool subscribe(const char *topic, uint8_t qos = 0);
 
-    bool subscribe(String topic, uint8_t qos = 0);
+    bool subscribe(const __FlashStringHelper *topic, uint8_t qos = 0);
 
-    bool unsubscribe(String topic);
+    bool unsubscribe(const String &topic);
+
+    bool unsubscribe(const char *topic);
+
+    bool unsubscribe(const __FlashStringHelper *topic);
 
     bool loop();
 
+    // Keep processing buffered packets until none are left or budget_us has been spent
+    // Returns 1 while there is more to do (bytes unread or publishes queued), 0 once
+    // drained, or -1 if not connected
+    // If wait_ms is given it receives next_timeout(), so the caller can sleep until then
+    int loop(unsigned long budget_us, unsigned long *wait_ms = NULL);
+
+    // Milliseconds until loop() (or connect() after a backoff) next needs calling,
+    // MQTT_NO_DEADLINE if nothing is scheduled. Incoming data should still wake the caller
+    unsigned long next_timeout(void);
+
+    // Readiness entry points for driving the client from poll()/epoll()/select()
+    // on_readable() handles every packet already received and returns what loop(budget_us) does,
+    // on_writable() writes out queued packets and on_timeout() services the timers,
+    // returning next_timeout(). Watch for writability only while wants_write() is true
+    int on_readable(void);
+
+    bool on_writable(void);
+
+    unsigned long on_timeout(void);
+
+    bool wants_write(void) const;
+
+#ifdef MQTT_HOST_BUILD
+    // Socket to register with the event loop, -1 when not connected
+    int fd(void) const { return _client.fd(); }
+
+    // Look up the server's name now (this blocks), so connecting later does not have to
+    // Returns false if it does not resolve
+    bool resolve(void);
+#endif
+
     bool connected();
 
+    // Round trip statistics and current retransmit timeout of this connection
+    const mqtt_rtt_t &rtt(void) const { return _rtt; }
+
     bool publish(MQTT::Publish &pub);
 
-    // Return the next packet id
-    // Needed for constructing our own publish (with QoS>0) or (un)subscribe messages
-    uint16_t next_packet_id(void) {
-        nextMsgId++;
-        if (nextMsgId == 0) nextMsgId = 1;
-        return nextMsgId;
+    // Report by exception: publish() drops a publish to topic while its payload is byte-identical
+    // to the last one that went out, or, when both are plain numbers, within deadband of it.
+    // Payloads longer than MQTT_DEADBAND_PAYLOAD_SIZE are only compared as numbers.
+    // After max_silence_ms without one going out the next goes regardless (0 for never)
+    // Dropped publishes count as successful. False if MQTT_DEADBAND_TOPICS are filtered already
+    // topic is referenced rather than copied
+    bool set_deadband(const char *topic, float deadband = 0, unsigned long max_silence_ms = 0);
+
+    void unset_deadband(const char *topic);
+
+    // Publishes dropped by the deadband filter
+    unsigned long suppressed(void) const { return _suppressed; }
+
+    // Token-bucket rate limit on publish(), publish_async() and publish_batch(): rate a second
+    // on average, up to burst at once. QoS 0 publishes over the limit join the TX queue, which
+    // loop() / on_writable() drain at the rate, with next_timeout() telling when the next may go.
+    // QoS 1 and 2 publishes wait for their turn in publish(). A rate of 0 lifts the limit
+    PubSubClient &set_rate_limit(uint32_t rate, uint32_t burst = 1);
+
+    // A limit of its own for topics starting with prefix, which is referenced rather than copied
+    // Applies on top of the overall one. False if MQTT_RATE_PREFIXES have a limit already
+    bool set_rate_limit(const char *prefix, uint32_t rate, uint32_t burst = 1);
+
+    // While held back by the limit, a queued QoS 0 publish is dropped in favour of a later one
+    // to the same topic, so only the latest value goes out
+    PubSubClient &set_rate_coalesce(bool c = true) {
+        _rate_coalesce = c;
+        return *this;
     }
+
+    // Queued publishes dropped in favour of later ones
+    unsigned long coalesced(void) const { return _coalesced; }
+
+    // Loopback for modules on the same device: publish() hands publishes whose topic matches
+    // filter ('+' and '#' wildcards included) straight to cb, or to the callback if cb is NULL,
+    // in microseconds rather than a round trip through the server. MQTT_LOCAL_ONLY keeps them
+    // off the network, and works while disconnected, MQTT_LOCAL_AND_REMOTE sends them to the
+    // server as well, which echoes them back if the client also subscribed there, and are only
+    // handed over once they went out: queued ones when the TX queue sends them, QoS 1 and 2
+    // once acknowledged, and none set_deadband() dropped. Publishes from a loopback callback
+    // are looped back up to MQTT_LOCAL_DEPTH deep.
+    // If any matching filter is local only, the publish stays local. publish_batch() items
+    // are handed over once their run went out, publish_async() ones are not looped back. A PROGMEM payload is handed over as it is, see
+    // payload_P(). filter is referenced, not copied. Subscribing the same filter and cb again
+    // changes its mode. False if MQTT_LOCAL_SUBSCRIPTIONS are in use
+    bool subscribe_local(const char *filter, mqtt_local_mode_t mode = MQTT_LOCAL_ONLY,
+                         callback_t cb = NULL, void *data = NULL);
+
+    // Drop every loopback subscription to filter
+    void unsubscribe_local(const char *filter);
+
+    // Publish the template's topic again with a new payload, taking a packet id if its QoS needs one
+    bool publish(MQTT::PublishTemplate &tpl, const uint8_t *payload, size_t plength);
+
+    // Publish several messages in one go: QoS 0 and 1 items are encoded back to back and
+    // written together, then the PUBACKs of all QoS 1 items are awaited at once, with a
+    // single retransmit timer. QoS 2 items go through publish() one at a time, in order
+    // Every item is treated as publish() treats it: subscribe_local() and set_deadband()
+    // apply, with local only items and the ones the deadband filter drops counting as ok
+    // Sets each item's ok and suppressed and returns how many succeeded
+    size_t publish_batch(mqtt_batch_item_t *items, size_t count);
+
+    // Format a QoS 0 payload straight into the TX buffer, behind where pub's topic goes,
+    // then send it with end_publish(). Nothing else may be sent in between
+    // QoS 1 and 2 payloads have to outlive retransmissions, so format those into a buffer
+    // of their own with a PayloadWriter and publish that
+    MQTT::PayloadWriter begin_publish(MQTT::Publish &pub);
+
+    // False if the payload overflowed the buffer
+    bool end_publish(MQTT::Publish &pub, MQTT::PayloadWriter &payload);
+
+#ifdef MQTT_COROUTINES
+    // Awaitable versions for C++20 coroutines: they send their packet and suspend until the
+    // matching CONNACK / PUBACK / PUBCOMP / SUBACK arrives through loop() or on_readable(),
+    // instead of blocking. They complete with false if the connection is lost meanwhile
+    // co_publish() resends like publish() does, from on_timeout() or loop()
+    // Their frames, and those of any coroutine taking a PubSubClient& first, come from a
+    // per-client pool
+    MQTT::Task<bool> co_connect(String id);
+
+    MQTT::Task<bool> co_publish(MQTT::Publish &pub);
+
+    MQTT::Task<bool> co_subscribe(String topic, uint8_t qos = 0);
+#endif
+
+#ifdef MQTT_TX_QUEUE
+    // QoS0 publish that is safe to call from any thread and never blocks
+    // The packet is encoded straight into the TX queue and sent by the thread that
+    // owns the client on its next loop() or on_writable()
+    // Returns false if the queue is full or the packet is larger than MQTT_MAX_PACKET_SIZE
+    bool publish_async(const char *topic, const uint8_t *payload, size_t plength, bool retained = false);
+#endif
+
+    // Return the next packet id not currently outstanding, 0 if MQTT_MAX_INFLIGHT are in use
+    // Needed for constructing our own publish (with QoS>0) or (un)subscribe messages
+    // The id is freed by the PUBACK / PUBCOMP / SUBACK / UNSUBACK completing its exchange
+    uint16_t next_packet_id(void);
+
+    // Free an id whose exchange was given up
+    void release_packet_id(uint16_t pid);
 };
 
 
@@ -0,0 +1,253 @@
+/*
+ PubSubGateway.cpp - Run many PubSubClients across worker threads on a host.
+*/
+
+#include "PubSubGateway.h"
+
+#ifdef MQTT_HOST_BUILD
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+// epoll tag for a worker's wake-up eventfd
+#define WAKE_TAG 0xffffffff
+
+// Longest a worker sleeps without looking at its clients' timers
+#define MAX_SWEEP_MS 1000UL
+
+PubSubGateway::PubSubGateway(size_t workers) :
+        _num_workers(workers),
+        _tick(NULL),
+        _tick_data(NULL),
+        _running(false) {
+    if (_num_workers == 0)
+        _num_workers = std::thread::hardware_concurrency();
+    if (_num_workers == 0)
+        _num_workers = 1;
+
+    _workers = new worker_t[_num_workers];
+    for (size_t w = 0; w < _num_workers; w++) {
+        _workers[w].epoll_fd = -1;
+        _workers[w].wake_fd = -1;
+        _workers[w].inbox = new handoff_queue_t[_num_workers];
+    }
+}
+
+PubSubGateway::~PubSubGateway() {
+    stop();
+    for (size_t w = 0; w < _num_workers; w++)
+        delete[] _workers[w].inbox;
+    delete[] _workers;
+}
+
+size_t PubSubGateway::add_client(PubSubClient &client, String id) {
+    size_t index = _clients.size();
+    _clients.push_back(&client);
+    _ids.push_back(id);
+
+    worker_t &worker = _workers[worker_of(index)];
+    worker.clients.push_back((uint32_t) index);
+    worker.interest.push_back(0);
+    worker.pending.push_back(false);
+    return index;
+}
+
+PubSubGateway &PubSubGateway::set_tick(tick_t tick, void *data) {
+    _tick = tick;
+    _tick_data = data;
+    return *this;
+}
+
+bool PubSubGateway::start(void) {
+    if (_running)
+        return false;
+
+    // Looked up here, on the caller's thread, as getaddrinfo() would stall a worker's whole shard
+    for (size_t i = 0; i < _clients.size(); i++) {
+        if (!_clients[i]->resolve())
+            return false;
+    }
+
+    for (size_t w = 0; w < _num_workers; w++) {
+        worker_t &worker = _workers[w];
+        worker.epoll_fd = epoll_create1(0);
+        worker.wake_fd = eventfd(0, EFD_NONBLOCK);
+        if (worker.epoll_fd < 0 || worker.wake_fd < 0)
+            return false;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = WAKE_TAG;
+        epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, worker.wake_fd, &ev);
+    }
+
+    _running = true;
+    for (size_t w = 0; w < _num_workers; w++)
+        _workers[w].thread = std::thread(&PubSubGateway::run, this, w);
+    return true;
+}
+
+void PubSubGateway::stop(void) {
+    if (!_running)
+        return;
+
+    _running = false;
+    for (size_t w = 0; w < _num_workers; w++) {
+        uint64_t one = 1;
+        if (write(_workers[w].wake_fd, &one, sizeof(one)) < 0) { }
+    }
+
+    for (size_t w = 0; w < _num_workers; w++) {
+        worker_t &worker = _workers[w];
+        worker.thread.join();
+        close(worker.epoll_fd);
+        close(worker.wake_fd);
+        worker.epoll_fd = worker.wake_fd = -1;
+    }
+}
+
+void PubSubGateway::watch(worker_t &worker, size_t k, bool add) {
+    PubSubClient &client = *_clients[worker.clients[k]];
+
+    struct epoll_event ev;
+    ev.events = (uint32_t) EPOLLIN | (client.wants_write() ? (uint32_t) EPOLLOUT : 0);
+    ev.data.u32 = (uint32_t) k;
+    if (!add && ev.events == worker.interest[k])
+        return;
+
+    worker.interest[k] = ev.events;
+    epoll_ctl(worker.epoll_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, client.fd(), &ev);
+}
+
+bool PubSubGateway::reconnect(worker_t &worker, size_t k) {
+    uint32_t index = worker.clients[k];
+    if (!_clients[index]->connect_async(_ids[index].c_str())) {
+        worker.stats.failed++;
+        return false;
+    }
+
+    worker.pending[k] = true;
+    watch(worker, k, true);
+    return true;
+}
+
+void PubSubGateway::dropped(worker_t &worker, size_t k) {
+    // Closing the socket already took it out of the epoll set
+    worker.interest[k] = 0;
+    if (worker.pending[k]) {
+        worker.pending[k] = false;
+        worker.stats.failed++;
+    }
+}
+
+void PubSubGateway::drain_inbox(worker_t &worker) {
+    for (size_t from = 0; from < _num_workers; from++) {
+        handoff_queue_t &queue = worker.inbox[from];
+        mqtt_handoff_t *h;
+        while ((h = queue.front()) != NULL) {
+            _clients[h->client]->publish((const char *) h->data, h->data + h->topic_len + 1, h->payload_len);
+            queue.pop();
+        }
+    }
+}
+
+void PubSubGateway::run(size_t w) {
+    worker_t &worker = _workers[w];
+
+    // Connecting happens here so that connection setup is spread over the workers too
+    for (size_t k = 0; k < worker.clients.size(); k++)
+        reconnect(worker, k);
+
+    unsigned long next_sweep = millis();
+    struct epoll_event ready[64];
+
+    while (_running.load(std::memory_order_relaxed)) {
+        bool busy = _tick ? _tick(*this, w, _tick_data) : false;
+
+        // Timers are only swept when the earliest of them is due, not on every wake-up
+        unsigned long now = millis();
+        if ((long) (now - next_sweep) >= 0) {
+            unsigned long soonest = MAX_SWEEP_MS;
+            for (size_t k = 0; k < worker.clients.size(); k++) {
+                // Also catches clients dropped by a ping timeout or a failed publish
+                PubSubClient &client = *_clients[worker.clients[k]];
+                if (!client.connected()) {
+                    if (worker.interest[k])
+                        dropped(worker, k);
+                    reconnect(worker, k);
+                }
+                soonest = min(soonest, client.on_timeout());
+            }
+            next_sweep = now + soonest;
+        }
+
+        long wait_ms = busy ? 0 : (long) (next_sweep - now);
+        int n = epoll_wait(worker.epoll_fd, ready, 64, wait_ms > 0 ? (int) wait_ms : 0);
+
+        for (int i = 0; i < n; i++) {
+            uint32_t k = ready[i].data.u32;
+            if (k == WAKE_TAG) {
+                uint64_t count;
+                if (read(worker.wake_fd, &count, sizeof(count)) < 0) { }
+                continue;
+            }
+
+            PubSubClient &client = *_clients[worker.clients[k]];
+            if (ready[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                client.on_readable();
+            if (!client.connected()) {
+                dropped(worker, k);
+                continue;
+            }
+            if (worker.pending[k] && !client.connecting()) {
+                worker.pending[k] = false;
+                worker.stats.connected++;
+            }
+            if (ready[i].events & EPOLLOUT)
+                client.on_writable();
+            watch(worker, k, false);
+        }
+
+        drain_inbox(worker);
+    }
+
+    for (size_t k = 0; k < worker.clients.size(); k++) {
+        if (_clients[worker.clients[k]]->connected())
+            _clients[worker.clients[k]]->disconnect();
+    }
+}
+
+bool PubSubGateway::publish(size_t from_worker, size_t client, const char *topic, const uint8_t *payload,
+                            size_t length) {
+    size_t to_worker = worker_of(client);
+    if (to_worker == from_worker)
+        return _clients[client]->publish(topic, payload, length);
+
+    worker_t &from = _workers[from_worker];
+    size_t topic_len = strlen(topic);
+    if (topic_len + length > MQTT_MAX_PACKET_SIZE) {
+        from.stats.dropped++;
+        return false;
+    }
+
+    mqtt_handoff_t *h = _workers[to_worker].inbox[from_worker].reserve();
+    if (h == NULL) {
+        from.stats.dropped++;
+        return false;
+    }
+
+    h->client = (uint32_t) client;
+    h->topic_len = (uint16_t) topic_len;
+    h->payload_len = (uint16_t) length;
+    memcpy(h->data, topic, topic_len + 1);
+    memcpy(h->data + topic_len + 1, payload, length);
+    _workers[to_worker].inbox[from_worker].commit();
+    from.stats.handed_off++;
+
+    uint64_t one = 1;
+    if (write(_workers[to_worker].wake_fd, &one, sizeof(one)) < 0) { }
+    return true;
+}
+
+#endif // MQTT_HOST_BUILD
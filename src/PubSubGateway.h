@@ -0,0 +1,156 @@
+/*
+ PubSubGateway.h - Run many PubSubClients across worker threads on a host.
+*/
+
+#ifndef PubSubGateway_h
+#define PubSubGateway_h
+
+#ifdef MQTT_HOST_BUILD
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "PubSubClient.h"
+
+// MQTT_HANDOFF_SLOTS : Capacity of each worker-to-worker publish queue
+#define MQTT_HANDOFF_SLOTS 256
+
+namespace MQTT {
+    // Bounded single-producer single-consumer ring
+    template<typename T, size_t N>
+    class SPSCQueue {
+    private:
+        T _slots[N];
+        std::atomic<size_t> _head;  // Next slot to read, owned by the consumer
+        char _pad[64];              // Keep the two indexes on separate cache lines
+        std::atomic<size_t> _tail;  // Next slot to write, owned by the producer
+
+    public:
+        SPSCQueue() : _head(0), _tail(0) { }
+
+        // Producer side: returns a slot to fill, or NULL when full
+        T *reserve(void) {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            if (tail - _head.load(std::memory_order_acquire) == N)
+                return NULL;
+            return &_slots[tail % N];
+        }
+
+        void commit(void) {
+            _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        // Consumer side: returns the oldest slot, or NULL when empty
+        T *front(void) {
+            size_t head = _head.load(std::memory_order_relaxed);
+            if (head == _tail.load(std::memory_order_acquire))
+                return NULL;
+            return &_slots[head % N];
+        }
+
+        void pop(void) {
+            _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+    };
+}
+
+// A publish handed from one worker to the worker that owns the target client
+struct mqtt_handoff_t {
+    uint32_t client;
+    uint16_t topic_len;
+    uint16_t payload_len;
+    uint8_t data[MQTT_MAX_PACKET_SIZE + 1];     // NUL-terminated topic, then the payload
+};
+
+class PubSubGateway {
+public:
+    // Called on a worker's thread once per pass of its event loop
+    // Return true while there is more to do, so the worker polls instead of sleeping
+    typedef bool(*tick_t)(PubSubGateway &gateway, size_t worker, void *data);
+
+    // Per-worker counters, only written by the worker that owns them
+    struct stats_t {
+        std::atomic<unsigned long> connected;
+        std::atomic<unsigned long> failed;
+        std::atomic<unsigned long> handed_off;
+        std::atomic<unsigned long> dropped;
+
+        stats_t() : connected(0), failed(0), handed_off(0), dropped(0) { }
+    };
+
+private:
+    typedef MQTT::SPSCQueue<mqtt_handoff_t, MQTT_HANDOFF_SLOTS> handoff_queue_t;
+
+    struct worker_t {
+        std::thread thread;
+        int epoll_fd;
+        int wake_fd;
+        std::vector<uint32_t> clients;      // Indexes into _clients owned by this worker
+        std::vector<uint32_t> interest;     // Events currently registered for each of them
+        std::vector<bool> pending;          // CONNECT sent, CONNACK not in yet
+        handoff_queue_t *inbox;             // One queue per source worker
+        stats_t stats;
+    };
+
+    size_t _num_workers;
+    worker_t *_workers;
+    std::vector<PubSubClient *> _clients;
+    std::vector<String> _ids;
+    tick_t _tick;
+    void *_tick_data;
+    std::atomic<bool> _running;
+
+    void run(size_t w);
+
+    void watch(worker_t &worker, size_t k, bool add);
+
+    // Start connecting a client, the CONNACK arrives through the worker's event loop
+    bool reconnect(worker_t &worker, size_t k);
+
+    // Take a client that has dropped out of the event loop
+    void dropped(worker_t &worker, size_t k);
+
+    void drain_inbox(worker_t &worker);
+
+public:
+    PubSubGateway(size_t workers = 0);
+
+    ~PubSubGateway();
+
+    // Add a client before start(), it is assigned to worker (index % workers)
+    // and connected with the given id from that worker's thread, and reconnected
+    // there whenever it drops (subject to its reconnect backoff). Connecting waits
+    // for neither the TCP handshake nor the CONNACK, so one slow server does not
+    // hold up the other clients
+    size_t add_client(PubSubClient &client, String id);
+
+    PubSubGateway &set_tick(tick_t tick, void *data = NULL);
+
+    // Server names are resolved here, once, not by the workers; false if one does not resolve
+    bool start(void);
+
+    void stop(void);
+
+    size_t workers(void) const { return _num_workers; }
+
+    size_t worker_of(size_t client) const { return client % _num_workers; }
+
+    PubSubClient &client(size_t index) { return *_clients[index]; }
+
+    // Clients owned by a worker, only to be touched from that worker's thread
+    size_t shard_size(size_t worker) const { return _workers[worker].clients.size(); }
+
+    PubSubClient &shard_client(size_t worker, size_t k) { return *_clients[_workers[worker].clients[k]]; }
+
+    const stats_t &stats(size_t worker) const { return _workers[worker].stats; }
+
+    // Publish on any client from a worker thread (e.g. inside a callback)
+    // Clients owned by another worker get the message through a hand-off queue
+    // Returns false if that queue is full or the message does not fit
+    // The topic must be NUL-terminated, nothing is copied onto the heap
+    bool publish(size_t from_worker, size_t client, const char *topic, const uint8_t *payload, size_t length);
+};
+
+#endif // MQTT_HOST_BUILD
+
+#endif
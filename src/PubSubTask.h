@@ -0,0 +1,164 @@
+/*
+ PubSubTask.h - C++20 coroutine support: awaitable client operations.
+*/
+
+#ifndef PubSubTask_h
+#define PubSubTask_h
+
+#include "MQTT.h"
+
+#ifdef MQTT_COROUTINES
+
+#include <coroutine>
+#include <utility>
+
+class PubSubClient;
+
+// Frames of coroutines whose first parameter (or object) is a PubSubClient come from its FramePool,
+// any others from the heap
+void *mqtt_frame_allocate(PubSubClient *client, size_t size);
+
+void mqtt_frame_release(void *frame, size_t size);
+
+namespace MQTT {
+    template<typename T>
+    class Task;
+
+    // Shared by Task<T> and Task<void>
+    class TaskPromiseBase {
+    public:
+        std::coroutine_handle<> continuation;
+        bool detached = false;
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+
+            template<typename P>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+                TaskPromiseBase &p = h.promise();
+                if (p.continuation)
+                    return p.continuation;
+                if (p.detached)
+                    h.destroy();
+                return std::noop_coroutine();
+            }
+
+            void await_resume() noexcept { }
+        };
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void unhandled_exception() { }
+
+        // NULL when out of memory, the coroutine then returns an empty Task
+        template<typename... Args>
+        static void *operator new(size_t size, PubSubClient &client, Args &&...) noexcept {
+            return mqtt_frame_allocate(&client, size);
+        }
+
+        static void *operator new(size_t size) noexcept {
+            return mqtt_frame_allocate(NULL, size);
+        }
+
+        static void operator delete(void *frame, size_t size) {
+            mqtt_frame_release(frame, size);
+        }
+    };
+
+    template<typename T>
+    class TaskPromise : public TaskPromiseBase {
+    public:
+        T value{};
+
+        Task<T> get_return_object();
+
+        static Task<T> get_return_object_on_allocation_failure();
+
+        void return_value(T v) { value = std::move(v); }
+
+        T result() { return std::move(value); }
+    };
+
+    template<>
+    class TaskPromise<void> : public TaskPromiseBase {
+    public:
+        Task<void> get_return_object();
+
+        static Task<void> get_return_object_on_allocation_failure();
+
+        void return_void() { }
+
+        void result() { }
+    };
+
+    // Lazily started coroutine, either co_await'ed by another one or start()ed as a detached job
+    // One whose frame could not be allocated is empty: it does nothing and co_await gives T()
+    template<typename T = void>
+    class Task {
+    public:
+        typedef TaskPromise<T> promise_type;
+
+    private:
+        std::coroutine_handle<promise_type> _handle;
+
+    public:
+        explicit Task(std::coroutine_handle<promise_type> h) : _handle(h) { }
+
+        Task(Task &&other) : _handle(std::exchange(other._handle, nullptr)) { }
+
+        Task(const Task &) = delete;
+
+        ~Task() {
+            if (_handle)
+                _handle.destroy();
+        }
+
+        bool empty() const { return !_handle; }
+
+        // Run until its first suspension and let it free itself when done
+        void start() {
+            std::coroutine_handle<promise_type> h = std::exchange(_handle, nullptr);
+            if (!h)
+                return;
+            h.promise().detached = true;
+            h.resume();
+        }
+
+        bool await_ready() const noexcept { return !_handle; }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            _handle.promise().continuation = awaiting;
+            return _handle;
+        }
+
+        T await_resume() {
+            if (!_handle)
+                return T();
+            return _handle.promise().result();
+        }
+    };
+
+    template<typename T>
+    Task<T> TaskPromise<T>::get_return_object() {
+        return Task<T>(std::coroutine_handle<TaskPromise<T> >::from_promise(*this));
+    }
+
+    inline Task<void> TaskPromise<void>::get_return_object() {
+        return Task<void>(std::coroutine_handle<TaskPromise<void> >::from_promise(*this));
+    }
+
+    template<typename T>
+    Task<T> TaskPromise<T>::get_return_object_on_allocation_failure() {
+        return Task<T>(std::coroutine_handle<TaskPromise<T> >());
+    }
+
+    inline Task<void> TaskPromise<void>::get_return_object_on_allocation_failure() {
+        return Task<void>(std::coroutine_handle<TaskPromise<void> >());
+    }
+}
+
+#endif // MQTT_COROUTINES
+
+#endif
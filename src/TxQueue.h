@@ -0,0 +1,94 @@
+/*
+ TxQueue.h - Lock-free queue of encoded packets, filled by any thread and drained by one.
+*/
+
+#ifndef TxQueue_h
+#define TxQueue_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+namespace MQTT {
+    // Bounded multi-producer single-consumer ring (Vyukov style)
+    // Each slot carries a sequence number: producers race for positions with a CAS on
+    // _tail and then fill their slot at leisure, the consumer only reads slots whose
+    // sequence says they have been committed. Nothing ever blocks or takes a lock
+    template<size_t SLOTS, size_t SIZE>
+    class TxQueue {
+    public:
+        struct slot_t {
+            std::atomic<size_t> seq;
+            size_t pos;
+            size_t len;
+            bool loopback;      // Hand it to loopback subscribers once it has gone out
+            uint8_t data[SIZE];
+        };
+
+    private:
+        static_assert((SLOTS & (SLOTS - 1)) == 0, "TxQueue size must be a power of two");
+
+        slot_t _slots[SLOTS];
+        std::atomic<size_t> _tail;  // Shared by the producers
+        char _pad[64];              // Keep it off the consumer's cache line
+        size_t _head;               // Consumer only
+
+    public:
+        TxQueue() : _tail(0), _head(0) {
+            for (size_t i = 0; i < SLOTS; i++)
+                _slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+
+        // Producer side: claim a slot to fill, NULL if the queue is full
+        slot_t *claim(void) {
+            size_t pos = _tail.load(std::memory_order_relaxed);
+            for (;;) {
+                slot_t *slot = &_slots[pos & (SLOTS - 1)];
+                intptr_t diff = (intptr_t) slot->seq.load(std::memory_order_acquire) - (intptr_t) pos;
+                if (diff == 0) {
+                    if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        slot->pos = pos;
+                        return slot;
+                    }
+                } else if (diff < 0) {
+                    return NULL;
+                } else {
+                    pos = _tail.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Producer side: hand a filled slot to the consumer
+        void commit(slot_t *slot) {
+            slot->seq.store(slot->pos + 1, std::memory_order_release);
+        }
+
+        // Consumer side: the oldest committed slot, NULL if there is none
+        slot_t *front(void) {
+            slot_t *slot = &_slots[_head & (SLOTS - 1)];
+            if (slot->seq.load(std::memory_order_acquire) != _head + 1)
+                return NULL;
+            return slot;
+        }
+
+        // Consumer side: release the slot returned by front()
+        void pop(void) {
+            _slots[_head & (SLOTS - 1)].seq.store(_head + SLOTS, std::memory_order_release);
+            _head++;
+        }
+
+        // Consumer side: the committed slot i places behind front(), NULL if there is none
+        slot_t *peek(size_t i) {
+            slot_t *slot = &_slots[(_head + i) & (SLOTS - 1)];
+            if (i >= SLOTS || slot->seq.load(std::memory_order_acquire) != _head + i + 1)
+                return NULL;
+            return slot;
+        }
+
+        bool empty(void) const {
+            return _slots[_head & (SLOTS - 1)].seq.load(std::memory_order_acquire) != _head + 1;
+        }
+    };
+}
+
+#endif
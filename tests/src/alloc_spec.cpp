@@ -0,0 +1,131 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+// Count every heap allocation (glibc only)
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+unsigned long allocations = 0;
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    allocations++;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+    allocations++;
+    return __libc_realloc(p, size);
+}
+}
+
+
+IPAddress server(172, 16, 0, 2);
+
+unsigned long received = 0;
+
+void callback(const MQTT::Publish &pub, void *) {
+    received++;
+}
+
+// Queue the server's side of one round: acks for the packet ids it uses and a publish
+void respond_round(ShimClient &shimClient, uint16_t pid) {
+    byte puback[] = { 0x40, 0x02, (byte) (pid >> 8), (byte) pid };
+    byte suback[] = { 0x90, 0x03, (byte) ((pid + 1) >> 8), (byte) (pid + 1), 0x00 };
+    byte unsuback[] = { 0xb0, 0x02, (byte) ((pid + 2) >> 8), (byte) (pid + 2) };
+    byte publish[] = { 0x30, 0x0e, 0x00, 0x05, 't', 'o', 'p', 'i', 'c', 'p', 'a', 'y', 'l', 'o', 'a', 'd' };
+    shimClient.respond(puback, sizeof(puback));
+    shimClient.respond(suback, sizeof(suback));
+    shimClient.respond(unsuback, sizeof(unsuback));
+    shimClient.respond(publish, sizeof(publish));
+}
+
+// Everything the client does in steady state, through the const char * API
+bool round(PubSubClient &client) {
+    static const uint8_t payload[] = "0123456789abcdef";
+
+    if (!client.publish("sensors/alloc/topic", payload, 16))
+        return false;
+    if (!client.publish(F("sensors/alloc/topic"), payload, 16))
+        return false;
+
+    MQTT::Publish pub(MQTT::TopicRef("sensors/alloc/topic"), (uint8_t *) payload, 16);
+    pub.set_qos(1, client.next_packet_id());
+    if (!client.publish(pub))
+        return false;
+
+    if (!client.subscribe("sensors/alloc/other") || !client.unsubscribe("sensors/alloc/other"))
+        return false;
+
+    return client.loop();
+}
+
+int test_steady_state() {
+    IT("publishes, receives and subscribes without allocating");
+    ShimClient shimClient;
+    WiFiClient::use(&shimClient);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883);
+    client.set_callback(callback);
+    IS_TRUE(client.connect("client_test1"));
+
+    uint16_t pid = 1;
+    unsigned long count = 0;
+    for (int i = 0; i < 100; i++, pid += 3) {
+        respond_round(shimClient, pid);
+
+        unsigned long before = allocations;
+        IS_TRUE(round(client));
+        // Anything allocated once happens in the first few rounds
+        if (i >= 10)
+            count += allocations - before;
+    }
+    IS_EQUAL(received, 100);
+    IS_EQUAL(count, 0);
+    IS_FALSE(shimClient.error());
+    END_IT
+}
+
+int test_publish_copies_topic() {
+    IT("copies a const char * topic into the publish");
+    char topic[16];
+    strcpy(topic, "first");
+    MQTT::Publish pub(topic, (uint8_t *) "payload", 7);
+    strcpy(topic, "later");
+    IS_TRUE(strcmp(pub.topic(), "first") == 0);
+    END_IT
+}
+
+int test_publish_references_topic() {
+    IT("references a TopicRef topic without allocating");
+    char topic[16];
+    strcpy(topic, "first");
+    unsigned long before = allocations;
+    MQTT::Publish pub(MQTT::TopicRef(topic), (uint8_t *) "payload", 7);
+    IS_EQUAL(allocations, before);
+    strcpy(topic, "later");
+    IS_TRUE(strcmp(pub.topic(), "later") == 0);
+    END_IT
+}
+
+
+int main()
+{
+    test_steady_state();
+    test_publish_copies_topic();
+    test_publish_references_topic();
+
+    FINISH
+}
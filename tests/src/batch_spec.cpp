@@ -0,0 +1,142 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+#include <string>
+#include <vector>
+
+
+IPAddress server(172, 16, 0, 2);
+
+void connect(PubSubClient &client, ShimClient &shimClient) {
+    WiFiClient::use(&shimClient);
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    client.connect("client_test1");
+}
+
+std::vector<std::string> seen;
+
+void record(const MQTT::Publish &pub, void *data) {
+    seen.push_back(std::string(pub.topic(), pub.topic_len()));
+}
+
+int test_partial_failure() {
+    IT("marks the one QoS 1 item that was never acknowledged and frees its packet id");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    client.set_max_retries(0);
+
+    mqtt_batch_item_t items[] = {
+        { "a", (const uint8_t *) "1", 1, 1 },
+        { "b", (const uint8_t *) "2", 1, 1 },
+        { "c", (const uint8_t *) "3", 1, 1 },
+    };
+    // Packet ids 2, 3 and 4, the PUBACK for 3 never comes
+    byte puback2[] = { 0x40, 0x02, 0x00, 0x02 };
+    byte puback4[] = { 0x40, 0x02, 0x00, 0x04 };
+    shimClient.respond(puback2, 4);
+    shimClient.respond(puback4, 4);
+
+    IS_EQUAL(client.publish_batch(items, 3), 2);
+    IS_TRUE(items[0].ok);
+    IS_FALSE(items[1].ok);
+    IS_TRUE(items[2].ok);
+    IS_EQUAL(items[1].packet_id, 3);
+    IS_TRUE(client.connected());
+    END_IT
+}
+
+int test_disconnected() {
+    IT("fails every item while disconnected");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    shimClient.setConnected(false);
+
+    mqtt_batch_item_t items[] = {
+        { "a", (const uint8_t *) "1", 1, 0 },
+        { "b", (const uint8_t *) "2", 1, 2 },
+    };
+    IS_EQUAL(client.publish_batch(items, 2), 0);
+    IS_FALSE(items[0].ok);
+    IS_FALSE(items[1].ok);
+    END_IT
+}
+
+int test_deadband() {
+    IT("drops repeats under set_deadband() at any QoS, also within one run");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    IS_TRUE(client.set_deadband("t", 0.5));
+
+    mqtt_batch_item_t items[] = {
+        { "t", (const uint8_t *) "20.0", 4, 0 },
+        { "t", (const uint8_t *) "20.2", 4, 0 },
+        { "u", (const uint8_t *) "x", 1, 0 },
+        { "t", (const uint8_t *) "21.0", 4, 0 },
+        { "t", (const uint8_t *) "21.1", 4, 2 },
+    };
+    byte publish0[] = { 0x30, 0x07, 0x00, 0x01, 't', '2', '0', '.', '0' };
+    byte publishu[] = { 0x30, 0x04, 0x00, 0x01, 'u', 'x' };
+    byte publish1[] = { 0x30, 0x07, 0x00, 0x01, 't', '2', '1', '.', '0' };
+    shimClient.expect(publish0, sizeof(publish0));
+    shimClient.expect(publishu, sizeof(publishu));
+    shimClient.expect(publish1, sizeof(publish1));
+
+    IS_EQUAL(client.publish_batch(items, 5), 5);
+    IS_FALSE(items[0].suppressed);
+    IS_TRUE(items[1].suppressed);
+    IS_FALSE(items[3].suppressed);
+    IS_TRUE(items[4].suppressed);
+    IS_EQUAL(client.suppressed(), 2);
+    IS_FALSE(shimClient.error());
+    END_IT
+}
+
+int test_loopback() {
+    IT("keeps local only items local and loops the rest back once written, in order");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    seen.clear();
+    IS_TRUE(client.subscribe_local("local/#", MQTT_LOCAL_ONLY, record));
+    IS_TRUE(client.subscribe_local("both/#", MQTT_LOCAL_AND_REMOTE, record));
+
+    mqtt_batch_item_t items[] = {
+        { "both/a", (const uint8_t *) "1", 1, 0 },
+        { "local/b", (const uint8_t *) "2", 1, 1 },
+        { "other", (const uint8_t *) "3", 1, 0 },
+        { "both/c", (const uint8_t *) "4", 1, 0 },
+    };
+    byte publisha[] = { 0x30, 0x09, 0x00, 0x06, 'b', 'o', 't', 'h', '/', 'a', '1' };
+    byte publisho[] = { 0x30, 0x08, 0x00, 0x05, 'o', 't', 'h', 'e', 'r', '3' };
+    byte publishc[] = { 0x30, 0x09, 0x00, 0x06, 'b', 'o', 't', 'h', '/', 'c', '4' };
+    shimClient.expect(publisha, sizeof(publisha));
+    shimClient.expect(publisho, sizeof(publisho));
+    shimClient.expect(publishc, sizeof(publishc));
+
+    IS_EQUAL(client.publish_batch(items, 4), 4);
+    IS_EQUAL(items[1].packet_id, 0);
+    IS_EQUAL(seen.size(), 3);
+    IS_TRUE(seen[0] == "both/a");
+    IS_TRUE(seen[1] == "local/b");
+    IS_TRUE(seen[2] == "both/c");
+    IS_FALSE(shimClient.error());
+    END_IT
+}
+
+
+int main()
+{
+    test_partial_failure();
+    test_disconnected();
+    test_deadband();
+    test_loopback();
+
+    FINISH
+}
@@ -0,0 +1,108 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+IPAddress server(172, 16, 0, 2);
+
+void connect(PubSubClient &client, ShimClient &shimClient) {
+    WiFiClient::use(&shimClient);
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    client.connect("client_test1");
+}
+
+// Whether publishing payload to topic wrote anything
+bool sent(PubSubClient &client, ShimClient &shimClient, const char *topic, const char *payload) {
+    size_t before = shimClient.received();
+    client.publish(topic, payload);
+    return shimClient.received() > before;
+}
+
+int test_numeric() {
+    IT("drops numbers within the deadband of the last one sent");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    IS_TRUE(client.set_deadband("s/t", 0.5));
+
+    IS_TRUE(sent(client, shimClient, "s/t", "21.0"));
+    IS_FALSE(sent(client, shimClient, "s/t", "21.3"));
+    IS_FALSE(sent(client, shimClient, "s/t", " 21.50 "));
+    IS_TRUE(sent(client, shimClient, "s/t", "21.6"));
+    IS_FALSE(sent(client, shimClient, "s/t", "2.16e1"));
+    IS_EQUAL(client.suppressed(), 3);
+    END_IT
+}
+
+int test_non_numeric() {
+    IT("compares payloads that only start like numbers byte for byte");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    IS_TRUE(client.set_deadband("s/t"));
+
+    IS_TRUE(sent(client, shimClient, "s/t", "2024-01-01"));
+    IS_TRUE(sent(client, shimClient, "s/t", "2024-02-01"));
+    IS_FALSE(sent(client, shimClient, "s/t", "2024-02-01"));
+    IS_TRUE(sent(client, shimClient, "s/t", "1.2.3"));
+    IS_TRUE(sent(client, shimClient, "s/t", "1.2.9"));
+    IS_TRUE(sent(client, shimClient, "s/t", "12abc"));
+    IS_TRUE(sent(client, shimClient, "s/t", "12abd"));
+    IS_TRUE(sent(client, shimClient, "s/t", "on"));
+    IS_FALSE(sent(client, shimClient, "s/t", "on"));
+    IS_EQUAL(client.suppressed(), 2);
+    END_IT
+}
+
+int test_topic_mismatch() {
+    IT("only filters the topics it was set for");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    IS_TRUE(client.set_deadband("s/t"));
+
+    IS_TRUE(sent(client, shimClient, "s/t", "1"));
+    IS_TRUE(sent(client, shimClient, "s/t2", "1"));
+    IS_TRUE(sent(client, shimClient, "s/t2", "1"));
+    IS_TRUE(sent(client, shimClient, "s", "1"));
+    IS_TRUE(sent(client, shimClient, "s", "1"));
+    IS_FALSE(sent(client, shimClient, "s/t", "1"));
+
+    // The topic is compared, so a copy in another buffer is the same topic
+    char topic[8];
+    strcpy(topic, "s/t");
+    IS_FALSE(sent(client, shimClient, topic, "1"));
+
+    client.unset_deadband("s/t");
+    IS_TRUE(sent(client, shimClient, "s/t", "1"));
+    IS_EQUAL(client.suppressed(), 2);
+    END_IT
+}
+
+int test_max_silence() {
+    IT("lets one through after max_silence_ms");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    IS_TRUE(client.set_deadband("s/t", 0, 50));
+
+    IS_TRUE(sent(client, shimClient, "s/t", "1"));
+    IS_FALSE(sent(client, shimClient, "s/t", "1"));
+    delay(60);
+    IS_TRUE(sent(client, shimClient, "s/t", "1"));
+    END_IT
+}
+
+
+int main()
+{
+    test_numeric();
+    test_non_numeric();
+    test_topic_mismatch();
+    test_max_silence();
+
+    FINISH
+}
@@ -0,0 +1,118 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+IPAddress server(172, 16, 0, 2);
+
+int callbacks;
+
+void callback(const MQTT::Publish &pub, void *data) {
+    callbacks++;
+}
+
+void connect(PubSubClient &client, ShimClient &shimClient) {
+    WiFiClient::use(&shimClient);
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    client.connect("client_test1");
+    client.set_callback(callback);
+    callbacks = 0;
+}
+
+// A QoS 1 publish of "payload" to "topic" with packet id pid
+void respond_publish(ShimClient &shimClient, uint16_t pid, bool dup) {
+    byte publish[] = { 0x32, 0x10, 0x00, 0x05, 't', 'o', 'p', 'i', 'c', (byte) (pid >> 8), (byte) pid,
+                       'p', 'a', 'y', 'l', 'o', 'a', 'd' };
+    if (dup)
+        publish[0] |= 0x08;
+    shimClient.respond(publish, sizeof(publish));
+}
+
+int test_redelivery() {
+    IT("acknowledges a redelivery of an id in the window without calling back");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+
+    byte puback[] = { 0x40, 0x02, 0x01, 0x02 };
+    shimClient.expect(puback, 4);
+    shimClient.expect(puback, 4);
+
+    respond_publish(shimClient, 0x0102, false);
+    IS_TRUE(client.loop());
+    respond_publish(shimClient, 0x0102, true);
+    IS_TRUE(client.loop());
+
+    IS_EQUAL(callbacks, 1);
+    IS_FALSE(shimClient.error());
+    END_IT
+}
+
+int test_reused_id() {
+    IT("delivers a new publish reusing an id in the window, as it has no DUP flag");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+
+    respond_publish(shimClient, 0x0102, false);
+    IS_TRUE(client.loop());
+    respond_publish(shimClient, 0x0102, false);
+    IS_TRUE(client.loop());
+
+    IS_EQUAL(callbacks, 2);
+    END_IT
+}
+
+int test_evicted() {
+    IT("delivers a redelivery once MQTT_QOS1_WINDOW newer ids have pushed it out");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+
+    // Ids 64 apart share a filter bit, so eviction has to keep it for the ones left
+    for (uint16_t pid = 1; pid <= MQTT_QOS1_WINDOW + 1; pid++) {
+        respond_publish(shimClient, pid * 64, false);
+        IS_TRUE(client.loop());
+    }
+    respond_publish(shimClient, 128, true);
+    IS_TRUE(client.loop());
+    respond_publish(shimClient, 64, true);
+    IS_TRUE(client.loop());
+
+    IS_EQUAL(callbacks, MQTT_QOS1_WINDOW + 2);
+    END_IT
+}
+
+int test_reconnect() {
+    IT("keeps the window across a reconnect, when servers redeliver");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+
+    respond_publish(shimClient, 0x0102, false);
+    IS_TRUE(client.loop());
+
+    shimClient.setConnected(false);
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    IS_TRUE(client.connect("client_test1"));
+    respond_publish(shimClient, 0x0102, true);
+    IS_TRUE(client.loop());
+
+    IS_EQUAL(callbacks, 1);
+    END_IT
+}
+
+
+int main()
+{
+    test_redelivery();
+    test_reused_id();
+    test_evicted();
+    test_reconnect();
+
+    FINISH
+}
@@ -0,0 +1,138 @@
+#include "JsonReader.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+#include <string>
+#include <vector>
+
+
+using MQTT::JsonReader;
+
+JsonReader reader(const char *json) {
+    return JsonReader((const uint8_t *) json, strlen(json));
+}
+
+// Everything a sketch might ask of a value, as text
+std::string describe(const JsonReader &v) {
+    char buf[16];
+    char out[96];
+    v.copy(buf, sizeof(buf));
+    snprintf(out, sizeof(out), "%d %lu %ld %d %s %lu", (int) v.type(), (unsigned long) v.size(),
+             v.to_long(-1), (int) v.to_bool(), buf, (unsigned long) v.raw_len());
+    return out;
+}
+
+std::string lookups(const JsonReader &doc) {
+    return describe(doc) + "|" + describe(doc.get("a")) + "|" + describe(doc.find("b.1"))
+           + "|" + describe(doc.find("c.d")) + "|" + describe(doc.get("e"));
+}
+
+int test_malformed() {
+    IT("gives JSON_NONE for malformed values rather than guessing");
+    IS_FALSE(reader("").exists());
+    IS_FALSE(reader("   ").exists());
+    IS_FALSE(reader("x").exists());
+    IS_FALSE(reader("{\"a\" 1}").get("a").exists());
+    IS_FALSE(reader("{a:1}").get("a").exists());
+    IS_FALSE(reader("{\"a\":}").get("a").exists());
+    IS_FALSE(reader("{\"a\":1 \"b\":2}").get("b").exists());
+    IS_FALSE(reader("[1 2]").at(1).exists());
+    IS_FALSE(reader("[1,2]").find("x").exists());
+    IS_FALSE(reader("5").get("a").exists());
+    END_IT
+}
+
+int test_accessors() {
+    IT("falls back to the defaults for missing or mistyped values");
+    JsonReader doc = reader("{\"s\":\"text\",\"n\":12}");
+    IS_EQUAL(doc.get("s").to_long(7), 7);
+    IS_EQUAL(doc.get("n").to_bool(true), true);
+    IS_EQUAL(doc.get("x").to_double(2.5), 2.5);
+    IS_FALSE(doc.get("n").equals("12"));
+    IS_EQUAL(doc.get("x").raw(), NULL);
+    IS_EQUAL(doc.get("x").raw_len(), 0);
+
+    char buf[4] = "abc";
+    IS_EQUAL(doc.get("n").copy(buf, sizeof(buf)), 0);
+    IS_EQUAL(buf[0], 0);
+    END_IT
+}
+
+int test_broken_strings() {
+    IT("stops at broken escapes and unterminated strings");
+    char buf[16];
+    IS_EQUAL(reader("\"ab\\u12\"").copy(buf, sizeof(buf)), 2);
+    IS_TRUE(strcmp(buf, "ab") == 0);
+    IS_FALSE(reader("\"ab\\u12\"").equals("ab"));
+    IS_FALSE(reader("\"abc").equals("abc"));
+    IS_EQUAL(reader("\"abc").raw_len(), 0);
+    IS_EQUAL(reader("\"abc\\").raw_len(), 0);
+    IS_FALSE(reader("{\"a\\\":1}").get("a").exists());
+    IS_TRUE(reader("\"caf\\u00e9\"").equals("caf\xc3\xa9"));
+    END_IT
+}
+
+int test_truncated() {
+    IT("reads nothing past the end of a truncated payload");
+    const char *json = "{\"a\":\"x\\\"y\",\"b\":[10,-2e1,{\"z\":[]}],\"c\":{\"d\":true},\"e\":null}";
+    size_t len = strlen(json);
+    bool same = true;
+    size_t full = 0;
+
+    // Whatever lies after the end must not change any answer
+    for (size_t n = 0; n <= len; n++) {
+        std::vector<uint8_t> first(json, json + n);
+        std::vector<uint8_t> second(json, json + n);
+        const char *after1 = "1]}\"\\,:";
+        const char *after2 = "x{[ ,\"2";
+        first.insert(first.end(), after1, after1 + strlen(after1));
+        second.insert(second.end(), after2, after2 + strlen(after2));
+
+        std::string one = lookups(JsonReader(&first[0], n));
+        std::string two = lookups(JsonReader(&second[0], n));
+        if (one != two) {
+            TRACE(n << ": " << one << " / " << two << "\n");
+            same = false;
+        }
+        if (n == len)
+            full = JsonReader(&first[0], n).size();
+    }
+    IS_TRUE(same);
+    IS_EQUAL(full, 4);
+    END_IT
+}
+
+int test_truncated_lookups() {
+    IT("finds earlier members of a payload cut short, and nothing of the cut one");
+    JsonReader doc = reader("{\"a\":1,\"b\":[1,2,3],\"c\":{\"d\":tr");
+    IS_EQUAL(doc.get("a").to_long(), 1);
+    IS_EQUAL(doc.find("b.2").to_long(), 3);
+    IS_EQUAL(doc.size(), 2);
+    IS_EQUAL(doc.get("c").raw_len(), 0);
+    IS_FALSE(doc.get("e").exists());
+    END_IT
+}
+
+int test_deep_nesting() {
+    IT("skips deeply nested and unbalanced values without running off");
+    std::string deep(2000, '[');
+    deep = "{\"x\":" + deep + ",\"a\":5}";
+    IS_FALSE(reader(deep.c_str()).get("a").exists());
+
+    std::string closed = "{\"x\":" + std::string(500, '[') + std::string(500, ']') + ",\"a\":5}";
+    IS_EQUAL(reader(closed.c_str()).get("a").to_long(), 5);
+    END_IT
+}
+
+
+int main()
+{
+    test_malformed();
+    test_accessors();
+    test_broken_strings();
+    test_truncated();
+    test_truncated_lookups();
+    test_deep_nesting();
+
+    FINISH
+}
@@ -0,0 +1,169 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+#include <vector>
+
+
+IPAddress server(172, 16, 0, 2);
+
+struct chunks_t {
+    size_t bytes;
+    uint32_t total;
+    uint32_t checksum;
+    bool in_order;
+};
+
+void chunk_callback(const MQTT::Publish &pub, const uint8_t *chunk, size_t length,
+                    uint32_t offset, uint32_t total, void *data) {
+    chunks_t *seen = (chunks_t *) data;
+    if (offset != seen->bytes) {
+        seen->in_order = false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        seen->checksum = seen->checksum * 31 + chunk[i];
+    }
+    seen->bytes += length;
+    seen->total = total;
+}
+
+// Fixed header for a publish with this much after it
+size_t publish_header(uint8_t *buf, uint8_t flags, uint32_t remaining) {
+    size_t len = 0;
+    buf[len++] = 0x30 | flags;
+    do {
+        uint8_t digit = remaining & 0x7f;
+        remaining >>= 7;
+        buf[len++] = remaining ? digit | 0x80 : digit;
+    } while (remaining);
+    return len;
+}
+
+std::vector<uint8_t> make_payload(size_t size) {
+    std::vector<uint8_t> payload(size);
+    for (size_t i = 0; i < size; i++) {
+        payload[i] = (uint8_t) (i * 7 + (i >> 12));
+    }
+    return payload;
+}
+
+uint32_t checksum(const std::vector<uint8_t> &payload) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < payload.size(); i++) {
+        sum = sum * 31 + payload[i];
+    }
+    return sum;
+}
+
+// Feed a publish to the client in pieces, as the network would, calling loop() after each
+bool receive_large(size_t size, uint8_t qos, size_t piece, chunks_t &seen, size_t &written) {
+    ShimClient shimClient;
+    WiFiClient::use(&shimClient);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883);
+    if (!client.connect("client_test1")) {
+        return false;
+    }
+    client.set_chunk_callback(chunk_callback, &seen);
+
+    std::vector<uint8_t> payload = make_payload(size);
+    uint8_t head[5 + 2 + 5 + 2];
+    uint32_t remaining = 2 + 5 + (qos ? 2 : 0) + size;
+    size_t len = publish_header(head, qos << 1, remaining);
+    head[len++] = 0;
+    head[len++] = 5;
+    memcpy(head + len, "topic", 5);
+    len += 5;
+    if (qos) {
+        head[len++] = 0x12;
+        head[len++] = 0x34;
+    }
+    shimClient.respond(head, len);
+
+    size_t before = shimClient.received();
+    for (size_t pos = 0; pos < size; pos += piece) {
+        shimClient.respond(&payload[pos], min(piece, size - pos));
+        client.loop();
+    }
+    client.loop();
+    written = shimClient.received() - before;
+
+    return seen.checksum == checksum(payload) && client.connected();
+}
+
+int test_receive_64k() {
+    IT("streams a 64 KB publish to the chunk callback");
+    chunks_t seen = { 0, 0, 0, true };
+    size_t written;
+    IS_TRUE(receive_large(64UL * 1024, 0, 1000, seen, written));
+    IS_TRUE(seen.in_order);
+    IS_EQUAL(seen.bytes, 64UL * 1024);
+    IS_EQUAL(seen.total, 64UL * 1024);
+    END_IT
+}
+
+int test_receive_1m() {
+    IT("streams a 1 MB publish to the chunk callback");
+    chunks_t seen = { 0, 0, 0, true };
+    size_t written;
+    IS_TRUE(receive_large(1UL << 20, 0, 4096, seen, written));
+    IS_TRUE(seen.in_order);
+    IS_EQUAL(seen.bytes, 1UL << 20);
+    IS_EQUAL(seen.total, 1UL << 20);
+    END_IT
+}
+
+int test_receive_16m_qos1() {
+    IT("streams a 16 MB QoS 1 publish and acknowledges it once");
+    chunks_t seen = { 0, 0, 0, true };
+    size_t written;
+    IS_TRUE(receive_large(16UL << 20, 1, 65536, seen, written));
+    IS_TRUE(seen.in_order);
+    IS_EQUAL(seen.bytes, 16UL << 20);
+    IS_EQUAL(seen.total, 16UL << 20);
+    IS_EQUAL(written, 4);
+    END_IT
+}
+
+int test_send_16m() {
+    IT("publishes a 16 MB payload with a four byte remaining length");
+    ShimClient shimClient;
+    WiFiClient::use(&shimClient);
+
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+
+    PubSubClient client(server, 1883);
+    IS_TRUE(client.connect("client_test1"));
+
+    std::vector<uint8_t> payload = make_payload(16UL << 20);
+    uint8_t head[5 + 2 + 5];
+    size_t len = publish_header(head, 0, 2 + 5 + payload.size());
+    IS_EQUAL(len, 5);
+    head[len++] = 0;
+    head[len++] = 5;
+    memcpy(head + len, "topic", 5);
+    len += 5;
+    shimClient.expect(head, len);
+    shimClient.expect(&payload[0], payload.size());
+
+    IS_TRUE(client.publish("topic", &payload[0], payload.size()));
+    IS_FALSE(shimClient.error());
+    END_IT
+}
+
+
+int main()
+{
+    test_receive_64k();
+    test_receive_1m();
+    test_receive_16m_qos1();
+    test_send_16m();
+
+    FINISH
+}
@@ -5,7 +5,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "WString.h"
 
 extern "C"{
     typedef uint8_t byte ;
@@ -14,10 +20,28 @@ extern "C"{
     /* sketch */
     extern void setup( void ) ;
     extern void loop( void ) ;
-    uint32_t millis( void );
 }
 
+unsigned long millis( void );
+unsigned long micros( void );
+void delay( unsigned long ms );
+void delayMicroseconds( unsigned int us );
+
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#endif
+#ifndef max
+#define max(a,b) ((a)>(b)?(a):(b))
+#endif
+
 #define PROGMEM
+#define PGM_P const char *
 #define pgm_read_byte_near(x) *(x)
+#define pgm_read_byte(x) (*(const uint8_t *)(x))
+#define memcpy_P memcpy
+#define strlen_P strlen
+
+class __FlashStringHelper;
+#define F(s) ((const __FlashStringHelper *)(s))
 
 #endif // Arduino_h
@@ -1,14 +1,18 @@
 #include "Buffer.h"
 #include "Arduino.h"
 
-Buffer::Buffer() {
+Buffer::Buffer() : pos(0) {
 }
 
-Buffer::Buffer(uint8_t* buf, size_t size) {
+Buffer::Buffer(uint8_t* buf, size_t size) : pos(0) {
     this->add(buf,size);
 }
 bool Buffer::available() {
-    return this->pos < this->length;
+    return this->pos < this->buffer.size();
+}
+
+size_t Buffer::remaining() {
+    return this->buffer.size() - this->pos;
 }
 
 uint8_t Buffer::next() {
@@ -18,13 +22,17 @@ uint8_t Buffer::next() {
     return 0;
 }
 
+int Buffer::peek() {
+    if (this->available()) {
+        return this->buffer[this->pos];
+    }
+    return -1;
+}
+
 void Buffer::reset() {
     this->pos = 0;
 }
 
-void Buffer::add(uint8_t* buf, size_t size) {
-    uint16_t i = 0;
-    for (;i<size;i++) {
-        this->buffer[this->length++] = buf[i];
-    }
+void Buffer::add(const uint8_t* buf, size_t size) {
+    this->buffer.insert(this->buffer.end(), buf, buf + size);
 }
@@ -2,22 +2,24 @@
 #define buffer_h
 
 #include "Arduino.h"
+#include <vector>
 
 class Buffer {
 private:
-    uint8_t buffer[1024];
-    uint16_t pos;
-    uint16_t length;
+    std::vector<uint8_t> buffer;
+    size_t pos;
     
 public:
     Buffer();
     Buffer(uint8_t* buf, size_t size);
     
     virtual bool available();
+    virtual size_t remaining();
     virtual uint8_t next();
+    virtual int peek();
     virtual void reset();
     
-    virtual void add(uint8_t* buf, size_t size);
+    virtual void add(const uint8_t* buf, size_t size);
 };
 
 #endif
@@ -1,8 +1,9 @@
 #ifndef client_h
 #define client_h
+#include "Stream.h"
 #include "IPAddress.h"
 
-class Client {
+class Client : public Stream {
 public:
   virtual int connect(IPAddress ip, uint16_t port) =0;
   virtual int connect(const char *host, uint16_t port) =0;
@@ -1,11 +1,20 @@
 #ifndef IPAddress_h
 #define IPAddress_h
 
-extern "C" {
+#include <stdint.h>
+#include <string.h>
 
-#define IPAddress uint8_t*  
+class IPAddress {
+private:
+    uint8_t _address[4];
 
-}
+public:
+    IPAddress() : _address{0, 0, 0, 0} {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _address{a, b, c, d} {}
+    IPAddress(const uint8_t *address) : _address{address[0], address[1], address[2], address[3]} {}
 
+    uint8_t operator[](int index) const { return _address[index]; }
+    bool operator==(const IPAddress &o) const { return memcmp(_address, o._address, 4) == 0; }
+};
 
 #endif
@@ -2,12 +2,25 @@
 #include "trace.h"
 #include <iostream>
 #include <Arduino.h>
-#include <ctime>
+#include <sys/time.h>
+#include <unistd.h>
 
-extern "C" {
-    uint32_t millis(void) {
-       return time(0)*1000;
-    }
+unsigned long millis(void) {
+    return micros() / 1000;
+}
+
+unsigned long micros(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
+void delay(unsigned long ms) {
+    usleep(ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+    usleep(us);
 }
 
 ShimClient::ShimClient() {
@@ -26,7 +39,7 @@ int ShimClient::connect(IPAddress ip, uint16_t port) {
         this->_connected = true;
     }
     if (this->_expectedPort !=0) {
-        if (memcmp(ip,this->_expectedIP,4) != 0) {
+        if (!(ip == this->_expectedIP)) {
             TRACE( "ip mismatch\n");
             this->_error = true;
         }
@@ -74,7 +87,7 @@ size_t ShimClient::write(uint8_t b)  {
 size_t ShimClient::write(const uint8_t *buf, size_t size)  {
     this->_received += size;
     TRACE( "[" << std::dec << (unsigned int)(size) << "] ");
-    uint16_t i=0;
+    size_t i=0;
     for (;i<size;i++) {
         if (i>0) {
             TRACE(":");
@@ -97,17 +110,17 @@ size_t ShimClient::write(const uint8_t *buf, size_t size)  {
     return size;
 }
 int ShimClient::available()  {
-    return this->responseBuffer->available();
+    return this->responseBuffer->remaining();
 }
-int ShimClient::read()  { return this->responseBuffer->next(); }
+int ShimClient::read()  { return this->responseBuffer->available() ? this->responseBuffer->next() : -1; }
 int ShimClient::read(uint8_t *buf, size_t size) { 
-    uint16_t i = 0;
-    for (;i<size;i++) {
-        buf[i] = this->read();
+    size_t i = 0;
+    for (;i<size && this->responseBuffer->available();i++) {
+        buf[i] = this->responseBuffer->next();
     }
-    return size;
+    return i;
 }
-int ShimClient::peek()  { return 0; }
+int ShimClient::peek()  { return this->responseBuffer->peek(); }
 void ShimClient::flush() {}
 void ShimClient::stop() {
     this->setConnected(false);
@@ -138,7 +151,7 @@ bool ShimClient::error() {
     return this->_error;
 }
 
-uint16_t ShimClient::received() {
+size_t ShimClient::received() {
     return this->_received;
 }
 
@@ -25,6 +25,13 @@ size_t Stream::write(uint8_t b)  {
     return 1;
 }
 
+size_t Stream::write(const uint8_t *buf, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        this->write(buf[i]);
+    }
+    return size;
+}
+
 
 bool Stream::error() {
     return this->_error;
@@ -34,6 +41,6 @@ void Stream::expect(uint8_t *buf, size_t size) {
     this->expectBuffer->add(buf,size);
 }
 
-uint16_t Stream::length() {
+size_t Stream::length() {
     return this->_written;
 }
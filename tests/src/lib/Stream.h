@@ -8,15 +8,21 @@ class Stream {
 private:
     Buffer* expectBuffer;
     bool _error;
-    uint16_t _written;
+    size_t _written;
 
 public:
     Stream();
+    virtual ~Stream() {}
     virtual size_t write(uint8_t);
-    
+    virtual size_t write(const uint8_t *buf, size_t size);
+    virtual int available() { return 0; }
+    virtual int read() { return -1; }
+    virtual int peek() { return -1; }
+    virtual void flush() {}
+
     virtual bool error();
-    virtual void expect(uint8_t *buf, size_t size);
-    virtual uint16_t length();
+    void expect(uint8_t *buf, size_t size);
+    virtual size_t length();
 };
 
 #endif
@@ -0,0 +1,28 @@
+#ifndef WString_h
+#define WString_h
+
+#include <string>
+#include <stdio.h>
+
+class String {
+private:
+    std::string s;
+
+public:
+    String() {}
+    String(const char *c) : s(c ? c : "") {}
+    String(double v, unsigned char decimals) { char b[40]; snprintf(b, sizeof b, "%.*f", decimals, v); s = b; }
+    explicit String(long v) : s(std::to_string(v)) {}
+
+    const char *c_str() const { return s.c_str(); }
+    unsigned int length() const { return s.size(); }
+    void reserve(unsigned int n) { s.reserve(n); }
+
+    String &operator+=(char c) { s += c; return *this; }
+    String &operator+=(const char *c) { s += c; return *this; }
+    String &operator+=(const String &o) { s += o.s; return *this; }
+    bool operator==(const char *c) const { return s == c; }
+    bool startsWith(const String &o) const { return s.compare(0, o.s.size(), o.s) == 0; }
+};
+
+#endif
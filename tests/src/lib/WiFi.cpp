@@ -0,0 +1,3 @@
+#include "WiFi.h"
+
+ShimClient* WiFiClient::shim = NULL;
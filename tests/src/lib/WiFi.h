@@ -0,0 +1,29 @@
+#ifndef WiFi_h
+#define WiFi_h
+
+#include "Client.h"
+#include "ShimClient.h"
+
+// PubSubClient makes its own WiFiClient; each one talks through the ShimClient set with use()
+class WiFiClient : public Client {
+private:
+    static ShimClient* shim;
+
+public:
+    static void use(ShimClient* client) { shim = client; }
+
+    virtual int connect(IPAddress ip, uint16_t port) { return shim->connect(ip, port); }
+    virtual int connect(const char *host, uint16_t port) { return shim->connect(host, port); }
+    virtual size_t write(uint8_t b) { return shim->write(b); }
+    virtual size_t write(const uint8_t *buf, size_t size) { return shim->write(buf, size); }
+    virtual int available() { return shim->available(); }
+    virtual int read() { return shim->read(); }
+    virtual int read(uint8_t *buf, size_t size) { return shim->read(buf, size); }
+    virtual int peek() { return shim->peek(); }
+    virtual void flush() { shim->flush(); }
+    virtual void stop() { shim->stop(); }
+    virtual uint8_t connected() { return shim->connected(); }
+    virtual operator bool() { return true; }
+};
+
+#endif
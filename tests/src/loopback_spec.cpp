@@ -0,0 +1,154 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+#include <string>
+#include <vector>
+
+
+IPAddress server(172, 16, 0, 2);
+
+void connect(PubSubClient &client, ShimClient &shimClient) {
+    WiFiClient::use(&shimClient);
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    client.connect("client_test1");
+}
+
+std::vector<std::string> seen;
+
+void record(const MQTT::Publish &pub, void *data) {
+    seen.push_back(std::string(pub.payload_string(), pub.payload_len()));
+}
+
+int test_local_only() {
+    IT("delivers local only topics without writing anything, also while disconnected");
+    ShimClient shimClient;
+    WiFiClient::use(&shimClient);
+    PubSubClient client(server, 1883);
+    seen.clear();
+    IS_TRUE(client.subscribe_local("home/+/t", MQTT_LOCAL_ONLY, record));
+
+    IS_TRUE(client.publish("home/kitchen/t", "21"));
+    IS_EQUAL(seen.size(), 1);
+    IS_EQUAL(shimClient.received(), 0);
+    END_IT
+}
+
+int test_after_send() {
+    IT("delivers local and remote topics only once they have been written");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    seen.clear();
+    IS_TRUE(client.subscribe_local("home/status", MQTT_LOCAL_AND_REMOTE, record));
+
+    size_t before = shimClient.received();
+    IS_TRUE(client.publish("home/status", "on"));
+    IS_EQUAL(seen.size(), 1);
+    IS_TRUE(shimClient.received() > before);
+
+    shimClient.setConnected(false);
+    IS_FALSE(client.publish("home/status", "off"));
+    IS_EQUAL(seen.size(), 1);
+    END_IT
+}
+
+int test_suppressed() {
+    IT("does not deliver what the deadband filter dropped");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    seen.clear();
+    IS_TRUE(client.subscribe_local("home/status", MQTT_LOCAL_AND_REMOTE, record));
+    IS_TRUE(client.set_deadband("home/status"));
+
+    IS_TRUE(client.publish("home/status", "on"));
+    IS_TRUE(client.publish("home/status", "on"));
+    IS_EQUAL(client.suppressed(), 1);
+    IS_EQUAL(seen.size(), 1);
+    END_IT
+}
+
+PubSubClient *republisher;
+
+void republish(const MQTT::Publish &pub, void *data) {
+    record(pub, data);
+    republisher->publish("home/echo", "x");
+}
+
+int test_pinned() {
+    IT("hands a payload written in place to every subscriber, even if the first publishes");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    republisher = &client;
+    seen.clear();
+    IS_TRUE(client.subscribe_local("home/status", MQTT_LOCAL_AND_REMOTE, republish));
+    IS_TRUE(client.subscribe_local("home/#", MQTT_LOCAL_AND_REMOTE, record));
+
+    MQTT::Publish pub(MQTT::TopicRef("home/status"), (uint8_t *) NULL, 0);
+    MQTT::PayloadWriter payload = client.begin_publish(pub);
+    payload.add("written in place");
+    IS_TRUE(client.end_publish(pub, payload));
+
+    // The republished "x" reaches the second subscriber first, nested in the first
+    IS_EQUAL(seen.size(), 3);
+    IS_TRUE(seen[0] == "written in place");
+    IS_TRUE(seen[1] == "x");
+    IS_TRUE(seen[2] == "written in place");
+    END_IT
+}
+
+int test_depth() {
+    IT("stops looping back publishes from callbacks MQTT_LOCAL_DEPTH deep");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    republisher = &client;
+    seen.clear();
+    IS_TRUE(client.subscribe_local("home/echo", MQTT_LOCAL_AND_REMOTE, republish));
+
+    IS_TRUE(client.publish("home/echo", "x"));
+    IS_EQUAL(seen.size(), MQTT_LOCAL_DEPTH);
+    END_IT
+}
+
+#ifdef MQTT_TX_QUEUE
+int test_queued() {
+    IT("delivers a publish held back by the rate limit when the queue sends it");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    seen.clear();
+    IS_TRUE(client.subscribe_local("home/status", MQTT_LOCAL_AND_REMOTE, record));
+    client.set_rate_limit(20, 1);
+
+    IS_TRUE(client.publish("home/status", "on"));
+    IS_TRUE(client.publish("home/status", "off"));
+    IS_EQUAL(seen.size(), 1);
+
+    delay(60);
+    IS_TRUE(client.loop());
+    IS_EQUAL(seen.size(), 2);
+    IS_TRUE(seen[1] == "off");
+    END_IT
+}
+#endif
+
+
+int main()
+{
+    test_local_only();
+    test_after_send();
+    test_suppressed();
+    test_pinned();
+    test_depth();
+#ifdef MQTT_TX_QUEUE
+    test_queued();
+#endif
+
+    FINISH
+}
@@ -0,0 +1,224 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+#include <vector>
+
+
+IPAddress server(172, 16, 0, 2);
+
+typedef std::vector<uint8_t> bytes_t;
+
+bytes_t compress(const bytes_t &data) {
+    MQTT::LZEncoder enc(data.empty() ? NULL : &data[0], data.size());
+    bytes_t out(enc.length());
+    size_t n = 0;
+    // Read back in odd-sized pieces, as the client does a buffer-full at a time
+    while (n < out.size()) {
+        size_t got = enc.read(&out[n], min((size_t) 7, out.size() - n));
+        if (got == 0)
+            break;
+        n += got;
+    }
+    out.resize(n);
+    return out;
+}
+
+void append(const uint8_t *data, size_t len, void *arg) {
+    bytes_t *out = (bytes_t *) arg;
+    out->insert(out->end(), data, data + len);
+}
+
+// Decode feeding piece bytes at a time
+bool decompress(const bytes_t &in, size_t piece, bytes_t &out, MQTT::LZDecoder &dec) {
+    out.clear();
+    for (size_t pos = 0; pos < in.size(); pos += piece) {
+        if (!dec.write(&in[pos], min(piece, in.size() - pos), append, &out))
+            return false;
+    }
+    return dec.done();
+}
+
+bytes_t text(size_t size) {
+    const char *words = "the quick brown fox jumps over the lazy dog, ";
+    bytes_t data(size);
+    for (size_t i = 0; i < size; i++)
+        data[i] = (uint8_t) words[i % strlen(words)];
+    return data;
+}
+
+bytes_t noise(size_t size) {
+    bytes_t data(size);
+    uint32_t x = 12345;
+    for (size_t i = 0; i < size; i++) {
+        x = x * 1103515245 + 12345;
+        data[i] = (uint8_t) (x >> 16);
+    }
+    return data;
+}
+
+int test_round_trip() {
+    IT("round trips empty, tiny, repetitive, noisy and larger-than-window payloads");
+    std::vector<bytes_t> inputs;
+    inputs.push_back(bytes_t());
+    inputs.push_back(bytes_t(1, 'a'));
+    inputs.push_back(bytes_t(3, 'a'));
+    inputs.push_back(bytes_t(5000, 0));
+    inputs.push_back(text(10000));
+    inputs.push_back(noise(3000));
+
+    bool ok = true;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        bytes_t packed = compress(inputs[i]);
+        size_t pieces[] = { 1, 3, packed.size() ? packed.size() : 1 };
+        for (size_t p = 0; p < 3; p++) {
+            MQTT::LZDecoder dec;
+            bytes_t out;
+            if (!decompress(packed, pieces[p], out, dec) || out != inputs[i]) {
+                TRACE("input " << i << " piece " << pieces[p] << "\n");
+                ok = false;
+            }
+        }
+    }
+    IS_TRUE(ok);
+    END_IT
+}
+
+int test_ratio() {
+    IT("compresses repetitive text and stores noise with only its header added");
+    bytes_t t = text(4000);
+    IS_TRUE(compress(t).size() < t.size() / 4);
+
+    bytes_t n = noise(1000);
+    MQTT::LZEncoder enc(&n[0], n.size());
+    IS_TRUE(enc.stored());
+    IS_EQUAL(enc.length(), n.size() + 3);
+    END_IT
+}
+
+int test_corrupt() {
+    IT("reports corrupt streams: bad header, too large a window, references out of range");
+    uint8_t out[64];
+    MQTT::LZDecoder dec;
+
+    uint8_t magic[] = { 0x50, 0x01, 'a' };
+    IS_EQUAL(dec.decode(magic, sizeof(magic), out, sizeof(out)), 0);
+    IS_TRUE(dec.error());
+
+    uint8_t window[] = { MQTT_LZ_MAGIC | (MQTT_LZ_WINDOW_BITS + 1), 0x01, 0x00, 'a' };
+    IS_EQUAL(dec.decode(window, sizeof(window), out, sizeof(out)), 0);
+    IS_TRUE(dec.error());
+
+    // A back-reference before anything was written
+    uint8_t before[] = { MQTT_LZ_MAGIC | MQTT_LZ_WINDOW_BITS, 0x05, 0x01, 0x00, 0x00 };
+    IS_EQUAL(dec.decode(before, sizeof(before), out, sizeof(out)), 0);
+    IS_TRUE(dec.error());
+
+    // A match running past the length in the header
+    uint8_t past[] = { MQTT_LZ_MAGIC | MQTT_LZ_WINDOW_BITS, 0x04, 0x02, 'a', 0x00, 0x0f };
+    IS_EQUAL(dec.decode(past, sizeof(past), out, sizeof(out)), 0);
+    IS_TRUE(dec.error());
+
+    // A length varint that never ends
+    uint8_t length[] = { MQTT_LZ_MAGIC, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01 };
+    IS_EQUAL(dec.decode(length, sizeof(length), out, sizeof(out)), 0);
+    IS_TRUE(dec.error());
+
+    uint8_t empty[] = { MQTT_LZ_MAGIC | MQTT_LZ_WINDOW_BITS, 0x00 };
+    IS_EQUAL(dec.decode(empty, sizeof(empty), out, sizeof(out)), 0);
+    IS_FALSE(dec.error());
+    END_IT
+}
+
+int test_cut_short() {
+    IT("treats a stream cut short or too large for the buffer as an error");
+    bytes_t t = text(200);
+    bytes_t packed = compress(t);
+    uint8_t out[256];
+    MQTT::LZDecoder dec;
+
+    IS_EQUAL(dec.decode(&packed[0], packed.size(), out, sizeof(out)), t.size());
+    IS_EQUAL(dec.decode(&packed[0], packed.size() - 1, out, sizeof(out)), 0);
+    IS_TRUE(dec.error());
+    IS_EQUAL(dec.decode(&packed[0], packed.size(), out, 100), 0);
+    IS_TRUE(dec.error());
+    END_IT
+}
+
+bytes_t received;
+int null_chunks;
+
+void chunk_callback(const MQTT::Publish &pub, const uint8_t *chunk, size_t length,
+                    uint32_t offset, uint32_t total, void *data) {
+    if (chunk == NULL) {
+        null_chunks++;
+        return;
+    }
+    if (offset == received.size())
+        received.insert(received.end(), chunk, chunk + length);
+}
+
+// Respond with a QoS 0 publish of payload to "t/lz"
+void respond_lz(ShimClient &shimClient, const bytes_t &payload) {
+    bytes_t packet;
+    uint32_t remaining = 2 + 4 + payload.size();
+    packet.push_back(0x30);
+    do {
+        uint8_t digit = remaining & 0x7f;
+        remaining >>= 7;
+        packet.push_back(remaining ? digit | 0x80 : digit);
+    } while (remaining);
+    const uint8_t topic[] = { 0x00, 0x04, 't', '/', 'l', 'z' };
+    packet.insert(packet.end(), topic, topic + sizeof(topic));
+    packet.insert(packet.end(), payload.begin(), payload.end());
+    shimClient.respond(&packet[0], packet.size());
+}
+
+int test_client() {
+    IT("decompresses publishes on their way to the chunk callback, reporting corrupt ones");
+    ShimClient shimClient;
+    WiFiClient::use(&shimClient);
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    PubSubClient client(server, 1883);
+    IS_TRUE(client.connect("client_test1"));
+    client.set_chunk_callback(chunk_callback);
+
+    // One that fits in a packet, and one that is streamed in through the packet buffer
+    bytes_t small = text(300);
+    bytes_t large = noise(MQTT_MAX_PACKET_SIZE * 3);
+    received.clear();
+    null_chunks = 0;
+    respond_lz(shimClient, compress(small));
+    while (client.loop(0) > 0) { }
+    IS_TRUE(received == small);
+
+    received.clear();
+    respond_lz(shimClient, compress(large));
+    while (client.loop(0) > 0) { }
+    IS_TRUE(received == large);
+
+    bytes_t cut = compress(small);
+    cut.resize(cut.size() / 2);
+    received.clear();
+    respond_lz(shimClient, cut);
+    while (client.loop(0) > 0) { }
+    IS_EQUAL(null_chunks, 1);
+    IS_EQUAL(client.lz_errors(), 1);
+    IS_TRUE(client.connected());
+    END_IT
+}
+
+
+int main()
+{
+    test_round_trip();
+    test_ratio();
+    test_corrupt();
+    test_cut_short();
+    test_client();
+
+    FINISH
+}
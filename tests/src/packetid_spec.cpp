@@ -0,0 +1,144 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+IPAddress server(172, 16, 0, 2);
+
+void connect(PubSubClient &client, ShimClient &shimClient) {
+    WiFiClient::use(&shimClient);
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    client.connect("client_test1");
+}
+
+int test_in_sequence() {
+    IT("hands out ids in sequence while their slots are free");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+
+    uint16_t first = client.next_packet_id();
+    IS_TRUE(first != 0);
+    IS_EQUAL(client.next_packet_id(), first + 1);
+    IS_EQUAL(client.next_packet_id(), first + 2);
+    END_IT
+}
+
+int test_full() {
+    IT("returns 0 with MQTT_MAX_INFLIGHT outstanding, and reuses a released slot");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+
+    uint16_t ids[MQTT_MAX_INFLIGHT];
+    for (int i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+        ids[i] = client.next_packet_id();
+        IS_TRUE(ids[i] != 0);
+    }
+    IS_EQUAL(client.next_packet_id(), 0);
+
+    // The sweep skips every slot still taken to find the one freed in the middle
+    client.release_packet_id(ids[5]);
+    uint16_t pid = client.next_packet_id();
+    IS_TRUE(pid != 0 && pid != ids[5]);
+    IS_EQUAL((pid & (MQTT_MAX_INFLIGHT - 1)), (ids[5] & (MQTT_MAX_INFLIGHT - 1)));
+    IS_EQUAL(client.next_packet_id(), 0);
+    END_IT
+}
+
+int test_collision() {
+    IT("skips an id whose slot is held by an older one still outstanding");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+
+    uint16_t held = client.next_packet_id();
+    for (int i = 1; i < MQTT_MAX_INFLIGHT; i++)
+        client.release_packet_id(client.next_packet_id());
+
+    // held + MQTT_MAX_INFLIGHT would share its slot
+    IS_EQUAL(client.next_packet_id(), held + MQTT_MAX_INFLIGHT + 1);
+    END_IT
+}
+
+int test_late_release() {
+    IT("ignores a late release of an old id once a newer one shares its slot");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+
+    uint16_t old = client.next_packet_id();
+    client.release_packet_id(old);
+    uint16_t pid = 0;
+    for (int i = 0; i < MQTT_MAX_INFLIGHT; i++) {
+        pid = client.next_packet_id();
+        if (i < MQTT_MAX_INFLIGHT - 1)
+            client.release_packet_id(pid);
+    }
+    IS_EQUAL(pid, old + MQTT_MAX_INFLIGHT);
+
+    // pid keeps its slot, so the others fill up the rest
+    client.release_packet_id(old);
+    for (int i = 1; i < MQTT_MAX_INFLIGHT; i++)
+        IS_TRUE(client.next_packet_id() != 0);
+    IS_EQUAL(client.next_packet_id(), 0);
+    END_IT
+}
+
+int test_puback_frees() {
+    IT("frees an id when the PUBACK completing its exchange arrives");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+
+    uint16_t pid = client.next_packet_id();
+    for (int i = 1; i < MQTT_MAX_INFLIGHT; i++)
+        client.next_packet_id();
+    IS_EQUAL(client.next_packet_id(), 0);
+
+    byte puback[] = { 0x40, 0x02, (byte) (pid >> 8), (byte) pid };
+    shimClient.respond(puback, 4);
+    IS_TRUE(client.loop());
+    uint16_t next = client.next_packet_id();
+    IS_TRUE(next != 0);
+    IS_EQUAL((next & (MQTT_MAX_INFLIGHT - 1)), (pid & (MQTT_MAX_INFLIGHT - 1)));
+    END_IT
+}
+
+int test_wrap() {
+    IT("wraps from 65535 to 1, never handing out 0");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+
+    bool zero = false;
+    bool wrapped = false;
+    uint16_t last = client.next_packet_id();
+    client.release_packet_id(last);
+    for (long i = 0; i < 65536L; i++) {
+        uint16_t pid = client.next_packet_id();
+        zero |= pid == 0;
+        wrapped |= last == 65535 && pid == 1;
+        client.release_packet_id(pid);
+        last = pid;
+    }
+    IS_FALSE(zero);
+    IS_TRUE(wrapped);
+    END_IT
+}
+
+
+int main()
+{
+    test_in_sequence();
+    test_full();
+    test_collision();
+    test_late_release();
+    test_puback_frees();
+    test_wrap();
+
+    FINISH
+}
@@ -0,0 +1,146 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+#include <string>
+
+
+IPAddress server(172, 16, 0, 2);
+
+// Room for size bytes, with guard bytes after it that must never change
+struct guarded_t {
+    uint8_t buf[64];
+
+    guarded_t() { memset(buf, '#', sizeof(buf)); }
+
+    bool intact(size_t size) const {
+        for (size_t i = size; i < sizeof(buf); i++)
+            if (buf[i] != '#')
+                return false;
+        return true;
+    }
+};
+
+std::string text(const MQTT::PayloadWriter &w) {
+    return std::string((const char *) w.data(), w.length());
+}
+
+int test_exact_fit() {
+    IT("fills the buffer exactly without overflowing");
+    guarded_t g;
+    MQTT::PayloadWriter w(g.buf, 4);
+    w.add("ab").add(42);
+    IS_FALSE(w.overflow());
+    IS_TRUE(text(w) == "ab42");
+    IS_TRUE(g.intact(4));
+    END_IT
+}
+
+int test_no_partial_writes() {
+    IT("drops a piece that does not fit whole, and everything after it");
+    guarded_t g;
+    MQTT::PayloadWriter w(g.buf, 6);
+    w.add("abc").add(12345UL);
+    IS_TRUE(w.overflow());
+    IS_TRUE(text(w) == "abc");
+
+    // Sticky, so checking once at the end is enough
+    w.add("d");
+    IS_TRUE(text(w) == "abc");
+    IS_TRUE(g.intact(6));
+    END_IT
+}
+
+int test_escape() {
+    IT("overflows on an escape that does not fit, leaving the string cut at a character");
+    guarded_t g;
+    MQTT::PayloadWriter w(g.buf, 8);
+    w.value("ab\x01");
+    IS_TRUE(w.overflow());
+    IS_TRUE(text(w) == "\"ab");
+    IS_TRUE(g.intact(8));
+    END_IT
+}
+
+int test_numbers() {
+    IT("overflows on doubles beyond 4294967295 and writes NaN as text or null");
+    guarded_t g;
+    MQTT::PayloadWriter w(g.buf, 32);
+    w.add(1e10);
+    IS_TRUE(w.overflow());
+
+    w.clear();
+    w.add(-2.25, 1).add(' ').add(NAN).add(' ').add_fixed(-105, 2);
+    IS_FALSE(w.overflow());
+    IS_TRUE(text(w) == "-2.3 nan -1.05");
+
+    w.clear();
+    w.begin_array().value(NAN).value(1.5, 1).end_array();
+    IS_TRUE(text(w) == "[null,1.5]");
+    END_IT
+}
+
+int test_nesting() {
+    IT("overflows past 32 levels of nesting");
+    guarded_t g;
+    MQTT::PayloadWriter w(g.buf, 64);
+    for (int i = 0; i < 32; i++)
+        w.begin_array();
+    IS_FALSE(w.overflow());
+    w.begin_array();
+    IS_TRUE(w.overflow());
+    IS_TRUE(g.intact(64));
+    END_IT
+}
+
+int test_clear() {
+    IT("starts over after clear(), with no comma left over from before");
+    guarded_t g;
+    MQTT::PayloadWriter w(g.buf, 24);
+    w.begin_object().key("a").value(1).key("a much longer key").value("x");
+    IS_TRUE(w.overflow());
+
+    w.clear();
+    w.begin_object().key("a").value(true).key("b").null().end_object();
+    IS_FALSE(w.overflow());
+    IS_TRUE(text(w) == "{\"a\":true,\"b\":null}");
+    IS_TRUE(g.intact(24));
+    END_IT
+}
+
+int test_end_publish() {
+    IT("does not publish a payload that overflowed the packet buffer");
+    ShimClient shimClient;
+    WiFiClient::use(&shimClient);
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    PubSubClient client(server, 1883);
+    IS_TRUE(client.connect("client_test1"));
+
+    MQTT::Publish pub(MQTT::TopicRef("topic"), (uint8_t *) NULL, 0);
+    MQTT::PayloadWriter payload = client.begin_publish(pub);
+    size_t before = shimClient.received();
+    for (int i = 0; i < MQTT_MAX_PACKET_SIZE; i++)
+        payload.add('x');
+    IS_TRUE(payload.overflow());
+    IS_FALSE(client.end_publish(pub, payload));
+    IS_EQUAL(shimClient.received(), before);
+    IS_TRUE(client.connected());
+    END_IT
+}
+
+
+int main()
+{
+    test_exact_fit();
+    test_no_partial_writes();
+    test_escape();
+    test_numbers();
+    test_nesting();
+    test_clear();
+    test_end_publish();
+
+    FINISH
+}
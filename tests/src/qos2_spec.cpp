@@ -0,0 +1,106 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+IPAddress server(172, 16, 0, 2);
+
+int callbacks;
+
+void callback(const MQTT::Publish &pub, void *data) {
+    callbacks++;
+}
+
+void connect(PubSubClient &client, ShimClient &shimClient) {
+    WiFiClient::use(&shimClient);
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    client.connect("client_test1");
+    client.set_callback(callback);
+    callbacks = 0;
+}
+
+// A QoS 2 publish of "payload" to "topic" with packet id 0x0102
+void respond_publish(ShimClient &shimClient, bool dup) {
+    byte publish[] = { 0x34, 0x10, 0x00, 0x05, 't', 'o', 'p', 'i', 'c', 0x01, 0x02,
+                       'p', 'a', 'y', 'l', 'o', 'a', 'd' };
+    if (dup)
+        publish[0] |= 0x08;
+    shimClient.respond(publish, sizeof(publish));
+}
+
+void respond_pubrel(ShimClient &shimClient) {
+    byte pubrel[] = { 0x62, 0x02, 0x01, 0x02 };
+    shimClient.respond(pubrel, sizeof(pubrel));
+}
+
+int test_resend_after_delivery() {
+    IT("delivers a publish resent before its PUBREL once, acknowledging both");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+
+    byte pubrec[] = { 0x50, 0x02, 0x01, 0x02 };
+    byte pubcomp[] = { 0x70, 0x02, 0x01, 0x02 };
+    shimClient.expect(pubrec, 4);
+    shimClient.expect(pubrec, 4);
+    shimClient.expect(pubcomp, 4);
+
+    respond_publish(shimClient, false);
+    IS_TRUE(client.loop());
+    respond_publish(shimClient, true);
+    IS_TRUE(client.loop());
+    respond_pubrel(shimClient);
+    IS_TRUE(client.loop());
+
+    IS_EQUAL(callbacks, 1);
+    IS_FALSE(shimClient.error());
+    END_IT
+}
+
+int test_resend_queued_with_pubrel() {
+    IT("does not deliver a resend still queued when its PUBREL arrives");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+
+    // All read in one loop(): the PUBREL is handled as it is read, ahead of the queued publishes
+    size_t before = shimClient.received();
+    respond_publish(shimClient, false);
+    respond_publish(shimClient, true);
+    respond_pubrel(shimClient);
+    IS_TRUE(client.loop());
+    IS_TRUE(client.loop());
+
+    IS_EQUAL(callbacks, 1);
+    IS_EQUAL(shimClient.received() - before, 12);
+    END_IT
+}
+
+int test_id_reused_after_pubrel() {
+    IT("delivers a new publish reusing an id whose PUBREL has been seen");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+
+    respond_publish(shimClient, false);
+    respond_pubrel(shimClient);
+    IS_TRUE(client.loop());
+    respond_publish(shimClient, false);
+    IS_TRUE(client.loop());
+
+    IS_EQUAL(callbacks, 2);
+    END_IT
+}
+
+
+int main()
+{
+    test_resend_after_delivery();
+    test_resend_queued_with_pubrel();
+    test_id_reused_after_pubrel();
+
+    FINISH
+}
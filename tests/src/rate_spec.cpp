@@ -0,0 +1,173 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+
+IPAddress server(172, 16, 0, 2);
+
+void connect(PubSubClient &client, ShimClient &shimClient) {
+    WiFiClient::use(&shimClient);
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    client.connect("client_test1");
+}
+
+// Publishes let through in duration ms, asking every millisecond of a mock clock starting at start
+int bucket_sends(uint32_t rate, uint32_t burst, unsigned long start, unsigned long duration) {
+    mqtt_bucket_t b;
+    b.set(rate, burst, start);
+    int sent = 0;
+    for (unsigned long t = 0; t <= duration; t++) {
+        while (b.wait(start + t) == 0) {
+            b.take();
+            sent++;
+        }
+    }
+    return sent;
+}
+
+int test_steady_rate() {
+    IT("lets exactly rate a second through on a mock clock, fractions carried over");
+    IS_EQUAL(bucket_sends(10, 1, 0, 10000), 101);
+    IS_EQUAL(bucket_sends(3, 1, 0, 10000), 31);
+    IS_EQUAL(bucket_sends(7, 1, 0, 1000), 8);
+    IS_EQUAL(bucket_sends(1000, 1, 0, 1000), 1001);
+    END_IT
+}
+
+int test_burst() {
+    IT("lets a burst through at once, then refills no further than the burst");
+    IS_EQUAL(bucket_sends(10, 5, 0, 0), 5);
+    IS_EQUAL(bucket_sends(10, 5, 0, 1000), 15);
+
+    mqtt_bucket_t b;
+    b.set(10, 5, 0);
+    for (int i = 0; i < 5; i++)
+        b.take();
+    IS_EQUAL(b.wait(0), 100);
+    IS_EQUAL(b.wait(60), 40);
+
+    // An hour idle is worth no more than the burst
+    IS_EQUAL(b.wait(3600000UL), 0);
+    for (int i = 0; i < 5; i++)
+        b.take();
+    IS_EQUAL(b.wait(3600000UL), 100);
+    END_IT
+}
+
+int test_clock_wrap() {
+    IT("keeps the rate across millis() wrapping around");
+    IS_EQUAL(bucket_sends(10, 1, (unsigned long) -5000, 10000), 101);
+    END_IT
+}
+
+int test_blocking() {
+    IT("holds publish_batch() items until their turn rather than queueing them");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    client.set_rate_limit(50, 1);
+
+    mqtt_batch_item_t items[] = {
+        { "topic", (const uint8_t *) "1", 1, 0 },
+        { "topic", (const uint8_t *) "2", 1, 0 },
+        { "topic", (const uint8_t *) "3", 1, 0 },
+        { "topic", (const uint8_t *) "4", 1, 0 },
+    };
+    size_t before = shimClient.received();
+    unsigned long start = millis();
+    IS_EQUAL(client.publish_batch(items, 4), 4);
+    unsigned long elapsed = millis() - start;
+
+    // Written by the time it returns, the last one 60 ms after the first
+    IS_EQUAL(shimClient.received() - before, 4 * 10);
+    IS_TRUE(elapsed >= 60);
+    IS_TRUE(elapsed < 250);
+    END_IT
+}
+
+int test_prefix() {
+    IT("applies a prefix limit only to topics under it");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    IS_TRUE(client.set_rate_limit("slow/", 20, 1));
+
+    unsigned long start = millis();
+    for (int i = 0; i < 5; i++)
+        IS_TRUE(client.publish("fast", "x"));
+    IS_TRUE(millis() - start < 20);
+
+    // The second goes to the TX queue, waiting its 50 ms there
+    IS_TRUE(client.publish("slow/a", "x"));
+    IS_TRUE(client.publish("slow/a", "y"));
+    unsigned long wait = client.next_timeout();
+    IS_TRUE(wait > 30 && wait <= 50);
+    IS_TRUE(client.set_rate_limit("slow/", 0));
+    END_IT
+}
+
+int test_queue_release() {
+    IT("releases queued QoS 0 publishes at the rate as loop() runs");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    client.set_rate_limit(100, 1);
+
+    // Each is 10 bytes on the wire
+    size_t before = shimClient.received();
+    for (int i = 0; i < 5; i++)
+        IS_TRUE(client.publish("topic", "x"));
+    IS_EQUAL(shimClient.received() - before, 10);
+
+    unsigned long start = millis();
+    while (shimClient.received() - before < 5 * 10 && millis() - start < 500) {
+        client.loop();
+        delay(1);
+    }
+    unsigned long elapsed = millis() - start;
+    IS_EQUAL(shimClient.received() - before, 5 * 10);
+    IS_TRUE(elapsed >= 35);
+    IS_TRUE(elapsed < 250);
+    END_IT
+}
+
+int test_coalesce() {
+    IT("sends only the latest of the held-back publishes to a topic with set_rate_coalesce()");
+    ShimClient shimClient;
+    PubSubClient client(server, 1883);
+    connect(client, shimClient);
+    client.set_rate_limit(20, 1).set_rate_coalesce();
+
+    byte first[] = { 0x30, 0x08, 0x00, 0x05, 't', 'o', 'p', 'i', 'c', '1' };
+    byte last[] = { 0x30, 0x08, 0x00, 0x05, 't', 'o', 'p', 'i', 'c', '4' };
+    shimClient.expect(first, sizeof(first));
+    shimClient.expect(last, sizeof(last));
+
+    IS_TRUE(client.publish("topic", "1"));
+    IS_TRUE(client.publish("topic", "2"));
+    IS_TRUE(client.publish("topic", "3"));
+    IS_TRUE(client.publish("topic", "4"));
+    delay(60);
+    IS_TRUE(client.loop());
+
+    IS_EQUAL(client.coalesced(), 2);
+    IS_FALSE(shimClient.error());
+    END_IT
+}
+
+
+int main()
+{
+    test_steady_rate();
+    test_burst();
+    test_clock_wrap();
+    test_blocking();
+    test_prefix();
+    test_queue_release();
+    test_coalesce();
+
+    FINISH
+}
@@ -0,0 +1,143 @@
+#include "PubSubClient.h"
+#include "ShimClient.h"
+#include "Buffer.h"
+#include "BDDTest.h"
+#include "trace.h"
+
+#include <string>
+#include <vector>
+
+
+IPAddress server(172, 16, 0, 2);
+
+// Each publish below is this long on the wire
+#define PUBLISH_LEN 10
+
+ShimClient *shim;
+PubSubClient *client;
+std::vector<std::string> seen;
+std::vector<int> unread;
+
+void callback(const MQTT::Publish &pub, void *data) {
+    seen.push_back(std::string(pub.topic(), pub.topic_len()));
+    unread.push_back(shim->available());
+}
+
+void connect(PubSubClient &c, ShimClient &shimClient) {
+    WiFiClient::use(&shimClient);
+    byte connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    shimClient.respond(connack,4);
+    c.connect("client_test1");
+    c.set_callback(callback);
+    shim = &shimClient;
+    client = &c;
+    seen.clear();
+    unread.clear();
+}
+
+// A QoS 0 publish of "pay" to topic, a single letter
+void respond_publish(ShimClient &shimClient, char topic) {
+    byte publish[] = { 0x30, 0x08, 0x00, 0x01, (byte) topic, 'p', 'a', 'y', 'l', 'd' };
+    shimClient.respond(publish, PUBLISH_LEN);
+}
+
+int test_high_water() {
+    IT("stops reading once set_rx_high_water() publishes are waiting");
+    ShimClient shimClient;
+    PubSubClient c(server, 1883);
+    connect(c, shimClient);
+    c.set_rx_high_water(2);
+
+    for (char t = 'a'; t < 'f'; t++)
+        respond_publish(shimClient, t);
+    while (c.loop(0) > 0) { }
+
+    // Two read ahead of the first callback, then one more each time one is handed over
+    IS_EQUAL(seen.size(), 5);
+    IS_EQUAL(unread[0], 3 * PUBLISH_LEN);
+    IS_EQUAL(unread[1], 2 * PUBLISH_LEN);
+    IS_EQUAL(unread[4], 0);
+    IS_TRUE(seen[0] == "a" && seen[4] == "e");
+    END_IT
+}
+
+int test_budget() {
+    IT("reports more to do from loop(budget) while publishes are left unread");
+    ShimClient shimClient;
+    PubSubClient c(server, 1883);
+    connect(c, shimClient);
+    c.set_rx_high_water(1);
+
+    for (char t = 'a'; t < 'd'; t++)
+        respond_publish(shimClient, t);
+
+    // A budget of 0 still hands over one publish a call
+    IS_EQUAL(c.loop(0), 1);
+    IS_EQUAL(seen.size(), 1);
+    IS_EQUAL(unread[0], 2 * PUBLISH_LEN);
+    IS_EQUAL(c.loop(0), 1);
+    IS_EQUAL(c.loop(0), 0);
+    IS_EQUAL(seen.size(), 3);
+    IS_EQUAL(c.next_timeout() > 0, true);
+    END_IT
+}
+
+int test_readable() {
+    IT("drains everything from on_readable(), still reading no further ahead than the mark");
+    ShimClient shimClient;
+    PubSubClient c(server, 1883);
+    connect(c, shimClient);
+    c.set_rx_high_water(1);
+
+    for (char t = 'a'; t < 'e'; t++)
+        respond_publish(shimClient, t);
+    IS_EQUAL(c.on_readable(), 0);
+    IS_EQUAL(seen.size(), 4);
+    IS_EQUAL(unread[0], 3 * PUBLISH_LEN);
+    IS_EQUAL(unread[3], 0);
+    END_IT
+}
+
+void waiting_callback(const MQTT::Publish &pub, void *data) {
+    callback(pub, data);
+    if (pub.topic()[0] != 'a')
+        return;
+
+    // Waits for its PUBACK, reading the publishes ahead of it into the free slots
+    MQTT::Publish reply("r", "x");
+    reply.set_qos(1, client->next_packet_id());
+    client->publish(reply);
+}
+
+int test_waiting_callback() {
+    IT("queues publishes that arrive while a callback waits for its PUBACK, in order");
+    ShimClient shimClient;
+    PubSubClient c(server, 1883);
+    connect(c, shimClient);
+    c.set_callback(waiting_callback);
+
+    respond_publish(shimClient, 'a');
+    respond_publish(shimClient, 'b');
+    respond_publish(shimClient, 'c');
+    // The reply takes packet id 2
+    byte puback[] = { 0x40, 0x02, 0x00, 0x02 };
+    shimClient.respond(puback, 4);
+
+    IS_TRUE(c.loop());
+    IS_TRUE(c.loop());
+    IS_EQUAL(seen.size(), 3);
+    IS_TRUE(seen[0] == "a" && seen[1] == "b" && seen[2] == "c");
+    IS_TRUE(c.connected());
+    END_IT
+}
+
+
+int main()
+{
+    test_high_water();
+    test_budget();
+    test_readable();
+    test_waiting_callback();
+
+    FINISH
+}